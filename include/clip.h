@@ -19,20 +19,18 @@
 #include "net.h"
 
 
-#define CLIP_UPDATER_FD_COUNT 8
 extern int clipMonitorFd;
 extern struct sockaddr_un clipMonitorAddr;
 extern pid_t clipMonitorPid[2];
 
 /* check if wl-clipboard is even present */
 bool clipHaveWlClipboard(void);
-/* spawn wl-paste monitor processes */
+/* spawn wl-paste monitor processes; updates they send are read from the
+ * event loop */
 bool clipSetupSockets(void);
 bool clipSpawnMonitors(void);
 /* convert a file descriptor to a clipboard ID */
 enum uSynergyClipboardId clipIdFromFd(int fd);
-/* process poll data */
-void clipMonitorPollProc(struct pollfd *pfd);
 /* run wl-copy, with given data */
 bool clipWlCopy(enum uSynergyClipboardId id, const unsigned char *data, size_t len);
 /* write all of stdin to the clipboard monitor FIFO */
@@ -0,0 +1,20 @@
+#pragma once
+/* control socket -- line-based commands to adjust a running instance
+ *
+ * Each request is a single line; the reply is zero or more lines of output,
+ * terminated by a line reading either "ok" or "error: <reason>" */
+
+#include <stdbool.h>
+#include "net.h"
+#include "wayland.h"
+
+#define CTL_LINE_MAX 256
+/* most reply output held for a client that isn't reading it */
+#define CTL_PENDING_MAX (1024 * 1024)
+
+extern int ctlFd;
+
+/* set up the listening socket, if enabled in the configuration, serving
+ * clients from the event loop; anything touching the wayland context goes
+ * through injectCall() */
+bool ctlInit(struct synNetContext *snet_ctx);
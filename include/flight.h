@@ -0,0 +1,78 @@
+#pragma once
+/* flight recorder -- a fixed-size ring of the most recent protocol and input
+ * events, cheap enough to be always on, so stuck keys and frozen pointers
+ * can be diagnosed after the fact without debug logs */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "os.h"
+
+/* must be a power of two */
+#define FLIGHT_RING_SIZE 4096
+#define FLIGHT_MAGIC "WFR1"
+
+enum flightType {
+	FLIGHT_NONE = 0,
+	FLIGHT_PKT, /* packet received from the server */
+	FLIGHT_INPUT, /* call into the input backend */
+	FLIGHT_FLUSH, /* wayland display flush */
+	FLIGHT_CONN, /* connection state change */
+};
+
+struct flightEvent {
+	uint64_t ns; /* CLOCK_MONOTONIC */
+	uint8_t type;
+	char tag[4]; /* FourCC, or backend call name */
+	int32_t arg[3];
+};
+
+/* dump file layout: header, followed by FLIGHT_RING_SIZE raw events in ring
+ * order; the oldest event is at head % FLIGHT_RING_SIZE once the ring has
+ * wrapped. Native byte order, as it is meant to be read on the same machine */
+struct flightHeader {
+	char magic[4];
+	uint32_t size;
+	uint32_t event_size;
+	uint32_t pid;
+	uint64_t head;
+};
+
+struct flightRing {
+	uint64_t head;
+	struct flightEvent ev[FLIGHT_RING_SIZE];
+};
+extern struct flightRing flightRing;
+/* the calling thread's most recent event, as packets are parsed on one
+ * thread and injected on another with inject/thread */
+extern _Thread_local struct flightEvent *flightLast;
+
+static inline void flightRecord(enum flightType type, const char *tag, int32_t a, int32_t b, int32_t c)
+{
+	uint64_t head = __atomic_fetch_add(&flightRing.head, 1, __ATOMIC_RELAXED);
+	struct flightEvent *ev = flightLast = flightRing.ev + (head & (FLIGHT_RING_SIZE - 1));
+
+	ev->ns = osGetMonoNs();
+	ev->type = type;
+	memcpy(ev->tag, tag, sizeof(ev->tag));
+	ev->arg[0] = a;
+	ev->arg[1] = b;
+	ev->arg[2] = c;
+}
+
+/* fill in the arguments of the most recent event, once they are parsed */
+static inline void flightAmend(int32_t a, int32_t b, int32_t c)
+{
+	struct flightEvent *ev = flightLast;
+
+	if (!ev)
+		return;
+	ev->arg[0] = a;
+	ev->arg[1] = b;
+	ev->arg[2] = c;
+}
+
+/* write the ring to the given file descriptor */
+bool flightDump(int fd);
+/* write the ring to flight/path, or the runtime directory by default */
+bool flightDumpFile(void);
@@ -0,0 +1,51 @@
+#pragma once
+/* injection thread -- optionally hands the Wayland connection to a thread of
+ * its own, fed input events through a lock-free single-producer,
+ * single-consumer ring, so nothing the network thread does (decryption,
+ * clipboard transfers, hooks) holds up injection.
+ *
+ * Everything here is called from the network thread, unless noted otherwise.
+ * Without the thread, the calls go straight through to their wl*
+ * counterparts. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "wayland.h"
+#include "sig.h"
+
+/* must be a power of two */
+#define INJECT_RING_SIZE 1024
+
+/* start injecting on another thread if threaded is set; the context must not
+ * be touched by the caller afterwards, other than through the functions
+ * below. on_geometry is called on this thread from the event loop, with output
+ * size changes seen on the injection thread */
+bool injectStart(struct wlContext *ctx, bool threaded, void (*on_geometry)(int width, int height));
+/* finish what has been queued and stop the thread, so the context can be
+ * used directly again; safe to call more than once */
+void injectStop(void);
+/* on the injection thread, stop it and have the network thread exit or
+ * restart with the given status in its place, without returning; does
+ * nothing anywhere else */
+void injectExit(enum sigExitStatus status, bool restart);
+/* whether the injection thread is running, and so owns the context */
+bool injectThreaded(void);
+
+void injectKey(int key, int id, int state);
+void injectKeyPrepare(int id);
+void injectKeyReleaseAll(void);
+void injectMouseButton(int button, int state);
+void injectMouseMotion(int x, int y);
+void injectMouseRelativeMotion(int dx, int dy);
+void injectMouseWheel(int dx, int dy);
+void injectIdleInhibit(bool on);
+/* run fn on the thread owning the context, and wait for its result */
+bool injectCall(bool (*fn)(struct wlContext *ctx, void *arg), void *arg);
+
+/* called when the outputs change size; false if the caller is the network
+ * thread and should deal with it, otherwise it is passed on to it */
+bool injectGeometry(int width, int height);
+/* deliver any geometry change, or exit if the injection thread stopped on a
+ * fatal error; the event loop does this as they come in, but it may be called
+ * at any time */
+void injectPollProc(void);
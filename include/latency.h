@@ -0,0 +1,111 @@
+#pragma once
+/* end-to-end input latency instrumentation
+ *
+ * Timestamps are taken as an event passes through each stage, and the spans
+ * between them are fed into log-linear (HDR-style) histograms per event
+ * class, so it is possible to tell whether time is spent in the network,
+ * parsing, or the compositor socket. */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "os.h"
+
+enum latencyClass {
+	LATENCY_KEY,
+	LATENCY_BUTTON,
+	LATENCY_MOTION,
+	LATENCY_WHEEL,
+	LATENCY_CLASS__COUNT
+};
+
+enum latencyStage {
+	LATENCY_STAGE_READY, /* socket became readable */
+	LATENCY_STAGE_PARSE, /* packets parsed into a batch of events */
+	LATENCY_STAGE_DISPATCH, /* handed to the input backend */
+	LATENCY_STAGE_FLUSH, /* display flush completed */
+	LATENCY_STAGE__COUNT
+};
+
+/* spans measured; each ends at the stage of the same index */
+enum latencySpan {
+	LATENCY_SPAN_TOTAL, /* ready -> flush */
+	LATENCY_SPAN_NET, /* ready -> parse: read, decryption */
+	LATENCY_SPAN_PARSE, /* parse -> dispatch: parsing and mapping */
+	LATENCY_SPAN_FLUSH, /* dispatch -> flush: backend and compositor socket */
+	LATENCY_SPAN__COUNT
+};
+
+/* sub-bucket precision (2^5 -> ~3%), up to 2^36 ns */
+#define LATENCY_SUB_BITS 5
+#define LATENCY_MAX_SHIFT 31
+#define LATENCY_BUCKETS ((LATENCY_MAX_SHIFT + 2) << LATENCY_SUB_BITS)
+/* arrivals further apart than this aren't a stream of events */
+#define LATENCY_SPACING_MAX 20000000
+
+struct latencyHist {
+	uint64_t count;
+	uint64_t max;
+	uint32_t bucket[LATENCY_BUCKETS];
+};
+
+/* what is in flight, kept per thread, since with inject/thread events are
+ * parsed on one and injected on another */
+struct latencyState {
+	uint64_t ts[LATENCY_STAGE__COUNT];
+	int class; /* -1 if nothing is in flight */
+	/* when the data being dispatched was received, when the data before
+	 * it was, and the usual spacing of events from the server */
+	uint64_t arrival;
+	uint64_t arrival_prev;
+	uint64_t spacing;
+	/* events stamped since the data arrived, the stamp of the first of
+	 * them, and the last stamp handed out */
+	int events;
+	uint64_t first;
+	uint64_t last;
+	/* what injected events are stamped with, or 0 for the current time */
+	uint64_t event_time;
+};
+extern _Thread_local struct latencyState latencyState;
+
+/* what has been measured, only ever added to by the injecting thread */
+struct latencyStats {
+	struct latencyHist hist[LATENCY_CLASS__COUNT][LATENCY_SPAN__COUNT];
+	/* startup: when it began, when the last phase ended, and when the
+	 * first event was injected */
+	uint64_t start;
+	uint64_t phase;
+	uint64_t first_event;
+};
+extern struct latencyStats latencyStats;
+
+static inline void latencyMark(enum latencyStage stage)
+{
+	latencyState.ts[stage] = osGetMonoNs();
+}
+
+/* an event of the given class is about to be handed to the backend; only
+ * counts if it was actually parsed from a packet */
+static inline void latencyDispatch(enum latencyClass class)
+{
+	if (!latencyState.ts[LATENCY_STAGE_PARSE])
+		return;
+	latencyState.class = class;
+	latencyMark(LATENCY_STAGE_DISPATCH);
+}
+
+/* the backend has returned; record everything in flight */
+void latencyDone(void);
+/* data was received from the server at a given monotonic time */
+void latencyArrival(uint64_t ns);
+/* stamp event i of a batch of count, spreading everything from one arrival
+ * back over the time since the previous one by the usual spacing, since
+ * that's roughly how the server sent them if they were held up along the
+ * way. Stamps never go backwards, even across batches. */
+void latencyEventTime(int i, int count);
+/* startup timing: begin, then mark the end of each phase, logging how long
+ * it took. The first injected event is logged the same way. */
+void latencyStartup(void);
+void latencyPhase(const char *name);
+/* log percentiles for each class */
+void latencyDump(void);
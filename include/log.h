@@ -21,6 +21,8 @@ enum logLevel {
 enum logLevel logLevelFromString(const char *s);
 
 bool logInit(enum logLevel level, char *path);
+/* change the level at runtime */
+void logSetLevel(enum logLevel level);
 void logOutV(enum logLevel level, const char *fmt, va_list ap);
 void logOut(enum logLevel level, const char *fmt, ...);
 /* standard log functions */
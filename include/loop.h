@@ -0,0 +1,32 @@
+#pragma once
+/* event loop -- file descriptors are registered along with a function to
+ * call when they become ready, and only those that are get called. Backed by
+ * epoll, which the BSDs have through epoll-shim.
+ *
+ * Events are as for poll(2). Remove a descriptor before closing it. */
+
+#include <stdbool.h>
+#include <poll.h>
+
+/* most we handle per wakeup; anything beyond is left for the next */
+#define LOOP_EVENTS_MAX 32
+
+/* server input goes first, so nothing else that is ready can delay it */
+enum loopPrio {
+	LOOP_PRIO_INPUT,
+	LOOP_PRIO_NORMAL,
+	LOOP_PRIO__COUNT
+};
+
+typedef void (*loopProc)(int fd, short revents, void *data);
+
+bool loopAdd(int fd, short events, enum loopPrio prio, loopProc proc, void *data);
+/* change the events waited for on a descriptor already added */
+bool loopModify(int fd, short events);
+void loopRemove(int fd);
+/* wait up to timeout ms, or forever if negative, and call whatever is ready;
+ * returns how many were, 0 on timeout or -1 on error (such as EINTR) */
+int loopWait(int timeout);
+/* call nothing more for this wakeup, as after a disconnect; whatever else was
+ * ready will still be next time */
+void loopBreak(void);
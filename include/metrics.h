@@ -0,0 +1,114 @@
+#pragma once
+/* counters and gauges, served in the Prometheus text exposition format over a
+ * unix socket in the runtime directory */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <poll.h>
+#include "uSynergy.h"
+#include "os.h"
+
+enum metricsHook {
+	METRICS_HOOK_SCREENSAVER_START,
+	METRICS_HOOK_SCREENSAVER_STOP,
+	METRICS_HOOK_SCREEN_ENTER,
+	METRICS_HOOK_SCREEN_EXIT,
+	METRICS_HOOK__COUNT
+};
+
+/* packet types we bother counting individually; anything else is "other" */
+#define METRICS_PKT_TYPES \
+	"QINF", "CIAK", "CROP", "CINN", "COUT", "CSEC", "DMDN", "DMUP", \
+	"DMMV", "DMRM", "DMWM", "DKDN", "DKRP", "DKUP", "DGBT", "DGST", \
+	"DSOP", "CALV", "CCLP", "DCLP", "CBYE", "EBAD", "EBSY", "CNOP"
+#define METRICS_PKT_COUNT 24
+
+/* socket options applied on connect, named as in the net/ config section */
+enum metricsSockopt {
+	METRICS_SOCKOPT_NODELAY,
+	METRICS_SOCKOPT_QUICKACK,
+	METRICS_SOCKOPT_PRIORITY,
+	METRICS_SOCKOPT_TOS,
+	METRICS_SOCKOPT_RCVBUF,
+	METRICS_SOCKOPT_SNDBUF,
+	METRICS_SOCKOPT_BUSY_POLL,
+	METRICS_SOCKOPT__COUNT
+};
+#define METRICS_SOCKOPT_NAMES \
+	"nodelay", "quickack", "priority", "tos", "rcvbuf", "sndbuf", "busy_poll"
+
+struct metrics {
+	uint64_t pkt[METRICS_PKT_COUNT + 1];
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t disconnects[USYNERGY_ERROR__COUNT];
+	uint64_t keepalives;
+	uint64_t keepalive_last_ns;
+	uint64_t keepalive_interval_ns;
+	uint64_t keepalive_rtt_ns;
+	uint64_t keepalives_missed;
+	uint64_t clip_bytes_in;
+	uint64_t clip_bytes_out;
+	uint64_t wl_flushes;
+	uint64_t wl_flushes_blocked;
+	uint64_t hook_runs[METRICS_HOOK__COUNT];
+	uint64_t hook_ns[METRICS_HOOK__COUNT];
+	/* effective values as read back, or -1 if left at the default */
+	int64_t sockopt[METRICS_SOCKOPT__COUNT];
+	/* motion jitter buffer */
+	uint64_t motion_buffered;
+	uint64_t motion_merged;
+	uint64_t motion_emitted;
+	uint64_t motion_held_ns;
+	uint64_t motion_jitter_ns;
+	uint64_t motion_delay_ns;
+	/* injection thread; this and the above, along with the display
+	 * flushes, go through metricsAdd() and friends */
+	uint64_t inject_events;
+	uint64_t inject_drains;
+	uint64_t inject_full;
+};
+extern struct metrics metrics;
+extern const char *metricsSockoptName[METRICS_SOCKOPT__COUNT];
+extern int metricsFd;
+
+/* for counters the injection thread updates while the network thread may be
+ * formatting them, as with inject/thread */
+static inline void metricsAdd(uint64_t *counter, uint64_t n)
+{
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+static inline void metricsSet(uint64_t *gauge, uint64_t v)
+{
+	__atomic_store_n(gauge, v, __ATOMIC_RELAXED);
+}
+static inline uint64_t metricsGet(const uint64_t *value)
+{
+	return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+/* count a received packet */
+void metricsPacket(const char *pkt_id);
+
+static inline void metricsKeepalive(void)
+{
+	uint64_t now = osGetMonoNs();
+
+	if (metrics.keepalive_last_ns)
+		metrics.keepalive_interval_ns = now - metrics.keepalive_last_ns;
+	metrics.keepalive_last_ns = now;
+	++metrics.keepalives;
+}
+static inline void metricsHook(enum metricsHook hook, uint64_t start_ns)
+{
+	++metrics.hook_runs[hook];
+	metrics.hook_ns[hook] += osGetMonoNs() - start_ns;
+}
+
+/* format the current values, returning a buffer that stays valid until the
+ * next call */
+const char *metricsFormat(size_t *len);
+/* set up the listening socket, if enabled in the configuration, serving
+ * scrapes from the event loop */
+bool metricsInit(uSynergyContext *syn_ctx);
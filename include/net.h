@@ -22,33 +22,59 @@
 #include <sys/un.h>
 
 
-#define CLIP_UPDATER_FD_COUNT 8
 extern int clipMonitorFd;
 extern struct sockaddr_un clipMonitorAddr;
 extern pid_t clipMonitorPid[2];
 
-enum net_pollfd_id {
-	POLLFD_SYN,
-	POLLFD_WL,
-	POLLFD_CLIP_MON,
-	POLLFD_CLIP_UPDATER,
-	POLLFD_COUNT = POLLFD_CLIP_UPDATER + CLIP_UPDATER_FD_COUNT
+enum synNetTransport {
+	SYN_NET_TCP,
+	SYN_NET_UNIX,
+	SYN_NET_VSOCK,
 };
-#define POLLFD_COUNT POLLFD_CLIP_UPDATER + CLIP_UPDATER_FD_COUNT
-extern struct pollfd netPollFd[POLLFD_COUNT];
 
 struct synNetContext {
 	uSynergyContext *syn_ctx;
+	/* transport, chosen by the form of the host */
+	enum synNetTransport transport;
+	/* server address, for display */
+	char *url;
 	bool tls;
 	bool tls_tofu;
 	struct tls *tls_ctx;
 	char *tls_hash;
+	/* name certificate hashes are stored under */
+	char *tls_name;
+	/* host name, socket path or CID, depending on transport */
 	char *host;
+	/* NULL if the transport has no such thing */
 	char *port;
 	int fd;
+	/* transport functions -- open and connect fd */
+	bool (*connect)(struct synNetContext *);
+	/* optional, called as each heartbeat is answered */
+	void (*heartbeat)(struct synNetContext *);
+	/* heartbeat period the socket options were last tuned for */
+	uint32_t keepalive_rate;
+	/* TCP_QUICKACK is not sticky, so must be set again after reads */
+	bool quickack;
+	/* when the kernel received what was last read, in monotonic ns */
+	uint64_t rx_time;
+	/* fd is registered with the event loop */
+	bool in_loop;
 };
+extern bool synNetInitTcp(struct synNetContext *snet_ctx);
+extern bool synNetInitUnix(struct synNetContext *snet_ctx);
+extern bool synNetInitVsock(struct synNetContext *snet_ctx);
+
+/* host may be a plain host name, or a URL of the form
+ * tcp://HOST[:PORT], unix://PATH or vsock://CID[:PORT] */
 bool synNetInit(struct synNetContext *net_ctx, uSynergyContext *syn_ctx, const char *host, const char *port, bool tls, bool tofu);
-void netPollInit(void);
+/* register the display with the event loop, unless the injection thread
+ * looks after it */
+void netPollInit(struct wlContext *wl_ctx);
 void netPoll(struct synNetContext *snet_ctx, struct wlContext *wl_ctx);
 bool synNetDisconnect(struct synNetContext *snet_ctx);
+/* make the first connection in another thread, so that it overlaps with the
+ * rest of startup; the first connection attempt then waits on it */
+bool synNetConnectEarly(struct synNetContext *snet_ctx);
 
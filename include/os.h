@@ -2,11 +2,15 @@
 #include <stdbool.h>
 #include <sys/mman.h>
 #include <sys/types.h>
+#include <stdint.h>
+#include <time.h>
 
 extern char *osConfigPathOverride;
 extern int osGetAnonFd(void);
 extern char *osGetRuntimePath(char *name);
 extern char *osGetHomeConfigPath(char *name);
+/* check for an executable in PATH, as posix_spawnp() would find it */
+extern bool osFindExec(const char *name);
 /* check if a file exists */
 extern bool osFileExists(const char *path);
 /* create parents of a given path if they don't already exist */
@@ -15,3 +19,11 @@ extern bool osMakeParentDir(const char *path, mode_t mode);
 extern void osDropPriv(void);
 /* determine the name of the other end of a socket */
 extern char *osGetPeerProcName(int fd);
+
+/* monotonic time in nanoseconds, for cheap event timestamps */
+static inline uint64_t osGetMonoNs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -0,0 +1,27 @@
+#pragma once
+/* output to clients of the local sockets (metrics scrapes, control replies)
+ *
+ * Whatever the socket won't take straight away is kept here, to be written
+ * out once it becomes writable again, so a slow reader never blocks us. The
+ * output itself is best built up with ssb. */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "ssb.h"
+
+struct outBuf {
+	struct ssb pending;
+	size_t sent;
+};
+
+/* send data, keeping what doesn't fit for later; false if the client is gone */
+bool outBufSend(struct outBuf *out, int fd, const char *data, size_t len);
+/* try again with what is left; false if the client is gone */
+bool outBufFlush(struct outBuf *out, int fd);
+void outBufFree(struct outBuf *out);
+
+/* bytes still waiting to be written */
+static inline size_t outBufPending(const struct outBuf *out)
+{
+	return out->pending.pos - out->sent;
+}
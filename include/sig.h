@@ -6,6 +6,8 @@
 #include "wayland.h"
 #include "log.h"
 #include "net.h"
+#include "flight.h"
+#include "latency.h"
 
 
 enum sigExitStatus {
@@ -17,6 +19,7 @@ enum sigExitStatus {
 
 extern volatile sig_atomic_t sigDoExit;
 extern volatile sig_atomic_t sigDoRestart;
+extern volatile sig_atomic_t sigDoDump;
 void Exit(enum sigExitStatus status);
 void Restart(enum sigExitStatus status);
 /* exit or restart, for situations like wayland protocol errors beyond our
@@ -28,7 +31,7 @@ void sigWaitSIGCHLD(bool state);
 
 static inline bool sigHandleCheck(void)
 {
-	return sigDoExit || sigDoRestart;
+	return sigDoExit || sigDoRestart || sigDoDump;
 }
 static inline void sigHandleRun(void)
 {
@@ -40,4 +43,10 @@ static inline void sigHandleRun(void)
 		logInfo("Restart signal %s received, restarting...", strsignal(sigDoRestart));
 		Restart(SES_SUCCESS);
 	}
+	if (sigDoDump) {
+		sigDoDump = 0;
+		logInfo("Dump signal received");
+		flightDumpFile();
+		latencyDump();
+	}
 }
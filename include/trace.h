@@ -0,0 +1,46 @@
+#pragma once
+/* protocol traces -- every decrypted chunk received from the server, with
+ * its timing, so a session can later be replayed without a server, to
+ * reproduce a problem exactly or to measure parsing and injection cost */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "uSynergy.h"
+
+#define TRACE_MAGIC "WTR1"
+
+/* file layout: header, followed by records, each followed by len bytes of
+ * data. A record with no data marks a new connection. Native byte order, as
+ * it is meant to be read on the same machine */
+struct traceHeader {
+	char magic[4];
+	uint32_t record_size;
+};
+
+struct traceRecord {
+	uint32_t us; /* since the previous record, saturating */
+	uint32_t len;
+};
+
+extern int traceFd;
+
+/* start recording to the given path */
+bool traceRecordOpen(const char *path);
+/* append a record */
+void traceRecordWrite(const void *buf, size_t len);
+
+static inline void traceRecordConnect(void)
+{
+	if (traceFd != -1)
+		traceRecordWrite(NULL, 0);
+}
+static inline void traceRecordRecv(const void *buf, size_t len)
+{
+	if (traceFd != -1 && len)
+		traceRecordWrite(buf, len);
+}
+
+/* feed a trace through the context and its callbacks, at the original timing
+ * or as fast as possible, returning once it has all been processed */
+bool traceReplay(uSynergyContext *context, const char *path, bool fast);
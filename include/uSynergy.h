@@ -101,10 +101,14 @@ enum uSynergyClipboardFormat
 #define				USYNERGY_PROTOCOL_MINOR			6				/* Minor protocol version */
 
 #define				USYNERGY_IDLE_TIMEOUT			10000			/* Timeout in milliseconds before reconnecting */
+#define				USYNERGY_KEEPALIVE_RATE			3000			/* Default heartbeat period in milliseconds, until the server says otherwise */
+#define				USYNERGY_KEEPALIVE_MISSES		2				/* Default number of heartbeats missed before reconnecting */
 
 #define				USYNERGY_TRACE_BUFFER_SIZE		1024			/* Maximum length of traced message */
 #define				USYNERGY_REPLY_BUFFER_SIZE		1024			/* Maximum size of a reply packet */
 #define				USYNERGY_RECEIVE_BUFFER_SIZE	0xFFFF			/* Maximum size of an incoming packet */
+#define				USYNERGY_BATCH_SIZE				64				/* Maximum number of events returned by one uSynergyFeed() */
+#define				USYNERGY_BATCH_RESERVE			4				/* Most events a single packet can produce */
 
 
 
@@ -314,6 +318,94 @@ typedef void		(*uSynergyClipboardCallback)(uSynergyCookie cookie, enum uSynergyC
 #define SYN_DATA_CHUNK 2
 #define SYN_DATA_END 3
 
+//---------------------------------------------------------------------------------------------------------------------
+//	Events
+//---------------------------------------------------------------------------------------------------------------------
+
+
+
+/**
+@brief Event types, one for each of the callbacks
+**/
+enum uSynergyEventType {
+	USYNERGY_EVENT_SCREEN_ACTIVE,
+	USYNERGY_EVENT_SCREENSAVER,
+	USYNERGY_EVENT_MOUSE_MOVE,
+	USYNERGY_EVENT_MOUSE_BUTTON,
+	USYNERGY_EVENT_MOUSE_WHEEL,
+	USYNERGY_EVENT_KEY,
+	USYNERGY_EVENT_JOYSTICK,
+	USYNERGY_EVENT_CLIPBOARD,
+};
+
+/**
+@brief Event produced by uSynergyFeed()
+
+Fields are as for the corresponding callback. Clipboard data points into the
+context, and is only valid until the next call to uSynergyFeed().
+**/
+struct uSynergyEvent {
+	enum uSynergyEventType type;
+	union {
+		bool active;
+		struct {
+			bool rel;
+			int16_t x;
+			int16_t y;
+		} move;
+		struct {
+			enum uSynergyMouseButton button;
+			bool down;
+		} button;
+		struct {
+			int16_t x;
+			int16_t y;
+		} wheel;
+		struct {
+			uint16_t key;
+			uint16_t id;
+			uint16_t modifiers;
+			bool down;
+			bool repeat;
+		} key;
+		struct {
+			uint8_t num;
+			uint16_t buttons;
+			int8_t sticks[4];
+		} joystick;
+		struct {
+			enum uSynergyClipboardId id;
+			enum uSynergyClipboardFormat format;
+			const uint8_t *data;
+			uint32_t size;
+		} clipboard;
+	};
+};
+
+/**
+@brief Batch of events produced by uSynergyFeed()
+**/
+struct uSynergyBatch {
+	struct uSynergyEvent ev[USYNERGY_BATCH_SIZE];
+	int count;
+	bool more; /* the batch filled up with complete packets still buffered */
+};
+
+
+
+/**
+@brief Batch callback
+
+Called with each batch before its events are passed on to the other callbacks,
+for anything that is cheaper done once for the lot.
+
+@param cookie		Cookie supplied in the Synergy context
+@param batch		Events about to be dispatched
+**/
+typedef void		(*uSynergyBatchCallback)(uSynergyCookie cookie, const struct uSynergyBatch *batch);
+
+
+
 //---------------------------------------------------------------------------------------------------------------------
 //	Context
 //---------------------------------------------------------------------------------------------------------------------
@@ -325,7 +417,8 @@ typedef void		(*uSynergyClipboardCallback)(uSynergyCookie cookie, enum uSynergyC
 **/
 typedef struct uSynergyContext
 {
-	/* Mandatory configuration data, filled in by client */
+	/* Mandatory configuration data, filled in by client -- the I/O
+	 * functions are only used by uSynergyUpdate() */
 	uSynergyConnectFunc				m_connectFunc;									/* Connect function */
 	uSynergySendFunc				m_sendFunc;										/* Send data function */
 	uSynergyReceiveFunc				m_receiveFunc;									/* Receive data function */
@@ -337,6 +430,7 @@ typedef struct uSynergyContext
 
 	/* Optional configuration data, filled in by client */
 	bool 					m_useRawKeyCodes; 						/* determine which key codes are sent to events */
+	uint32_t 				m_keepAliveMisses; 						/* heartbeats missed before the server is considered dead */
 	bool 					m_errorIsFatal[USYNERGY_ERROR__COUNT]; 				/* determines whether or not a given error code is fatal (i.e. we just give up rather than reconnect*/
 	uSynergyCookie					m_cookie;										/* Cookie pointer passed to callback functions (can be NULL) */
 	uSynergyScreenActiveCallback	m_screenActiveCallback;							/* Callback for entering and leaving screen */
@@ -348,6 +442,7 @@ typedef struct uSynergyContext
 	uSynergyKeyboardCallback		m_keyboardCallback;								/* Callback for keyboard events */
 	uSynergyJoystickCallback		m_joystickCallback;								/* Callback for joystick events */
 	uSynergyClipboardCallback		m_clipboardCallback;							/* Callback for clipboard events */
+	uSynergyBatchCallback			m_batchCallback;								/* Callback for each batch, before the above */
 
 	/* State data, used internall by client, initialized by uSynergyInit() */
 	enum uSynergyError 						m_lastError; /* last error code which may have triggered a lost connection */
@@ -358,9 +453,16 @@ typedef struct uSynergyContext
 	bool 					m_resChanged; /* whether we've had a screen resolution change or not */
 	bool					m_isCaptured;									/* Is Synergy active (i.e. this client is receiving input messages?) */
 	uint32_t						m_lastMessageTime;								/* Time at which last message was received */
+	uint32_t 						m_keepAliveRate; /* heartbeat period set by the server, in ms, or 0 if disabled */
+	uint32_t 						m_keepAlivesMissed; /* heartbeats missed since the last message */
 	uint32_t						m_sequenceNumber;								/* Packet sequence number */
 	uint8_t							m_receiveBuffer[USYNERGY_RECEIVE_BUFFER_SIZE];	/* Receive buffer */
 	int								m_receiveOfs;									/* Receive buffer offset */
+	uint32_t 						m_receiveSkip; /* bytes left of an oversized packet being discarded */
+	struct uSynergyBatch*			m_batch;										/* Batch being filled by uSynergyFeed() */
+	uint8_t* 						m_sendBuffer; /* Replies waiting to be sent */
+	size_t 							m_sendLen; /* Length of pending replies */
+	size_t 							m_sendSize; /* Allocated size of send buffer */
 	uint8_t							m_replyBuffer[USYNERGY_REPLY_BUFFER_SIZE];		/* Reply buffer */
 	uint8_t*						m_replyCur;										/* Write offset into reply buffer */
 	int8_t							m_joystickSticks[USYNERGY_NUM_JOYSTICKS][4];	/* Joystick stick position in 2 axes for 2 sticks */
@@ -395,18 +497,128 @@ extern void		uSynergyInit(uSynergyContext *context);
 
 
 /**
-@brief Update uSynergy
+@brief Start a connection
+
+Resets protocol state for a newly established connection, and starts the
+heartbeat clock. The server speaks first, so there is nothing to send yet.
+
+@param context	Context to be started
+@param now		Current time in milliseconds, as from m_getTimeFunc
+**/
+extern void		uSynergyStart(uSynergyContext *context, uint32_t now);
+
+
+
+/**
+@brief Mark a connection as lost
+
+@param context	Context to be updated
+@param err		Reason for the disconnection
+**/
+extern void		uSynergyDisconnect(uSynergyContext *context, enum uSynergyError err);
+
+
+
+/**
+@brief Receive space
+
+Returns the free part of the receive buffer; data read directly into it can be
+passed to uSynergyFeed() without being copied.
+
+@param context	Context to be fed
+@param len		Receives the amount of free space
+**/
+extern uint8_t*	uSynergyRecvSpace(uSynergyContext *context, size_t *len);
+
+
+
+/**
+@brief Feed received data
+
+This is the core of the protocol implementation, and does no I/O of its own.
+Data is buffered, and each complete packet is parsed into events in @a batch
+and replies in the output buffer (see uSynergyOutput()). At most
+USYNERGY_BATCH_SIZE events are produced at once; if @a batch->more is set, or
+not all of @a buf was consumed, call again with the remainder (possibly none)
+after handling the batch. A lost connection is reported by m_connected being
+cleared.
+
+@param context	Context to be fed
+@param buf		Received data
+@param len		Length of received data
+@param now		Current time in milliseconds, as from m_getTimeFunc
+@param batch	Receives the events produced
+@returns		Number of bytes consumed from @a buf
+**/
+extern size_t	uSynergyFeed(uSynergyContext *context, const uint8_t *buf, size_t len, uint32_t now, struct uSynergyBatch *batch);
+
+
+
+/**
+@brief Pending output
+
+Returns replies waiting to be sent to the server. These accumulate until
+consumed with uSynergyOutputDone().
+
+@param context	Context to be checked
+@param len		Receives the number of bytes pending
+**/
+extern const uint8_t*	uSynergyOutput(uSynergyContext *context, size_t *len);
+
+
+
+/**
+@brief Consume pending output
+
+@param context	Context to be updated
+@param len		Number of bytes that were sent
+**/
+extern void		uSynergyOutputDone(uSynergyContext *context, size_t len);
+
+
+
+/**
+@brief Heartbeat wait time
+
+Returns the time in milliseconds until the next heartbeat from the server is
+due, for use as a poll timeout. If heartbeats are disabled, the time until
+USYNERGY_IDLE_TIMEOUT passes without hearing from the server is used instead.
+
+@param context	Context to be checked
+@param now		Current time in milliseconds, as from m_getTimeFunc
+**/
+extern int		uSynergyKeepAliveWait(uSynergyContext *context, uint32_t now);
+
+
+
+/**
+@brief Check for missed heartbeats
+
+Call after waiting for uSynergyKeepAliveWait(). Returns false once too many
+heartbeats have been missed (or, with heartbeats disabled, once nothing has
+been heard for USYNERGY_IDLE_TIMEOUT) and the server should be considered dead;
+the caller is then responsible for disconnecting.
+
+@param context	Context to be checked
+@param now		Current time in milliseconds, as from m_getTimeFunc
+**/
+extern bool		uSynergyKeepAliveCheck(uSynergyContext *context, uint32_t now);
 
-This function updates uSynergy and does the bulk of the work. It does connection management,
-receiving data, reconnecting after errors or timeouts and so on. It assumes that networking
-operations are blocking and it can suspend the current thread if it needs to wait. It is
-best practice to call uSynergyUpdate from a background thread so it is responsive.
 
-Because uSynergy relies mostly on blocking calls it will mostly stay in thread sleep state
-waiting for system mutexes and won't eat much memory.
 
-uSynergyUpdate doesn't do any memory allocations or have any side effects beyond those of
-the callbacks it calls.
+//---------------------------------------------------------------------------------------------------------------------
+//	Callback interface
+//---------------------------------------------------------------------------------------------------------------------
+
+
+
+/**
+@brief Update uSynergy
+
+This drives the functions above with the I/O functions and callbacks in the
+context. It does connection management, receiving data, reconnecting after
+errors or timeouts and so on. It assumes that networking operations are
+blocking and it can suspend the current thread if it needs to wait.
 
 @param context	Context to be updated
 **/
@@ -414,11 +626,25 @@ extern void		uSynergyUpdate(uSynergyContext *context);
 
 
 
+/**
+@brief Send pending output
+
+Sends anything queued by the functions below using m_sendFunc. This happens
+automatically within uSynergyUpdate(). Does nothing while disconnected, as
+output still pending is dropped when the connection is lost.
+
+@param context	Context to be flushed
+@returns		false if sending failed, in which case the connection is marked as lost
+**/
+extern bool		uSynergyFlush(uSynergyContext *context);
+
+
+
 /**
 @brief Update clipboard data
 
 This function sets new clipboard data and prepares it to be sent to the server
-on screen deactivation. 
+on screen deactivation. The grab notification is queued as output.
 
 Currently there is only support for plaintext, but HTML and image data could be
 supported with some effort.
@@ -430,10 +656,23 @@ supported with some effort.
 **/
 extern void 		uSynergyUpdateClipBuf(uSynergyContext *context, enum uSynergyClipboardId id, uint32_t len, const char *data);
 
+/**
+@brief Queue clipboard data
+
+Streams already formatted clipboard data (as kept by uSynergyUpdateClipBuf())
+to the server in chunks. This happens on its own on screen deactivation.
+
+@param context		Synergy context
+@param id 		Clipboard the data is for
+@param len 		Length of clipboard data
+@param text		Clipboard data
+**/
+extern void 		uSynergySendClipboard(uSynergyContext *context, int id, uint32_t len, const unsigned char *text);
+
 /**
 @brief Update screen resolution
 
-This will send an update to the server on screen resolution change.
+This will queue an update to the server on screen resolution change.
 
 @param context 		Synergy context
 @param width 		Width in pixels
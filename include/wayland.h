@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <poll.h>
 #include <sys/mman.h>
 #include <xkbcommon/xkbcommon.h>
@@ -31,6 +32,8 @@ struct wlOutput
 	int width;
 	int height;
 	int32_t scale;
+	/* of the current mode, in mHz */
+	int32_t refresh;
 	bool complete;
 	bool have_log_size;
 	bool have_log_pos;
@@ -55,6 +58,23 @@ extern bool wlIdleInitKde(struct wlContext *ctx);
 extern bool wlIdleInitGnome(struct wlContext *ctx);
 
 #define WL_INPUT_BUTTON_COUNT 8
+/* wheel deltas from the server are in these units to a notch */
+#define WL_INPUT_WHEEL_STEP 120
+/* synergy ids are 16 bits, kept in pages by the high byte */
+#define WL_INPUT_ID_PAGE_BITS 8
+#define WL_INPUT_ID_PAGE_SIZE (1 << WL_INPUT_ID_PAGE_BITS)
+#define WL_INPUT_ID_PAGES (0x10000 >> WL_INPUT_ID_PAGE_BITS)
+/* state components that are sent along with keys */
+#define WL_INPUT_MODS_COMPONENTS (XKB_STATE_MODS_DEPRESSED | XKB_STATE_MODS_LATCHED | XKB_STATE_MODS_LOCKED | XKB_STATE_LAYOUT_EFFECTIVE)
+/* id not in the id keymap, so the raw keymap is used */
+#define WL_INPUT_ID_UNMAPPED INT_MIN
+
+/* what an id is typed with: a raw keycode, and the modifiers its level
+ * needs held for the press */
+struct wlIdKey {
+	int key;
+	xkb_mod_mask_t mods;
+};
 
 struct wlInput {
 	/* module-specific state */
@@ -66,16 +86,26 @@ struct wlInput {
 	struct xkb_context *xkb_ctx;
 	struct xkb_keymap *xkb_map;
 	struct xkb_state *xkb_state;
+	/* serialized modifier state, and whether the last key changed it */
+	xkb_mod_mask_t mods_depressed;
+	xkb_mod_mask_t mods_latched;
+	xkb_mod_mask_t mods_locked;
+	xkb_layout_index_t group;
+	bool mods_changed;
 	/* raw keymap -- distinct from xkb */
 	size_t key_count;
 	int *raw_keymap;
-	/* id-based keymap -- uses synergy abstract keycodes */
-	size_t id_count;
-	int *id_keymap;
-	/* whether or not a given id entry should be used */
-	bool *id_keymap_valid;
+	/* id-based keymap -- uses synergy abstract keycodes. Only a handful
+	 * are ever set, so pages without any share a single empty one */
+	struct wlIdKey *id_keymap[WL_INPUT_ID_PAGES];
+	/* whether ids are also mapped from the keymap itself */
+	bool id_auto;
 	/* mouse button map */
 	int button_map[WL_INPUT_BUTTON_COUNT];
+	/* wheel movement short of a whole notch, per axis (0 vertical) */
+	int wheel_rest[2];
+	/* drop mapped input, i.e. everything from the server */
+	bool paused;
 	/* wayland context */
 	struct wlContext *wl_ctx;
 	/* actual functions */
@@ -86,6 +116,16 @@ struct wlInput {
 	void (*key)(struct wlInput *, int, int);
 	bool (*key_map)(struct wlInput *, char *);
 	void (*update_geom)(struct wlInput *);
+	/* optional; called on exit */
+	void (*cleanup)(struct wlInput *);
+	/* optional; find or bind a spare keycode for a keysym the keymap
+	 * lacks, or -1. New bindings only take effect on key_spare_commit(),
+	 * and are never taken back before their key has been pressed */
+	int (*key_spare)(struct wlInput *, xkb_keysym_t sym);
+	void (*key_spare_commit)(struct wlInput *);
+	/* optional; send the mods_* as they are now, ahead of the next key.
+	 * Without it, ids are never mapped to levels that need modifiers */
+	void (*key_mods)(struct wlInput *);
 };
 
 /* uinput must open device fds before privileges are dropped, so this is
@@ -94,6 +134,38 @@ struct wlInput {
 extern bool wlInputInitWlr(struct wlContext *ctx);
 extern bool wlInputInitKde(struct wlContext *ctx);
 extern bool wlInputInitUinput(struct wlContext *ctx);
+/* these two need no compositor, so they are never picked automatically */
+extern bool wlInputInitNull(struct wlContext *ctx);
+extern bool wlInputInitRecord(struct wlContext *ctx);
+
+/* motion held back by the jitter buffer */
+#define WL_MOTION_QUEUE 64
+struct wlMotionSample {
+	uint64_t arrival;
+	uint64_t due;
+	bool rel;
+	int x;
+	int y;
+};
+struct wlMotion {
+	bool enable;
+	/* bounds on the delay, and frames per second * 1000 if overridden */
+	uint64_t min_delay;
+	uint64_t max_delay;
+	int32_t rate;
+	/* estimates, in ns: usual time between arrivals, how much that
+	 * varies, and how long to hold motion because of it */
+	uint64_t last_arrival;
+	uint64_t interval;
+	uint64_t jitter;
+	uint64_t delay;
+	/* when the last motion held is due, and the next frame may go */
+	uint64_t last_due;
+	uint64_t next_tick;
+	struct wlMotionSample queue[WL_MOTION_QUEUE];
+	size_t head;
+	size_t count;
+};
 
 struct wlContext {
 	char *comp_name;
@@ -119,34 +191,48 @@ struct wlContext {
 	struct ext_idle_notifier_v1 *idle_notifier; /* new standard */
 	struct wlIdle idle;
 	//state
+	/* no display connection at all; only the null and record backends
+	 * work like this */
+	bool headless;
 	int width;
 	int height;
-	time_t epoch;
 	long timeout;
+	/* ms to wait for outputs to settle before reporting them, and when
+	 * that will have been, or 0 */
+	long output_debounce;
+	uint64_t output_update_due;
+	struct wlMotion motion;
+	/* while set, flushes are put off until it is cleared, so a run of
+	 * events goes out together; whether one was put off */
+	bool flush_defer;
+	bool flush_pending;
 	//callbacks
 	void (*on_output_update)(struct wlContext *ctx);
 };
 
-/* flush the display with proper error checking */
+/* flush the display with proper error checking, unless flush_defer is set */
 extern void wlDisplayFlush(struct wlContext *ctx);
 
 /* (re)set the keyboard layout according to the configuration
- * probably not useful outside wlSetup*/
+ * any keys still pressed should be released first */
 extern int wlKeySetConfigLayout(struct wlContext *ctx);
 /* load button map */
 extern void wlLoadButtonMap(struct wlContext *ctx);
 /* set up the wayland context */
 extern bool wlSetup(struct wlContext *context, int width, int height, char *backend);
 
-/* obtain a monotonic timestamp */
+/* obtain a monotonic timestamp in ms, for the event being injected */
 extern uint32_t wlTS(struct wlContext *context);
 /* update screen resolution */
 extern void wlResUpdate(struct wlContext *context, int width, int height);
 /* close wayland connection */
 extern void wlClose(struct wlContext *context);
-/* retrieve the wayland connection file descriptor, for polling purposes */
+/* retrieve the wayland connection file descriptor, for polling purposes, or
+ * -1 if headless */
 extern int wlPrepareFd(struct wlContext *context);
-/* process IO indicated by poll() */
+/* shorten a poll() timeout in ms to when deferred work is due */
+extern int wlPollTimeout(struct wlContext *context, int timeout);
+/* process IO indicated by poll(), and any deferred work that is due */
 extern void wlPollProc(struct wlContext *context, short revents);
 
 /* mouse-related functions */
@@ -154,14 +240,32 @@ extern void wlMouseRelativeMotion(struct wlContext *context, int dx, int dy);
 extern void wlMouseMotion(struct wlContext *context, int x, int y);
 extern void wlMouseButton(struct wlContext *context, int button, int state);
 extern void wlMouseWheel(struct wlContext *context, signed short dx, signed short dy);
+/* motion jitter buffer: set up from the configuration, hold motion back if
+ * enabled (false if it should just go), let everything held go now, shorten a
+ * poll timeout to when the next frame is due, and hand on that frame */
+extern void wlMotionInit(struct wlContext *context);
+extern bool wlMotionQueue(struct wlContext *context, bool rel, int x, int y);
+extern void wlMotionFlush(struct wlContext *context);
+extern int wlMotionTimeout(struct wlContext *context, int timeout);
+extern void wlMotionRun(struct wlContext *context);
+/* for backends with only whole wheel notches: add a delta for an axis (0 is
+ * vertical) and return the notches it completes, keeping the rest */
+extern int wlInputWheelSteps(struct wlInput *input, int axis, int delta);
 
 /* keyboard-related functions */
 /* send a raw keycode, no mapping is performed */
 extern void wlKeyRaw(struct wlContext *context, int key, int state);
 /* send a keycode or id, mapping as needed. Prefers the id value. */
 extern void wlKey(struct wlContext *context, int key, int id, int state);
+/* bind a spare keycode ahead of time for an id the keymap lacks, so that a
+ * batch of them needs only one keymap update */
+extern void wlKeyPrepare(struct wlContext *context, int id);
+/* map an id to a raw keycode, or back to WL_INPUT_ID_UNMAPPED */
+extern bool wlKeySetId(struct wlContext *context, int id, int key);
 /* release all currently-pressed keys, usually on exiting the screen */
 extern void wlKeyReleaseAll(struct wlContext *context);
+/* stop or resume passing on mapped key and mouse input */
+extern void wlInputPause(struct wlContext *context, bool paused);
 
 /* enable or disable idle inhibition */
 extern void wlIdleInhibit(struct wlContext *context, bool on);
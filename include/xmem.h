@@ -163,6 +163,80 @@ static void strfreev(char **strv)
 	}
 }
 
+/* XMEM_COUNT: count allocations per call site
+ *
+ * When built with XMEM_COUNT defined, each call of the allocating functions
+ * above gets a static record of how many times it allocated and how many bytes
+ * it asked for, linked into xmemSites the first time it is hit. Calls made
+ * between the functions themselves are not counted twice. Safe to use from
+ * several threads: the counts are atomic, and sites are only ever prepended
+ * to the list, so it may be walked while it grows. Needs GCC or clang. */
+#if defined(XMEM_COUNT)
+struct xmemSite {
+	const char *file;
+	int line;
+	unsigned long count;
+	unsigned long bytes;
+	struct xmemSite *next;
+};
+
+#if defined(__GNUC__)
+__attribute__((weak))
+#endif
+struct xmemSite *xmemSites;
+
+XMEM_UNUSED
+static void xmem_count(struct xmemSite *site, size_t bytes)
+{
+	struct xmemSite *head;
+
+	if (!__atomic_fetch_add(&site->count, 1, __ATOMIC_RELAXED)) {
+		head = __atomic_load_n(&xmemSites, __ATOMIC_RELAXED);
+		do {
+			site->next = head;
+		} while (!__atomic_compare_exchange_n(&xmemSites, &head, site, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+	__atomic_fetch_add(&site->bytes, bytes, __ATOMIC_RELAXED);
+}
+
+#define XMEM_COUNT_SITE(bytes) do { \
+	static struct xmemSite xmem_site_ = { __FILE__, __LINE__ }; \
+	xmem_count(&xmem_site_, (bytes)); \
+} while (0)
+#define XMEM_SITE(bytes, expr) ({ \
+	__typeof__(expr) xmem_ret_ = (expr); \
+	XMEM_COUNT_SITE(bytes); \
+	xmem_ret_; \
+})
+#define xmalloc(len) ({ \
+	size_t xmem_l_ = (len); \
+	XMEM_SITE(xmem_l_, xmalloc(xmem_l_)); \
+})
+#define xcalloc(nmemb, size) ({ \
+	size_t xmem_n_ = (nmemb), xmem_s_ = (size); \
+	XMEM_SITE(xmem_n_ * xmem_s_, xcalloc(xmem_n_, xmem_s_)); \
+})
+#define xrealloc(ptr, len) ({ \
+	size_t xmem_l_ = (len); \
+	XMEM_SITE(xmem_l_, xrealloc((ptr), xmem_l_)); \
+})
+#define xreallocarray(ptr, nmemb, size) ({ \
+	size_t xmem_n_ = (nmemb), xmem_s_ = (size); \
+	XMEM_SITE(xmem_n_ * xmem_s_, xreallocarray((ptr), xmem_n_, xmem_s_)); \
+})
+#define xstrdup(str) ({ \
+	char *xmem_r_ = xstrdup(str); \
+	if (xmem_r_) \
+		XMEM_COUNT_SITE(strlen(xmem_r_) + 1); \
+	xmem_r_; \
+})
+#define xasprintf(strp, ...) do { \
+	char **xmem_p_ = (strp); \
+	xasprintf(xmem_p_, __VA_ARGS__); \
+	XMEM_COUNT_SITE(strlen(*xmem_p_) + 1); \
+} while (0)
+#endif
+
 #undef XMEM_UNUSED
 
 #endif
@@ -1,54 +1,35 @@
 #include "clip.h"
 #include "wayland.h"
 #include "net.h"
+#include "loop.h"
 
 extern uSynergyContext synContext;
 extern char **environ;
 
-int clipMonitorFd;
+int clipMonitorFd = -1;
 struct sockaddr_un clipMonitorAddr;
 pid_t clipMonitorPid[2];
 
-/* check for wl-clipboard's presence */
+/* check for wl-clipboard's presence -- without running it, which is slow */
 bool clipHaveWlClipboard(void)
 {
-	bool ret = true;
-	pid_t pid;
-	int status;
-	char *argv_0[] = {
+	const char *need[] = {
 		"wl-paste",
-		"-v",
-		NULL
-	};
-	char *argv_1[] = {
 		"wl-copy",
-		"-v",
-		NULL
 	};
-	char **argv[] = {argv_0, argv_1};
-
-	sigWaitSIGCHLD(true);
 
-	for (int i = 0; i < 2; ++i) {
-		if (posix_spawnp(&pid, argv[i][0], NULL, NULL, argv[i], environ)) {
-			ret = false;
-			goto done;
-		}
-		if (waitpid(pid, &status, 0) != pid) {
-			ret = false;
-			goto done;
-		}
-		if (status) {
-			ret = false;
-			goto done;
+	for (int i = 0; i < sizeof(need)/sizeof(*need); ++i) {
+		if (!osFindExec(need[i])) {
+			logDbg("%s not found", need[i]);
+			return false;
 		}
-		logDbg("Found %s", argv[i][0]);
+		logDbg("Found %s", need[i]);
 	}
-done:
-	sigWaitSIGCHLD(false);
-	return ret;
+	return true;
 }
 
+static void monitor_proc(int fd, short revents, void *data);
+
 /* set up sockets */
 bool clipSetupSockets()
 {
@@ -71,10 +52,7 @@ bool clipSetupSockets()
 		logPErr("listen");
 		return false;
 	}
-	for (int i = POLLFD_CLIP_UPDATER; i < POLLFD_COUNT; ++i) {
-		netPollFd[i].fd = -1;
-	}
-	return true;
+	return loopAdd(clipMonitorFd, POLLIN, LOOP_PRIO_NORMAL, monitor_proc, NULL);
 }
 
 /* spawn wl-paste watchers */
@@ -100,14 +78,28 @@ bool clipSpawnMonitors(void)
 			NULL
 	};
 	char **argv[] = { argv_0, argv_1 };
-	/* kill the other crap on our socket */
-	char *killcmd;
-	int killret;
-	xasprintf(&killcmd, "pkill -f 'wlpaste.*%s'", clipMonitorAddr.sun_path);
-	if ((killret = system(killcmd))) {
-		logWarn("Could not kill lingering wlpaste instances: %d\n", killret);
+	/* kill the other crap on our socket, without a shell in between */
+	char *pattern;
+	char *kill_argv[] = {
+		"pkill",
+		"-f",
+		NULL,
+		NULL
+	};
+	pid_t pid;
+	int status;
+
+	xasprintf(&pattern, "wl-paste.*%s", clipMonitorAddr.sun_path);
+	kill_argv[2] = pattern;
+	sigWaitSIGCHLD(true);
+	if (posix_spawnp(&pid, kill_argv[0], NULL, NULL, kill_argv, environ)) {
+		logPErr("Could not spawn pkill");
+	} else if (waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) > 1) {
+		/* 1 is just nothing found */
+		logWarn("Could not kill lingering wl-paste instances: %d", WEXITSTATUS(status));
 	}
-	free(killcmd);
+	sigWaitSIGCHLD(false);
+	free(pattern);
 	for (int i = 0; i < 2; ++i) {
 		if (posix_spawnp(clipMonitorPid + i,"wl-paste",NULL,NULL,argv[i],environ)) {
 			logPErr("spawn");
@@ -117,68 +109,76 @@ bool clipSpawnMonitors(void)
 	return true;
 }
 
-/* process poll data */
-void clipMonitorPollProc(struct pollfd *pfd)
+/* read an update from a connected waynergy-clip-update */
+static void updater_proc(int fd, short revents, void *data)
 {
+	/* kept between updates, only ever grown */
+	static char *buf;
+	static size_t buf_len;
 	size_t len;
-	char c_id, *buf = NULL;
+	char c_id;
 	enum uSynergyClipboardId id;
-	if (pfd->revents & POLLIN) {
-		if (pfd->fd == clipMonitorFd) {
-			for (int i = POLLFD_CLIP_UPDATER; i < POLLFD_COUNT; ++i) {
-				if (netPollFd[i].fd == -1) {
-					logDbg("Accepting");
-					netPollFd[i].fd = accept(clipMonitorFd, NULL, NULL);
-					if (netPollFd[i].fd == -1) {
-						logPErr("accept");
-						switch (errno) {
-							case ECONNABORTED:
-							case EINTR:
-								break;
-							default:
-								logErr("clipboard update socket is broken");
-								close(clipMonitorFd);
-								clipMonitorFd = -1;
-								netPollFd[POLLFD_CLIP_MON].fd = -1;
-								break;
-						}
-					}
-					return;
-				}
-			}
-			logErr("No free updater file descriptors -- doing nothing");
-		} else {
-			if (!read_full(pfd->fd, &c_id, 1, 0)) {
-				logPErr("Could not read clipboard ID");
-				goto done;
-			}
-			if (!read_full(pfd->fd, &len, sizeof(len), 0)) {
-				logPErr("Could not read clipboard data length");
-				goto done;
-			}
-			buf = xmalloc(len);
-			if (!read_full(pfd->fd, buf, len, 0)) {
-				logPErr("Could not read clipboard data");
-				goto done;
-			}
-			if (c_id == 'p') {
-				id = SYNERGY_CLIPBOARD_SELECTION;
-			} else if (c_id == 'c') {
-				id = SYNERGY_CLIPBOARD_CLIPBOARD;
-			} else {
-				logErr("Unknown clipboard ID %c", c_id);
-				goto done;
-			}
-			logDbg("Clipboard data read for %c: %zd bytes", c_id, len);
-			uSynergyUpdateClipBuf(&synContext, id , len, buf);
+
+	if (!(revents & POLLIN))
+		goto done;
+	if (!read_full(fd, &c_id, 1, 0)) {
+		logPErr("Could not read clipboard ID");
+		goto done;
+	}
+	if (!read_full(fd, &len, sizeof(len), 0)) {
+		logPErr("Could not read clipboard data length");
+		goto done;
+	}
+	if (len > buf_len) {
+		buf = xrealloc(buf, len);
+		buf_len = len;
+	}
+	if (!read_full(fd, buf, len, 0)) {
+		logPErr("Could not read clipboard data");
+		goto done;
+	}
+	if (c_id == 'p') {
+		id = SYNERGY_CLIPBOARD_SELECTION;
+	} else if (c_id == 'c') {
+		id = SYNERGY_CLIPBOARD_CLIPBOARD;
+	} else {
+		logErr("Unknown clipboard ID %c", c_id);
+		goto done;
+	}
+	logDbg("Clipboard data read for %c: %zd bytes", c_id, len);
+	uSynergyUpdateClipBuf(&synContext, id , len, buf);
+	uSynergyFlush(&synContext);
 done:
-			shutdown(pfd->fd, SHUT_RDWR);
-			close(pfd->fd);
-			pfd->fd = -1;
-			free(buf);
+	loopRemove(fd);
+	shutdown(fd, SHUT_RDWR);
+	close(fd);
+}
+
+/* accept a waynergy-clip-update connection */
+static void monitor_proc(int listen_fd, short revents, void *data)
+{
+	int fd;
+
+	if (!(revents & POLLIN))
+		return;
+	logDbg("Accepting");
+	if ((fd = accept(listen_fd, NULL, NULL)) == -1) {
+		logPErr("accept");
+		switch (errno) {
+			case ECONNABORTED:
+			case EINTR:
+				break;
+			default:
+				logErr("clipboard update socket is broken");
+				loopRemove(clipMonitorFd);
+				close(clipMonitorFd);
+				clipMonitorFd = -1;
+				break;
 		}
+		return;
 	}
-	return;
+	if (!loopAdd(fd, POLLIN, LOOP_PRIO_NORMAL, updater_proc, NULL))
+		close(fd);
 }
 
 
@@ -0,0 +1,372 @@
+#include "ctl.h"
+#include "config.h"
+#include "xmem.h"
+#include "log.h"
+#include "flight.h"
+#include "latency.h"
+#include "metrics.h"
+#include "inject.h"
+#include "loop.h"
+#include "outbuf.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+
+int ctlFd = -1;
+
+static struct synNetContext *ctl_snet_ctx;
+
+/* a connected client, its partial request line, and whatever it has yet to
+ * read of the replies */
+struct ctl_client {
+	int fd;
+	char buf[CTL_LINE_MAX];
+	size_t len;
+	struct outBuf out;
+};
+
+/* replies are built up here, and written in one go */
+static struct ssb out_buf;
+
+static void out(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	ssb_xvprintf(&out_buf, fmt, ap);
+	va_end(ap);
+}
+
+static bool cmd_help(char *arg);
+
+static bool cmd_loglevel(char *arg)
+{
+	enum logLevel level;
+
+	if (!arg) {
+		out("error: level required\n");
+		return false;
+	}
+	if ((level = logLevelFromString(arg)) == LOG__INVALID) {
+		out("error: invalid level '%s'\n", arg);
+		return false;
+	}
+	logSetLevel(level);
+	return true;
+}
+static bool cmd_reconnect(char *arg)
+{
+	logInfo("Reconnect requested over control socket");
+	injectKeyReleaseAll();
+	/* a requested disconnect is a normal one, never fatal */
+	uSynergyDisconnect(ctl_snet_ctx->syn_ctx, USYNERGY_ERROR_NONE);
+	synNetDisconnect(ctl_snet_ctx);
+	return true;
+}
+/* these run wherever the wayland context lives */
+static bool keymap_reload(struct wlContext *wl_ctx, void *arg)
+{
+	wlKeyReleaseAll(wl_ctx);
+	return !wlKeySetConfigLayout(wl_ctx);
+}
+static bool input_pause(struct wlContext *wl_ctx, void *arg)
+{
+	wlInputPause(wl_ctx, arg);
+	return true;
+}
+static bool display_status(struct wlContext *wl_ctx, void *arg)
+{
+	struct wlOutput *output;
+
+	out("paused: %s\n", wl_ctx->input.paused ? "yes" : "no");
+	for (output = wl_ctx->outputs; output; output = output->next) {
+		out("output: %s %dx%d+%d+%d scale %d\n",
+				output->name ? output->name : "unknown",
+				output->width,
+				output->height,
+				output->x,
+				output->y,
+				output->scale);
+	}
+	return true;
+}
+
+static bool cmd_keymap(char *arg)
+{
+	logInfo("Keymap reload requested over control socket");
+	if (!injectCall(keymap_reload, NULL)) {
+		out("error: could not load keymap\n");
+		return false;
+	}
+	return true;
+}
+static bool cmd_release(char *arg)
+{
+	injectKeyReleaseAll();
+	return true;
+}
+static bool cmd_pause(char *arg)
+{
+	injectCall(input_pause, (void *)1);
+	return true;
+}
+static bool cmd_resume(char *arg)
+{
+	injectCall(input_pause, NULL);
+	return true;
+}
+static bool cmd_dump(char *arg)
+{
+	latencyDump();
+	if (!flightDumpFile()) {
+		out("error: could not write flight recorder\n");
+		return false;
+	}
+	return true;
+}
+static bool cmd_stats(char *arg)
+{
+	size_t len;
+	const char *buf;
+
+	buf = metricsFormat(&len);
+	out("%.*s", (int)len, buf);
+	return true;
+}
+static bool cmd_status(char *arg)
+{
+	uSynergyContext *syn_ctx = ctl_snet_ctx->syn_ctx;
+
+	out("server: %s%s\n", ctl_snet_ctx->url, ctl_snet_ctx->tls ? " (tls)" : "");
+	out("connected: %s\n", syn_ctx->m_connected ? "yes" : "no");
+	out("implementation: %s\n", syn_ctx->m_implementation ? syn_ctx->m_implementation : "unknown");
+	out("captured: %s\n", syn_ctx->m_isCaptured ? "yes" : "no");
+	out("last-error: %d\n", syn_ctx->m_lastError);
+	out("geometry: %dx%d\n", syn_ctx->m_clientWidth, syn_ctx->m_clientHeight);
+	if (!injectCall(display_status, NULL)) {
+		out("error: could not get display status\n");
+		return false;
+	}
+	return true;
+}
+
+static const struct {
+	const char *name;
+	bool (*func)(char *);
+	const char *help;
+} cmds[] = {
+	{"help", cmd_help, "list commands"},
+	{"status", cmd_status, "show connection and output geometry"},
+	{"stats", cmd_stats, "show metrics"},
+	{"loglevel", cmd_loglevel, "LEVEL -- change the log level"},
+	{"reconnect", cmd_reconnect, "drop the connection and connect again"},
+	{"keymap", cmd_keymap, "reload the keyboard layout from the configuration"},
+	{"release", cmd_release, "release all pressed keys"},
+	{"pause", cmd_pause, "stop injecting input from the server"},
+	{"resume", cmd_resume, "resume injecting input from the server"},
+	{"dump", cmd_dump, "write out the flight recorder and latency statistics"},
+};
+
+static bool cmd_help(char *arg)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(cmds)/sizeof(*cmds); ++i) {
+		out("%s: %s\n", cmds[i].name, cmds[i].help);
+	}
+	return true;
+}
+
+static void run_line(char *line)
+{
+	char *arg;
+	size_t i;
+
+	ssb_rewind(&out_buf);
+	line[strcspn(line, "\r")] = '\0';
+	if ((arg = strchr(line, ' '))) {
+		*(arg++) = '\0';
+		arg += strspn(arg, " ");
+		if (!*arg)
+			arg = NULL;
+	}
+	if (!*line)
+		return;
+	logDbg("Control command: %s", line);
+	for (i = 0; i < sizeof(cmds)/sizeof(*cmds); ++i) {
+		if (!strcmp(line, cmds[i].name)) {
+			if (cmds[i].func(arg))
+				out("ok\n");
+			return;
+		}
+	}
+	out("error: unknown command '%s'\n", line);
+}
+
+static void client_close(struct ctl_client *client)
+{
+	loopRemove(client->fd);
+	close(client->fd);
+	outBufFree(&client->out);
+	free(client);
+}
+
+/* send the reply just built, keeping what the client won't take yet; false
+ * if it should be dropped */
+static bool client_send(struct ctl_client *client)
+{
+	if (!outBufSend(&client->out, client->fd, out_buf.buf, out_buf.pos))
+		return false;
+	if (outBufPending(&client->out) > CTL_PENDING_MAX) {
+		logDbg("Control client not reading replies, dropping it");
+		return false;
+	}
+	return true;
+}
+
+/* run every complete request line, stopping to wait for the client whenever
+ * it falls behind on the replies */
+static void client_lines(struct ctl_client *client)
+{
+	char *buf = client->buf;
+	size_t *len = &client->len;
+	char *nl;
+
+	while ((nl = strchr(buf, '\n'))) {
+		*nl = '\0';
+		run_line(buf);
+		*len -= nl + 1 - buf;
+		memmove(buf, nl + 1, *len + 1);
+		if (!client_send(client)) {
+			client_close(client);
+			return;
+		}
+		if (outBufPending(&client->out)) {
+			if (!loopModify(client->fd, POLLOUT))
+				client_close(client);
+			return;
+		}
+		/* a reconnect leaves nothing to keep serving until we are
+		 * back in the event loop */
+		if (ctl_snet_ctx->fd == -1)
+			return;
+	}
+	if (*len == CTL_LINE_MAX - 1) {
+		logWarn("Control request too long, dropping client");
+		client_close(client);
+	}
+}
+
+static void client_proc(int fd, short revents, void *data)
+{
+	struct ctl_client *client = data;
+	ssize_t ret;
+
+	if (revents & POLLOUT) {
+		if (!outBufFlush(&client->out, fd)) {
+			client_close(client);
+			return;
+		}
+		if (outBufPending(&client->out))
+			return;
+		if (!loopModify(fd, POLLIN)) {
+			client_close(client);
+			return;
+		}
+		client_lines(client);
+		return;
+	}
+	/* a hangup may still come with a request to read first */
+	if (!(revents & POLLIN)) {
+		if (revents & (POLLHUP | POLLERR | POLLNVAL))
+			client_close(client);
+		return;
+	}
+	if ((ret = read(fd, client->buf + client->len, CTL_LINE_MAX - 1 - client->len)) <= 0) {
+		if (ret == -1 && (errno == EAGAIN || errno == EINTR))
+			return;
+		client_close(client);
+		return;
+	}
+	client->len += ret;
+	client->buf[client->len] = '\0';
+	client_lines(client);
+}
+
+static void client_accept(int listen_fd, short revents, void *data)
+{
+	struct ctl_client *client;
+	int fd;
+
+	if (!(revents & POLLIN))
+		return;
+	while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+		client = xmalloc(sizeof(*client));
+		client->fd = fd;
+		client->len = 0;
+		client->out = (struct outBuf){0};
+		if (!loopAdd(fd, POLLIN, LOOP_PRIO_NORMAL, client_proc, client)) {
+			close(fd);
+			free(client);
+		}
+	}
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+		logPErr("control accept");
+	}
+}
+
+bool ctlInit(struct synNetContext *snet_ctx)
+{
+	char *path;
+	struct sockaddr_un addr = {0};
+	mode_t mask;
+	int ret;
+
+	ctl_snet_ctx = snet_ctx;
+	if (!configTryBool("ctl/enable", false)) {
+		return true;
+	}
+	path = configTryString("ctl/path", NULL);
+	if (!path) {
+		path = osGetRuntimePath("waynergy-ctl-sock");
+	}
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		logErr("Control socket path %s is too long", path);
+		free(path);
+		return false;
+	}
+	strcpy(addr.sun_path, path);
+	addr.sun_family = AF_UNIX;
+	unlink(addr.sun_path);
+	free(path);
+	if ((ctlFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+		logPErr("control socket");
+		return false;
+	}
+	/* this can do quite a bit more than the metrics socket, so nobody
+	 * else may connect, not even before it could be chmod'ed */
+	mask = umask(077);
+	ret = bind(ctlFd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if (ret == -1) {
+		logPErr("control bind");
+		goto error;
+	}
+	if (listen(ctlFd, 8) == -1) {
+		logPErr("control listen");
+		goto error;
+	}
+	if (!loopAdd(ctlFd, POLLIN, LOOP_PRIO_NORMAL, client_accept, NULL))
+		goto error;
+	logInfo("Accepting control commands on %s", addr.sun_path);
+	return true;
+error:
+	close(ctlFd);
+	ctlFd = -1;
+	return false;
+}
@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "flight.h"
+
+static const char *type_str[] = {
+	"none",
+	"pkt",
+	"input",
+	"flush",
+	"conn",
+};
+
+int main(int argc, char **argv)
+{
+	FILE *f;
+	struct flightHeader hdr;
+	struct flightEvent *ev;
+	uint64_t i, start, count, last_ns;
+
+	if (argc != 2) {
+		fprintf(stderr, "USAGE: %s dumpfile\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (!(f = fopen(argv[1], "r"))) {
+		perror("fopen");
+		return EXIT_FAILURE;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1) {
+		fprintf(stderr, "Could not read header\n");
+		return EXIT_FAILURE;
+	}
+	if (memcmp(hdr.magic, FLIGHT_MAGIC, sizeof(hdr.magic)) || hdr.event_size != sizeof(*ev) || !hdr.size || (hdr.size & (hdr.size - 1))) {
+		fprintf(stderr, "Not a flight recorder dump, or written by an incompatible version\n");
+		return EXIT_FAILURE;
+	}
+	ev = calloc(hdr.size, sizeof(*ev));
+	if (!ev || fread(ev, sizeof(*ev), hdr.size, f) != hdr.size) {
+		fprintf(stderr, "Could not read events\n");
+		return EXIT_FAILURE;
+	}
+	fclose(f);
+
+	if (hdr.head > hdr.size) {
+		start = hdr.head & (hdr.size - 1);
+		count = hdr.size;
+	} else {
+		start = 0;
+		count = hdr.head;
+	}
+	printf("# pid %" PRIu32 ", %" PRIu64 " events recorded, showing last %" PRIu64 "\n", hdr.pid, hdr.head, count);
+	printf("# %-16s %10s %-6s %-4s %11s %11s %11s\n", "time (s)", "delta (us)", "type", "tag", "arg0", "arg1", "arg2");
+	last_ns = 0;
+	for (i = 0; i < count; ++i) {
+		struct flightEvent *e = ev + ((start + i) & (hdr.size - 1));
+		printf("  %16.9f %10.1f %-6s %.4s %11" PRId32 " %11" PRId32 " %11" PRId32 "\n",
+				e->ns / 1e9,
+				last_ns ? (e->ns - last_ns) / 1e3 : 0.0,
+				e->type < sizeof(type_str)/sizeof(*type_str) ? type_str[e->type] : "?",
+				e->tag,
+				e->arg[0],
+				e->arg[1],
+				e->arg[2]);
+		last_ns = e->ns;
+	}
+	free(ev);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,49 @@
+#include "flight.h"
+#include "config.h"
+#include "fdio_full.h"
+#include "xmem.h"
+#include "log.h"
+#include <fcntl.h>
+#include <unistd.h>
+
+struct flightRing flightRing;
+_Thread_local struct flightEvent *flightLast;
+
+bool flightDump(int fd)
+{
+	struct flightHeader hdr = {
+		.magic = FLIGHT_MAGIC,
+		.size = FLIGHT_RING_SIZE,
+		.event_size = sizeof(struct flightEvent),
+		.pid = getpid(),
+		.head = flightRing.head,
+	};
+
+	if (!write_full(fd, &hdr, sizeof(hdr), 0))
+		return false;
+	return write_full(fd, flightRing.ev, sizeof(flightRing.ev), 0);
+}
+
+bool flightDumpFile(void)
+{
+	bool ret;
+	int fd;
+	char *path;
+
+	if (!(path = configTryString("flight/path", NULL))) {
+		path = osGetRuntimePath("waynergy-flight");
+	}
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR)) == -1) {
+		logPErr("Could not open flight recorder dump");
+		free(path);
+		return false;
+	}
+	if ((ret = flightDump(fd))) {
+		logInfo("Flight recorder (%ju events) dumped to %s", (uintmax_t)flightRing.head, path);
+	} else {
+		logPErr("Could not write flight recorder dump");
+	}
+	close(fd);
+	free(path);
+	return ret;
+}
@@ -0,0 +1,456 @@
+/* injection thread
+ *
+ * With inject/thread, the Wayland connection is handed over to a thread of
+ * its own once it is set up. The network thread keeps reading, decrypting and
+ * parsing, and pushes each input event into a fixed ring that only it writes
+ * to and only the injection thread reads from, so neither ever waits on a
+ * lock. The injection thread drains whatever has built up, with a single
+ * display flush at the end, then sleeps on the display and a pipe that is
+ * only written to when it is known to be asleep.
+ *
+ * Anything else needing the connection, such as the control socket, goes
+ * through injectCall(); output changes come back the other way, through a
+ * pipe in the event loop, since only the network thread may talk to the
+ * server. So do fatal errors: the injection thread stops where it is, and
+ * the network thread does the exiting. */
+#include "inject.h"
+#include "latency.h"
+#include "metrics.h"
+#include "log.h"
+#include "sig.h"
+#include "loop.h"
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+enum inject_type {
+	INJECT_KEY,
+	INJECT_KEY_PREPARE,
+	INJECT_KEY_RELEASE_ALL,
+	INJECT_BUTTON,
+	INJECT_MOTION,
+	INJECT_REL_MOTION,
+	INJECT_WHEEL,
+	INJECT_IDLE_INHIBIT,
+	INJECT_CALL,
+	INJECT_STOP,
+};
+
+/* an event, and the latency stamps it was parsed with */
+struct inject_event {
+	int type;
+	int32_t arg[3];
+	uint64_t ready;
+	uint64_t parse;
+	uint64_t arrival;
+	uint64_t event_time;
+};
+
+static struct {
+	struct wlContext *ctx;
+	bool threaded;
+	pthread_t thread;
+	/* network -> injection wakeup, and injection -> network notification */
+	int wake[2];
+	int notify[2];
+	void (*on_geometry)(int width, int height);
+	/* synchronous calls, one at a time */
+	pthread_mutex_t call_lock;
+	pthread_cond_t call_cond;
+	bool (*call_fn)(struct wlContext *ctx, void *arg);
+	void *call_arg;
+	bool call_ret;
+	bool call_done;
+	struct inject_event ring[INJECT_RING_SIZE];
+	/* each written by one side only, kept apart so they don't share a
+	 * cache line */
+	_Alignas(64) atomic_size_t head; /* next to read */
+	_Alignas(64) atomic_size_t tail; /* next to write */
+	_Alignas(64) atomic_bool sleeping;
+	/* width << 32 | height, or 0 if nothing has changed */
+	_Alignas(64) _Atomic uint64_t geometry;
+	/* set once the injection thread has stopped on a fatal error, along
+	 * with what the network thread should do about it */
+	atomic_bool exiting;
+	enum sigExitStatus exit_status;
+	bool exit_restart;
+} inject = {
+	.wake = {-1, -1},
+	.notify = {-1, -1},
+	.call_lock = PTHREAD_MUTEX_INITIALIZER,
+	.call_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void pipe_write(int fd)
+{
+	char c = 0;
+
+	/* if it is full, there is already a wakeup pending */
+	while (write(fd, &c, 1) == -1 && errno == EINTR);
+}
+
+static void pipe_drain(int fd)
+{
+	char buf[64];
+
+	while (read(fd, buf, sizeof(buf)) > 0);
+}
+
+static bool pipe_open(int fd[static 2])
+{
+	int i;
+
+	if (pipe(fd)) {
+		logPErr("Could not create pipe");
+		return false;
+	}
+	for (i = 0; i < 2; ++i) {
+		fcntl(fd[i], F_SETFD, FD_CLOEXEC);
+		fcntl(fd[i], F_SETFL, fcntl(fd[i], F_GETFL) | O_NONBLOCK);
+	}
+	return true;
+}
+
+static void pipe_close(int fd[static 2])
+{
+	int i;
+
+	for (i = 0; i < 2; ++i) {
+		if (fd[i] != -1)
+			close(fd[i]);
+		fd[i] = -1;
+	}
+}
+
+/* false if the injection thread is gone, and the event was dropped */
+static bool push(int type, int32_t a, int32_t b, int32_t c)
+{
+	size_t tail = atomic_load_explicit(&inject.tail, memory_order_relaxed);
+	struct inject_event *ev;
+
+	if (atomic_load_explicit(&inject.exiting, memory_order_acquire))
+		return false;
+	while (tail - atomic_load_explicit(&inject.head, memory_order_acquire) == INJECT_RING_SIZE) {
+		if (atomic_load_explicit(&inject.exiting, memory_order_acquire))
+			return false;
+		metricsAdd(&metrics.inject_full, 1);
+		pipe_write(inject.wake[1]);
+		sched_yield();
+	}
+	ev = inject.ring + (tail & (INJECT_RING_SIZE - 1));
+	ev->type = type;
+	ev->arg[0] = a;
+	ev->arg[1] = b;
+	ev->arg[2] = c;
+	ev->ready = latencyState.ts[LATENCY_STAGE_READY];
+	ev->parse = latencyState.ts[LATENCY_STAGE_PARSE];
+	ev->arrival = latencyState.arrival;
+	ev->event_time = latencyState.event_time;
+	atomic_store_explicit(&inject.tail, tail + 1, memory_order_release);
+	/* pairs with the fence in run(): either it sees this event before
+	 * sleeping, or we see that it is asleep */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&inject.sleeping, memory_order_relaxed))
+		pipe_write(inject.wake[1]);
+	return true;
+}
+
+static bool process(struct wlContext *ctx, const struct inject_event *ev)
+{
+	bool ret;
+
+	latencyState.ts[LATENCY_STAGE_READY] = ev->ready;
+	latencyState.ts[LATENCY_STAGE_PARSE] = ev->parse;
+	latencyState.arrival = ev->arrival;
+	latencyState.event_time = ev->event_time;
+	switch (ev->type) {
+	case INJECT_KEY:
+		wlKey(ctx, ev->arg[0], ev->arg[1], ev->arg[2]);
+		break;
+	case INJECT_KEY_PREPARE:
+		wlKeyPrepare(ctx, ev->arg[0]);
+		break;
+	case INJECT_KEY_RELEASE_ALL:
+		wlKeyReleaseAll(ctx);
+		break;
+	case INJECT_BUTTON:
+		wlMouseButton(ctx, ev->arg[0], ev->arg[1]);
+		break;
+	case INJECT_MOTION:
+		wlMouseMotion(ctx, ev->arg[0], ev->arg[1]);
+		break;
+	case INJECT_REL_MOTION:
+		wlMouseRelativeMotion(ctx, ev->arg[0], ev->arg[1]);
+		break;
+	case INJECT_WHEEL:
+		wlMouseWheel(ctx, ev->arg[0], ev->arg[1]);
+		break;
+	case INJECT_IDLE_INHIBIT:
+		wlIdleInhibit(ctx, ev->arg[0]);
+		break;
+	case INJECT_CALL:
+		/* flushed first, so it sees the display as it would have */
+		ctx->flush_defer = false;
+		if (ctx->flush_pending)
+			wlDisplayFlush(ctx);
+		/* not under the lock, in case the call never returns */
+		ret = inject.call_fn(ctx, inject.call_arg);
+		pthread_mutex_lock(&inject.call_lock);
+		inject.call_ret = ret;
+		inject.call_done = true;
+		pthread_cond_signal(&inject.call_cond);
+		pthread_mutex_unlock(&inject.call_lock);
+		ctx->flush_defer = true;
+		break;
+	case INJECT_STOP:
+		return false;
+	}
+	return true;
+}
+
+/* everything queued so far, with one flush at the end */
+static bool drain(struct wlContext *ctx)
+{
+	size_t head = atomic_load_explicit(&inject.head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&inject.tail, memory_order_acquire);
+	struct inject_event ev;
+	bool ret = true;
+
+	if (head == tail)
+		return true;
+	metricsAdd(&metrics.inject_drains, 1);
+	metricsAdd(&metrics.inject_events, tail - head);
+	ctx->flush_defer = true;
+	while (ret && head != tail) {
+		ev = inject.ring[head & (INJECT_RING_SIZE - 1)];
+		atomic_store_explicit(&inject.head, ++head, memory_order_release);
+		ret = process(ctx, &ev);
+	}
+	latencyState.ts[LATENCY_STAGE_PARSE] = 0;
+	latencyState.event_time = 0;
+	ctx->flush_defer = false;
+	if (ctx->flush_pending)
+		wlDisplayFlush(ctx);
+	return ret;
+}
+
+static void *run(void *arg)
+{
+	struct wlContext *ctx = arg;
+	struct pollfd pfd[2] = {
+		{ .fd = wlPrepareFd(ctx), .events = POLLIN },
+		{ .fd = inject.wake[0], .events = POLLIN },
+	};
+	int ret;
+
+	logDbg("Injection thread started");
+	while (drain(ctx)) {
+		atomic_store_explicit(&inject.sleeping, true, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+		if (atomic_load_explicit(&inject.tail, memory_order_relaxed) !=
+				atomic_load_explicit(&inject.head, memory_order_relaxed)) {
+			atomic_store_explicit(&inject.sleeping, false, memory_order_relaxed);
+			continue;
+		}
+		ret = poll(pfd, 2, wlPollTimeout(ctx, -1));
+		atomic_store_explicit(&inject.sleeping, false, memory_order_relaxed);
+		if (ret == -1) {
+			if (errno != EINTR)
+				logPErr("Injection thread poll failed");
+			continue;
+		}
+		if (pfd[1].revents & POLLIN)
+			pipe_drain(inject.wake[0]);
+		wlPollProc(ctx, ret ? pfd[0].revents : 0);
+	}
+	logDbg("Injection thread stopped");
+	return NULL;
+}
+
+/* a geometry change was handed back */
+static void notify_proc(int fd, short revents, void *data)
+{
+	pipe_drain(fd);
+	injectPollProc();
+}
+
+bool injectStart(struct wlContext *ctx, bool threaded, void (*on_geometry)(int width, int height))
+{
+	sigset_t set, old;
+	int err;
+
+	inject.ctx = ctx;
+	inject.on_geometry = on_geometry;
+	if (!threaded)
+		return true;
+	if (!pipe_open(inject.wake))
+		return false;
+	if (!pipe_open(inject.notify)) {
+		pipe_close(inject.wake);
+		return false;
+	}
+	/* signals are for the network thread to deal with */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	err = pthread_create(&inject.thread, NULL, run, ctx);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err) {
+		logErr("Could not start injection thread: %s", strerror(err));
+		pipe_close(inject.wake);
+		pipe_close(inject.notify);
+		return false;
+	}
+	loopAdd(inject.notify[0], POLLIN, LOOP_PRIO_NORMAL, notify_proc, NULL);
+	inject.threaded = true;
+	logInfo("Injecting input on a separate thread");
+	return true;
+}
+
+void injectStop(void)
+{
+	if (!inject.threaded)
+		return;
+	/* if it stopped on its own, there's nobody to tell */
+	push(INJECT_STOP, 0, 0, 0);
+	pthread_join(inject.thread, NULL);
+	inject.threaded = false;
+}
+
+void injectExit(enum sigExitStatus status, bool restart)
+{
+	if (!inject.threaded || !pthread_equal(pthread_self(), inject.thread))
+		return;
+	inject.exit_status = status;
+	inject.exit_restart = restart;
+	atomic_store_explicit(&inject.exiting, true, memory_order_release);
+	/* a call waiting on us would wait forever */
+	pthread_mutex_lock(&inject.call_lock);
+	inject.call_ret = false;
+	inject.call_done = true;
+	pthread_cond_signal(&inject.call_cond);
+	pthread_mutex_unlock(&inject.call_lock);
+	pipe_write(inject.notify[1]);
+	logDbg("Injection thread stopped on a fatal error");
+	pthread_exit(NULL);
+}
+
+bool injectThreaded(void)
+{
+	return inject.threaded;
+}
+
+void injectKey(int key, int id, int state)
+{
+	if (inject.threaded) {
+		push(INJECT_KEY, key, id, state);
+	} else {
+		wlKey(inject.ctx, key, id, state);
+	}
+}
+void injectKeyPrepare(int id)
+{
+	if (inject.threaded) {
+		push(INJECT_KEY_PREPARE, id, 0, 0);
+	} else {
+		wlKeyPrepare(inject.ctx, id);
+	}
+}
+void injectKeyReleaseAll(void)
+{
+	if (inject.threaded) {
+		push(INJECT_KEY_RELEASE_ALL, 0, 0, 0);
+	} else {
+		wlKeyReleaseAll(inject.ctx);
+	}
+}
+void injectMouseButton(int button, int state)
+{
+	if (inject.threaded) {
+		push(INJECT_BUTTON, button, state, 0);
+	} else {
+		wlMouseButton(inject.ctx, button, state);
+	}
+}
+void injectMouseMotion(int x, int y)
+{
+	if (inject.threaded) {
+		push(INJECT_MOTION, x, y, 0);
+	} else {
+		wlMouseMotion(inject.ctx, x, y);
+	}
+}
+void injectMouseRelativeMotion(int dx, int dy)
+{
+	if (inject.threaded) {
+		push(INJECT_REL_MOTION, dx, dy, 0);
+	} else {
+		wlMouseRelativeMotion(inject.ctx, dx, dy);
+	}
+}
+void injectMouseWheel(int dx, int dy)
+{
+	if (inject.threaded) {
+		push(INJECT_WHEEL, dx, dy, 0);
+	} else {
+		wlMouseWheel(inject.ctx, dx, dy);
+	}
+}
+void injectIdleInhibit(bool on)
+{
+	if (inject.threaded) {
+		push(INJECT_IDLE_INHIBIT, on, 0, 0);
+	} else {
+		wlIdleInhibit(inject.ctx, on);
+	}
+}
+
+bool injectCall(bool (*fn)(struct wlContext *ctx, void *arg), void *arg)
+{
+	bool ret;
+
+	if (!inject.threaded)
+		return fn(inject.ctx, arg);
+	pthread_mutex_lock(&inject.call_lock);
+	inject.call_fn = fn;
+	inject.call_arg = arg;
+	inject.call_done = false;
+	if (!push(INJECT_CALL, 0, 0, 0)) {
+		pthread_mutex_unlock(&inject.call_lock);
+		return false;
+	}
+	while (!inject.call_done)
+		pthread_cond_wait(&inject.call_cond, &inject.call_lock);
+	ret = inject.call_ret;
+	pthread_mutex_unlock(&inject.call_lock);
+	return ret;
+}
+
+bool injectGeometry(int width, int height)
+{
+	if (!inject.threaded || !pthread_equal(pthread_self(), inject.thread))
+		return false;
+	atomic_store(&inject.geometry, (uint64_t)(uint32_t)width << 32 | (uint32_t)height);
+	pipe_write(inject.notify[1]);
+	return true;
+}
+
+void injectPollProc(void)
+{
+	uint64_t geom;
+
+	if (inject.threaded && atomic_load_explicit(&inject.exiting, memory_order_acquire)) {
+		injectStop();
+		if (inject.exit_restart)
+			Restart(inject.exit_status);
+		Exit(inject.exit_status);
+	}
+	if (!(geom = atomic_exchange(&inject.geometry, 0)))
+		return;
+	if (inject.on_geometry)
+		inject.on_geometry(geom >> 32, geom & UINT32_MAX);
+}
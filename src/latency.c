@@ -0,0 +1,196 @@
+#include "latency.h"
+#include "log.h"
+#include <inttypes.h>
+
+_Thread_local struct latencyState latencyState = {
+	.class = -1,
+};
+struct latencyStats latencyStats;
+
+static const char *class_str[] = {
+	"key",
+	"button",
+	"motion",
+	"wheel",
+};
+static const char *span_str[] = {
+	"total",
+	"net",
+	"parse",
+	"flush",
+};
+
+static unsigned bucket_index(uint64_t v)
+{
+	unsigned msb, shift;
+
+	if (v < (1 << LATENCY_SUB_BITS))
+		return v;
+	msb = 63 - __builtin_clzll(v);
+	shift = msb - LATENCY_SUB_BITS;
+	if (shift > LATENCY_MAX_SHIFT)
+		return LATENCY_BUCKETS - 1;
+	return ((shift + 1) << LATENCY_SUB_BITS) + (v >> shift) - (1 << LATENCY_SUB_BITS);
+}
+/* highest value that lands in a given bucket */
+static uint64_t bucket_value(unsigned i)
+{
+	unsigned shift;
+	uint64_t mant;
+
+	if (i < (1 << LATENCY_SUB_BITS))
+		return i;
+	shift = (i >> LATENCY_SUB_BITS) - 1;
+	mant = (i & ((1 << LATENCY_SUB_BITS) - 1)) + (1 << LATENCY_SUB_BITS);
+	return ((mant + 1) << shift) - 1;
+}
+
+/* only the injecting thread adds, but another may be dumping at the same
+ * time, so each value is loaded and stored whole; no need for anything more
+ * costly with a single writer */
+#define LOAD(v) __atomic_load_n(&(v), __ATOMIC_RELAXED)
+#define STORE(v, x) __atomic_store_n(&(v), (x), __ATOMIC_RELAXED)
+
+static void hist_add(struct latencyHist *h, uint64_t v)
+{
+	uint32_t *bucket = h->bucket + bucket_index(v);
+
+	STORE(h->count, h->count + 1);
+	if (v > h->max)
+		STORE(h->max, v);
+	STORE(*bucket, *bucket + 1);
+}
+
+static uint64_t hist_percentile(struct latencyHist *h, double p)
+{
+	uint64_t target, seen = 0;
+	unsigned i;
+
+	uint64_t count = LOAD(h->count), max = LOAD(h->max);
+
+	target = count * p;
+	if (target >= count)
+		target = count - 1;
+	for (i = 0; i < LATENCY_BUCKETS - 1; ++i) {
+		seen += LOAD(h->bucket[i]);
+		if (seen > target)
+			break;
+	}
+	/* the bucket bound may overshoot what we've actually seen */
+	return bucket_value(i) < max ? bucket_value(i) : max;
+}
+
+void latencyDone(void)
+{
+	uint64_t *ts = latencyState.ts;
+	struct latencyHist *h;
+
+	if (latencyState.class == -1)
+		return;
+	/* backends that don't flush the display are done on return */
+	if (ts[LATENCY_STAGE_FLUSH] < ts[LATENCY_STAGE_DISPATCH])
+		latencyMark(LATENCY_STAGE_FLUSH);
+	h = latencyStats.hist[latencyState.class];
+	/* readiness may be absent when not driven by the poll loop */
+	if (ts[LATENCY_STAGE_READY] && ts[LATENCY_STAGE_READY] <= ts[LATENCY_STAGE_PARSE]) {
+		hist_add(h + LATENCY_SPAN_TOTAL, ts[LATENCY_STAGE_FLUSH] - ts[LATENCY_STAGE_READY]);
+		hist_add(h + LATENCY_SPAN_NET, ts[LATENCY_STAGE_PARSE] - ts[LATENCY_STAGE_READY]);
+	}
+	hist_add(h + LATENCY_SPAN_PARSE, ts[LATENCY_STAGE_DISPATCH] - ts[LATENCY_STAGE_PARSE]);
+	hist_add(h + LATENCY_SPAN_FLUSH, ts[LATENCY_STAGE_FLUSH] - ts[LATENCY_STAGE_DISPATCH]);
+	latencyState.class = -1;
+	ts[LATENCY_STAGE_PARSE] = 0;
+	if (!latencyStats.first_event && latencyStats.start) {
+		STORE(latencyStats.first_event, ts[LATENCY_STAGE_FLUSH]);
+		logInfo("Startup: first event injected %.1fms in",
+				(latencyStats.first_event - latencyStats.start) / 1e6);
+	}
+}
+
+void latencyArrival(uint64_t ns)
+{
+	uint64_t gap;
+
+	/* never backwards, whatever the clocks did */
+	if (ns < latencyState.arrival)
+		ns = latencyState.arrival;
+	/* the last read is done with, so it's known how many events came in
+	 * after its gap; only a steady stream says anything about how they
+	 * are spaced */
+	if (latencyState.events && latencyState.arrival_prev) {
+		gap = latencyState.arrival - latencyState.arrival_prev;
+		if (gap < LATENCY_SPACING_MAX) {
+			latencyState.spacing = latencyState.spacing ?
+				(latencyState.spacing * 7 + gap / latencyState.events) / 8 :
+				gap / latencyState.events;
+		}
+	}
+	latencyState.events = 0;
+	latencyState.arrival_prev = latencyState.arrival;
+	latencyState.arrival = ns;
+}
+
+void latencyEventTime(int i, int count)
+{
+	uint64_t gap, window, t;
+
+	if (!(t = latencyState.arrival)) {
+		latencyState.event_time = 0;
+		return;
+	}
+	if (!latencyState.events++) {
+		/* the first batch is all we know of yet; any after it in the
+		 * same read carry on at the same spacing, up to the arrival */
+		if (latencyState.arrival_prev && count - i > 1) {
+			gap = latencyState.arrival - latencyState.arrival_prev;
+			window = latencyState.spacing * (count - i - 1);
+			t -= window < gap ? window : gap;
+		}
+		latencyState.first = t;
+	} else {
+		t = latencyState.first + latencyState.spacing * (latencyState.events - 1);
+		if (t > latencyState.arrival)
+			t = latencyState.arrival;
+	}
+	if (t < latencyState.last)
+		t = latencyState.last;
+	latencyState.event_time = latencyState.last = t;
+}
+
+void latencyStartup(void)
+{
+	latencyStats.start = latencyStats.phase = osGetMonoNs();
+}
+
+void latencyPhase(const char *name)
+{
+	uint64_t now = osGetMonoNs();
+
+	logInfo("Startup: %s took %.1fms (%.1fms in)",
+			name,
+			(now - latencyStats.phase) / 1e6,
+			(now - latencyStats.start) / 1e6);
+	latencyStats.phase = now;
+}
+
+void latencyDump(void)
+{
+	int c, s;
+	struct latencyHist *h;
+
+	for (c = 0; c < LATENCY_CLASS__COUNT; ++c) {
+		for (s = 0; s < LATENCY_SPAN__COUNT; ++s) {
+			h = &latencyStats.hist[c][s];
+			if (!LOAD(h->count))
+				continue;
+			logInfo("Latency %s/%s: n=%" PRIu64 " p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus",
+					class_str[c],
+					span_str[s],
+					LOAD(h->count),
+					hist_percentile(h, 0.5) / 1e3,
+					hist_percentile(h, 0.99) / 1e3,
+					hist_percentile(h, 0.999) / 1e3,
+					LOAD(h->max) / 1e3);
+		}
+	}
+}
@@ -150,6 +150,11 @@ bool logInit(enum logLevel level, char *path)
 	logInfo("Log initialized at level %d", level);
 	return true;
 }
+void logSetLevel(enum logLevel level)
+{
+	log_level = level;
+	logInfo("Log level set to %d", level);
+}
 void logClose(void)
 {
 	if (log_file)
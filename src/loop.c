@@ -0,0 +1,140 @@
+#include "loop.h"
+#include "xmem.h"
+#include "log.h"
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+
+/* indexed by descriptor; the generation tells a descriptor apart from a
+ * later one with the same number, in case one is closed and another opened
+ * while events for it are still waiting to be handled */
+struct loop_handler {
+	loopProc proc;
+	void *data;
+	enum loopPrio prio;
+	uint32_t gen;
+};
+
+static struct {
+	int fd;
+	struct loop_handler *handler;
+	int handler_count;
+	uint32_t gen;
+	bool stop;
+	struct epoll_event ev[LOOP_EVENTS_MAX];
+} loop = {
+	.fd = -1,
+};
+
+static bool loop_init(void)
+{
+	if (loop.fd != -1)
+		return true;
+	if ((loop.fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		logPErr("Could not create event loop");
+		return false;
+	}
+	return true;
+}
+
+static uint32_t to_epoll(short events)
+{
+	return (events & POLLIN ? EPOLLIN : 0) |
+		(events & POLLOUT ? EPOLLOUT : 0) |
+		(events & POLLPRI ? EPOLLPRI : 0);
+}
+
+static short from_epoll(uint32_t events)
+{
+	return (events & EPOLLIN ? POLLIN : 0) |
+		(events & EPOLLOUT ? POLLOUT : 0) |
+		(events & EPOLLPRI ? POLLPRI : 0) |
+		(events & EPOLLERR ? POLLERR : 0) |
+		(events & EPOLLHUP ? POLLHUP : 0);
+}
+
+bool loopAdd(int fd, short events, enum loopPrio prio, loopProc proc, void *data)
+{
+	struct epoll_event ev;
+	int old;
+
+	if (fd < 0 || !loop_init())
+		return false;
+	if (fd >= loop.handler_count) {
+		old = loop.handler_count;
+		loop.handler_count = fd + 16;
+		loop.handler = xreallocarray(loop.handler, loop.handler_count, sizeof(*loop.handler));
+		memset(loop.handler + old, 0, (loop.handler_count - old) * sizeof(*loop.handler));
+	}
+	loop.handler[fd] = (struct loop_handler){
+		.proc = proc,
+		.data = data,
+		.prio = prio,
+		.gen = ++loop.gen,
+	};
+	ev.events = to_epoll(events);
+	ev.data.u64 = (uint64_t)loop.handler[fd].gen << 32 | (uint32_t)fd;
+	if (epoll_ctl(loop.fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		logPErr("Could not add descriptor to event loop");
+		loop.handler[fd].proc = NULL;
+		return false;
+	}
+	return true;
+}
+
+bool loopModify(int fd, short events)
+{
+	struct epoll_event ev;
+
+	if (fd < 0 || fd >= loop.handler_count || !loop.handler[fd].proc)
+		return false;
+	ev.events = to_epoll(events);
+	ev.data.u64 = (uint64_t)loop.handler[fd].gen << 32 | (uint32_t)fd;
+	if (epoll_ctl(loop.fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+		logPErr("Could not modify descriptor in event loop");
+		return false;
+	}
+	return true;
+}
+
+void loopRemove(int fd)
+{
+	if (fd < 0 || fd >= loop.handler_count || !loop.handler[fd].proc)
+		return;
+	loop.handler[fd].proc = NULL;
+	if (epoll_ctl(loop.fd, EPOLL_CTL_DEL, fd, NULL) == -1)
+		logPDbg("Could not remove descriptor from event loop");
+}
+
+int loopWait(int timeout)
+{
+	struct loop_handler *h;
+	enum loopPrio prio;
+	uint32_t gen;
+	int i, n, fd;
+
+	if (!loop_init())
+		return -1;
+	if ((n = epoll_wait(loop.fd, loop.ev, LOOP_EVENTS_MAX, timeout)) <= 0)
+		return n;
+	loop.stop = false;
+	for (prio = 0; prio < LOOP_PRIO__COUNT; ++prio) {
+		for (i = 0; i < n && !loop.stop; ++i) {
+			fd = (uint32_t)loop.ev[i].data.u64;
+			gen = loop.ev[i].data.u64 >> 32;
+			if (fd >= loop.handler_count)
+				continue;
+			h = loop.handler + fd;
+			if (!h->proc || h->gen != gen || h->prio != prio)
+				continue;
+			h->proc(fd, from_epoll(loop.ev[i].events), h->data);
+		}
+	}
+	return n;
+}
+
+void loopBreak(void)
+{
+	loop.stop = true;
+}
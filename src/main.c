@@ -16,12 +16,17 @@
 #include "clip.h"
 #include "log.h"
 #include "sig.h"
+#include "metrics.h"
+#include "ctl.h"
+#include "trace.h"
+#include "latency.h"
+#include "inject.h"
 #include "ver.h"
 
 static struct sopt optspec[] = {
 	SOPT_INITL('h', "help", "Help text"),
 	SOPT_INITL('v', "version", "Version information"),
-	SOPT_INIT_ARGL('b', "backend", SOPT_ARGTYPE_STR, "backend", "[backend] Input backend -- one of wlr, kde, uinput"),
+	SOPT_INIT_ARGL('b', "backend", SOPT_ARGTYPE_STR, "backend", "[backend] Input backend -- one of wlr, kde, uinput, or null and record for testing"),
 	SOPT_INIT_ARGL('c', "host", SOPT_ARGTYPE_STR, "host", "[host] Server to connect to"),
 	SOPT_INIT_ARGL('p', "port", SOPT_ARGTYPE_STR, "port", "[port] Port"),
 	SOPT_INIT_ARGL('W', "width", SOPT_ARGTYPE_SHORT, "width", "[width] Width of screen in pixels (manual override, must be given with height)"),
@@ -30,9 +35,13 @@ static struct sopt optspec[] = {
 	SOPT_INIT_ARGL('l', "logfile", SOPT_ARGTYPE_STR, "file", "[log/path] Name of logfile to use"),
 	SOPT_INIT_ARGL('L', "loglevel", SOPT_ARGTYPE_STR, "level", "[log/level] Log level -- number, increasing from 0 for more verbosity up to 6, or one of 'none', 'error', 'warn', 'info', 'debug', 'debugsyn'"),
 	SOPT_INITL('n', "no-clip", "Don't synchronize the clipboard"),
+	SOPT_INITL('D', "headless", "[headless] Don't connect to the display at all -- needs the null or record backend, and manual dimensions"),
 	SOPT_INITL('e', "enable-crypto", "[tls/enable] Enable TLS encryption"),
 	SOPT_INITL('E', "disable-crypto", "[tls/enable] Force disable TLS encryption"),
 	SOPT_INITL('t', "enable-tofu", "[tls/tofu] Enable trust-on-first-use for TLS certificate"),
+	SOPT_INIT_ARGL('r', "record", SOPT_ARGTYPE_STR, "file", "Record everything received from the server to a trace file"),
+	SOPT_INIT_ARGL('R', "replay", SOPT_ARGTYPE_STR, "file", "Replay a trace file instead of connecting to a server, then exit"),
+	SOPT_INITL('f', "replay-fast", "Replay as fast as possible, rather than with the original timing"),
 	SOPT_INITL(CHAR_MAX + USYNERGY_ERROR_NONE, "fatal-none", "Consider *normal* disconnect (i.e. CBYE) to be fatal"),
 	SOPT_INITL(CHAR_MAX + USYNERGY_ERROR_EBAD, "fatal-ebad", "Protocol errors are fatal"),
 	SOPT_INITL(CHAR_MAX + USYNERGY_ERROR_EBSY, "fatal-ebsy", "EBSY (client already exists with our name) errors are fatal"),
@@ -47,29 +56,39 @@ struct synNetContext synNetContext;
 
 static void syn_mouse_wheel_cb(uSynergyCookie cookie, int16_t x, int16_t y)
 {
-	wlMouseWheel(&wlContext, x, y);
+	injectMouseWheel(x, y);
 }
 
 static void syn_mouse_button_down_cb(uSynergyCookie cookie, enum uSynergyMouseButton button)
 {
-	wlMouseButton(&wlContext, button, 1);
+	injectMouseButton(button, 1);
 }
 static void syn_mouse_button_up_cb(uSynergyCookie cookie, enum uSynergyMouseButton button)
 {
-	wlMouseButton(&wlContext, button, 0);
+	injectMouseButton(button, 0);
 }
 static void syn_mouse_move_cb(uSynergyCookie cookie, bool rel, int16_t x, int16_t y)
 {
 	if (rel) {
-		wlMouseRelativeMotion(&wlContext, x, y);
+		injectMouseRelativeMotion(x, y);
 	} else {
-		wlMouseMotion(&wlContext, x, y);
+		injectMouseMotion(x, y);
 	}
 }
 static void syn_key_cb(uSynergyCookie cookie, uint16_t key, uint16_t id, uint16_t mod, bool down, bool repeat)
 {
 	if (!repeat)
- 		wlKey(&wlContext, key, id, down);
+ 		injectKey(key, id, down);
+}
+static void syn_batch_cb(uSynergyCookie cookie, const struct uSynergyBatch *batch)
+{
+	int i;
+
+	/* so keys the layout lacks all fit in one keymap update */
+	for (i = 0; i < batch->count; ++i) {
+		if (batch->ev[i].type == USYNERGY_EVENT_KEY && batch->ev[i].key.down && !batch->ev[i].key.repeat)
+			injectKeyPrepare(batch->ev[i].key.id);
+	}
 }
 static void syn_clip_cb(uSynergyCookie cookie, enum uSynergyClipboardId id, uint32_t format, const uint8_t *data, uint32_t size)
 {
@@ -82,18 +101,26 @@ static void syn_screensaver_cb(uSynergyCookie cookie, bool state)
 {
 	size_t i;
 	int ret;
-	wlIdleInhibit(&wlContext, !state);
+	uint64_t start;
+	injectIdleInhibit(!state);
 	char **cmd = configReadLines(state ? "screensaver/start" : "screensaver/stop");
 	if (!cmd)
 		return;
+	start = osGetMonoNs();
 	for (i = 0; cmd[i]; ++i) {
 		ret = system(cmd[i]);
 		if (ret) {
 			logWarn("Screensaver callback state %s command #%zd (%s) failed with code %d", state ? "start" : "stop", i, cmd[i], ret);
 		}
 	}
+	metricsHook(state ? METRICS_HOOK_SCREENSAVER_START : METRICS_HOOK_SCREENSAVER_STOP, start);
 	strfreev(cmd);
 }
+static void syn_geometry_cb(int width, int height)
+{
+	uSynergyUpdateRes(&synContext, width, height);
+	uSynergyFlush(&synContext);
+}
 void wl_output_update_cb(struct wlContext *context)
 {
 	struct wlOutput *output = context->outputs;
@@ -116,30 +143,39 @@ void wl_output_update_cb(struct wlContext *context)
 	}
 	width = r - l;
 	height = t - b;
+	if (width == context->width && height == context->height) {
+		logDbg("Geometry unchanged: %dx%d", width, height);
+		return;
+	}
 	logInfo("Geometry updated: %dx%d", width, height);
-	uSynergyUpdateRes(&synContext, width, height);
-	wlResUpdate(&wlContext, width, height);
+	wlResUpdate(context, width, height);
+	/* the server is told from the network thread */
+	if (!injectGeometry(width, height))
+		syn_geometry_cb(width, height);
 }
 static void syn_active_cb(uSynergyCookie cookie, bool active)
 {
 	size_t i;
 	int ret;
 	char **cmd;
+	uint64_t start;
 
 	if (!active) {
-		wlKeyReleaseAll(&wlContext);
+		injectKeyReleaseAll();
 	}
 
 	cmd = configReadLines(active ? "screen/enter" : "screen/exit");
 	if (!cmd) {
 		return;
 	}
+	start = osGetMonoNs();
 	for (i = 0; cmd[i]; ++i) {
 		ret = system(cmd[i]);
 		if (ret) {
 			logWarn("Screen state %s command #%zd (%s) failed with code %d", active ? "enter" : "exit", i, cmd[i], ret);
 		}
 	}
+	metricsHook(active ? METRICS_HOOK_SCREEN_ENTER : METRICS_HOOK_SCREEN_EXIT, start);
 	strfreev(cmd);
 }
 
@@ -168,12 +204,16 @@ int main(int argc, char **argv)
 	char *backend = NULL;
 	char hostname[_POSIX_HOST_NAME_MAX] = {0};
 	char *log_path = NULL;
+	char *record_path = NULL;
+	char *replay_path = NULL;
+	bool replay_fast = false;
 	enum logLevel log_level;
 	bool man_geom = false;
 	bool use_clipboard = true;
 	bool enable_crypto = false;
 	bool enable_tofu = false;
 
+	latencyStartup();
 	/* deal with privileged operations first */
 	uinput_fd_open(wlContext.uinput_fd);
 	/* and drop said privileges */
@@ -195,6 +235,7 @@ int main(int argc, char **argv)
 	host = configTryString("host", "localhost");
 	name = configTryString("name", hostname);
 	backend = configTryString("backend", NULL);
+	wlContext.headless = configTryBool("headless", false);
 	enable_crypto = configTryBool("tls/enable", false);
 	enable_tofu = configTryBool("tls/tofu", false);
 	synContext.m_clientWidth = configTryLong("width", 0);
@@ -242,6 +283,9 @@ int main(int argc, char **argv)
 			case 'n':
 				use_clipboard = false;
 				break;
+			case 'D':
+				wlContext.headless = true;
+				break;
 			case 'e':
 				enable_crypto = true;
 				break;
@@ -251,6 +295,15 @@ int main(int argc, char **argv)
 			case 't':
 				enable_tofu = true;
 				break;
+			case 'r':
+				record_path = xstrdup(soptarg.str);
+				break;
+			case 'R':
+				replay_path = xstrdup(soptarg.str);
+				break;
+			case 'f':
+				replay_fast = true;
+				break;
 			case CHAR_MAX + USYNERGY_ERROR_NONE:
 			case CHAR_MAX + USYNERGY_ERROR_EBAD:
 			case CHAR_MAX + USYNERGY_ERROR_EBSY:
@@ -266,6 +319,7 @@ opterror:
 	/* set up logging */
 	logInit(log_level, log_path);
 	logInfo("%s version %s", argv[0], WAYNERGY_VERSION_STR);
+	latencyPhase("configuration");
 	/* now we decide if we should use manual geom */
 	if (synContext.m_clientWidth || synContext.m_clientHeight) {
 		if (!(synContext.m_clientWidth && synContext.m_clientHeight)) {
@@ -280,12 +334,28 @@ opterror:
 	sigHandleInit(argv);
 	/* we can't override const, so set hostname here*/
 	synContext.m_clientName = name;
-	if (!synNetInit(&synNetContext, &synContext, host, port, enable_crypto, enable_tofu)) {
+	if (replay_path) {
+		/* no server, so nothing to disconnect from on exit either */
+		synNetContext.fd = -1;
+	} else if (!synNetInit(&synNetContext, &synContext, host, port, enable_crypto, enable_tofu)) {
 		logErr("Could not initialize network code");
 		goto error;
 	}
+	if (record_path && !traceRecordOpen(record_path)) {
+		goto error;
+	}
+	if (!metricsInit(&synContext)) {
+		logErr("Could not set up metrics socket");
+		goto error;
+	}
 	/* key code type */
 	synContext.m_useRawKeyCodes = configTryBool("syn_raw_key_codes", true);
+	/* dead server detection */
+	synContext.m_keepAliveMisses = configTryLong("net/heartbeat_misses", USYNERGY_KEEPALIVE_MISSES);
+	if (synContext.m_keepAliveMisses < 1) {
+		logWarn("net/heartbeat_misses must be at least 1");
+		synContext.m_keepAliveMisses = 1;
+	}
 	/* populate events */
 	synContext.m_mouseMoveCallback = syn_mouse_move_cb;
 	synContext.m_mouseButtonDownCallback = syn_mouse_button_down_cb;
@@ -294,31 +364,58 @@ opterror:
 	synContext.m_keyboardCallback = syn_key_cb;
 	synContext.m_screensaverCallback = syn_screensaver_cb;
 	synContext.m_screenActiveCallback = syn_active_cb;
+	synContext.m_batchCallback = syn_batch_cb;
+	/* nothing else touches the network context until the first
+	 * connection attempt, which waits for this one */
+	if (!replay_path)
+		synNetConnectEarly(&synNetContext);
 	/* wayland context events */
 	wlContext.on_output_update = man_geom ? NULL : wl_output_update_cb;
 	/* set up clipboard */
+	if (wlContext.headless && use_clipboard) {
+		logInfo("Clipboard sync disabled, as wl-clipboard needs a display");
+		use_clipboard = false;
+	}
 	if (clipHaveWlClipboard() && use_clipboard) {
 		synContext.m_clipboardCallback = syn_clip_cb;
-		if (!clipSetupSockets())
+		/* when replaying there is nobody to send local changes to */
+		if (!replay_path && !clipSetupSockets())
 			goto error;
-		if(!clipSpawnMonitors())
+		if(!replay_path && !clipSpawnMonitors())
 			goto error;
 	} else if (!use_clipboard) {
 		logInfo("Clipboard sync disabled by command line");
 	} else {
 		logWarn("wl-clipboard not found, no clipboard synchronization support");
 	}
+	latencyPhase("clipboard");
 	/* setup wayland */
 	if (!wlSetup(&wlContext, synContext.m_clientWidth, synContext.m_clientHeight, backend))
 		goto error;
+	if (replay_path) {
+		if (!traceReplay(&synContext, replay_path, replay_fast))
+			goto error;
+		wlKeyReleaseAll(&wlContext);
+		Exit(SES_SUCCESS);
+	}
+	if (!ctlInit(&synNetContext)) {
+		logErr("Could not set up control socket");
+		goto error;
+	}
 	wlIdleInhibit(&wlContext, true);
+	/* from here on, the wayland context belongs to the injection thread,
+	 * if there is one */
+	if (!injectStart(&wlContext, configTryBool("inject/thread", false), syn_geometry_cb))
+		goto error;
 	/* initialize main loop */
-	netPollInit();
+	netPollInit(&wlContext);
 	/* and actual main loop */
 	while(1) {
 		/* no matter what handling signals is a good idea */
 	       	sigHandleRun();
 		if (!synContext.m_connected) {
+			/* connect with the geometry as it is now */
+			injectPollProc();
 			/* always try updating first so we initially connect */
 			uSynergyUpdate(&synContext);
 		} else {
@@ -329,6 +426,8 @@ error:
 	ret = EXIT_FAILURE;
 done:
 	free(log_path);
+	free(record_path);
+	free(replay_path);
 	free(host);
 	free(name);
 	free(port);
@@ -0,0 +1,281 @@
+#include "metrics.h"
+#include "config.h"
+#include "xmem.h"
+#include "log.h"
+#include "latency.h"
+#include "loop.h"
+#include "outbuf.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+struct metrics metrics = {
+	.sockopt = { [0 ... METRICS_SOCKOPT__COUNT - 1] = -1 },
+};
+const char *metricsSockoptName[METRICS_SOCKOPT__COUNT] = { METRICS_SOCKOPT_NAMES };
+int metricsFd = -1;
+
+static uSynergyContext *metrics_syn_ctx;
+static const char *pkt_types[METRICS_PKT_COUNT] = { METRICS_PKT_TYPES };
+static const char *hook_str[METRICS_HOOK__COUNT] = {
+	"screensaver/start",
+	"screensaver/stop",
+	"screen/enter",
+	"screen/exit",
+};
+static const char *error_str[USYNERGY_ERROR__COUNT] = {
+	"none",
+	"ebsy",
+	"ebad",
+	"timeout",
+};
+
+/* scrapes are formatted here, kept between requests to avoid allocating on
+ * every one */
+static struct ssb out_buf;
+
+void metricsPacket(const char *pkt_id)
+{
+	int i;
+
+	for (i = 0; i < METRICS_PKT_COUNT; ++i) {
+		if (!memcmp(pkt_id, pkt_types[i], 4))
+			break;
+	}
+	++metrics.pkt[i];
+}
+
+static void out(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	ssb_xvprintf(&out_buf, fmt, ap);
+	va_end(ap);
+}
+static void out_head(const char *name, const char *type, const char *help)
+{
+	out("# HELP waynergy_%s %s\n# TYPE waynergy_%s %s\n", name, help, name, type);
+}
+
+static long get_rss(void)
+{
+	long pages = -1;
+#if defined(__linux__)
+	FILE *f;
+
+	if (!(f = fopen("/proc/self/statm", "r")))
+		return -1;
+	if (fscanf(f, "%*s %ld", &pages) != 1)
+		pages = -1;
+	fclose(f);
+#endif
+	return pages == -1 ? -1 : pages * sysconf(_SC_PAGESIZE);
+}
+
+static void format_metrics(void)
+{
+	int i;
+	long rss;
+	uint64_t first_event;
+
+	ssb_rewind(&out_buf);
+	out_head("connected", "gauge", "Whether the synergy connection is up");
+	out("waynergy_connected %d\n", metrics_syn_ctx->m_connected);
+	out_head("packets_received_total", "counter", "Packets received, by type");
+	for (i = 0; i < METRICS_PKT_COUNT; ++i) {
+		out("waynergy_packets_received_total{type=\"%s\"} %" PRIu64 "\n", pkt_types[i], metrics.pkt[i]);
+	}
+	out("waynergy_packets_received_total{type=\"other\"} %" PRIu64 "\n", metrics.pkt[METRICS_PKT_COUNT]);
+	out_head("received_bytes_total", "counter", "Bytes received from the server");
+	out("waynergy_received_bytes_total %" PRIu64 "\n", metrics.bytes_in);
+	out_head("sent_bytes_total", "counter", "Bytes sent to the server");
+	out("waynergy_sent_bytes_total %" PRIu64 "\n", metrics.bytes_out);
+	out_head("disconnects_total", "counter", "Connections lost, by error");
+	for (i = 0; i < USYNERGY_ERROR__COUNT; ++i) {
+		out("waynergy_disconnects_total{error=\"%s\"} %" PRIu64 "\n", error_str[i], metrics.disconnects[i]);
+	}
+	out_head("keepalives_total", "counter", "Keepalives received");
+	out("waynergy_keepalives_total %" PRIu64 "\n", metrics.keepalives);
+	out_head("keepalive_interval_seconds", "gauge", "Time between the last two keepalives");
+	out("waynergy_keepalive_interval_seconds %.6f\n", metrics.keepalive_interval_ns / 1e9);
+	out_head("keepalive_rtt_seconds", "gauge", "Round trip time estimate when the last keepalive was answered");
+	out("waynergy_keepalive_rtt_seconds %.6f\n", metrics.keepalive_rtt_ns / 1e9);
+	out_head("keepalives_missed_total", "counter", "Heartbeat periods that passed without hearing from the server");
+	out("waynergy_keepalives_missed_total %" PRIu64 "\n", metrics.keepalives_missed);
+	out_head("keepalive_period_seconds", "gauge", "Heartbeat period requested by the server");
+	out("waynergy_keepalive_period_seconds %.3f\n", metrics_syn_ctx->m_keepAliveRate / 1e3);
+	out_head("clipboard_bytes_total", "counter", "Clipboard data transferred, by direction");
+	out("waynergy_clipboard_bytes_total{direction=\"in\"} %" PRIu64 "\n", metrics.clip_bytes_in);
+	out("waynergy_clipboard_bytes_total{direction=\"out\"} %" PRIu64 "\n", metrics.clip_bytes_out);
+	out_head("wayland_flushes_total", "counter", "Wayland display flushes");
+	out("waynergy_wayland_flushes_total %" PRIu64 "\n", metricsGet(&metrics.wl_flushes));
+	out_head("wayland_flushes_blocked_total", "counter", "Wayland display flushes that had to block");
+	out("waynergy_wayland_flushes_blocked_total %" PRIu64 "\n", metricsGet(&metrics.wl_flushes_blocked));
+	out_head("hook_runs_total", "counter", "Configured commands run, by hook");
+	for (i = 0; i < METRICS_HOOK__COUNT; ++i) {
+		out("waynergy_hook_runs_total{hook=\"%s\"} %" PRIu64 "\n", hook_str[i], metrics.hook_runs[i]);
+	}
+	out_head("hook_seconds_total", "counter", "Time spent running configured commands, by hook");
+	for (i = 0; i < METRICS_HOOK__COUNT; ++i) {
+		out("waynergy_hook_seconds_total{hook=\"%s\"} %.6f\n", hook_str[i], metrics.hook_ns[i] / 1e9);
+	}
+	out_head("socket_option", "gauge", "Socket options in effect on the server connection, -1 if left alone");
+	for (i = 0; i < METRICS_SOCKOPT__COUNT; ++i) {
+		out("waynergy_socket_option{name=\"%s\"} %" PRId64 "\n", metricsSockoptName[i], metrics.sockopt[i]);
+	}
+	if (metricsGet(&metrics.motion_buffered)) {
+		out_head("motion_buffered_total", "counter", "Motion events held by the jitter buffer");
+		out("waynergy_motion_buffered_total %" PRIu64 "\n", metricsGet(&metrics.motion_buffered));
+		out_head("motion_merged_total", "counter", "Buffered motion events merged into another in the same frame");
+		out("waynergy_motion_merged_total %" PRIu64 "\n", metricsGet(&metrics.motion_merged));
+		out_head("motion_emitted_total", "counter", "Motion events handed on by the jitter buffer");
+		out("waynergy_motion_emitted_total %" PRIu64 "\n", metricsGet(&metrics.motion_emitted));
+		out_head("motion_held_seconds_total", "counter", "Time buffered motion events were held for");
+		out("waynergy_motion_held_seconds_total %.6f\n", metricsGet(&metrics.motion_held_ns) / 1e9);
+		out_head("motion_jitter_seconds", "gauge", "Estimated jitter in motion arrivals");
+		out("waynergy_motion_jitter_seconds %.6f\n", metricsGet(&metrics.motion_jitter_ns) / 1e9);
+		out_head("motion_delay_seconds", "gauge", "Delay the jitter buffer is aiming for");
+		out("waynergy_motion_delay_seconds %.6f\n", metricsGet(&metrics.motion_delay_ns) / 1e9);
+	}
+	if (metricsGet(&metrics.inject_events)) {
+		out_head("inject_events_total", "counter", "Events handed to the injection thread");
+		out("waynergy_inject_events_total %" PRIu64 "\n", metricsGet(&metrics.inject_events));
+		out_head("inject_drains_total", "counter", "Times the injection thread drained its queue, with one flush each");
+		out("waynergy_inject_drains_total %" PRIu64 "\n", metricsGet(&metrics.inject_drains));
+		out_head("inject_full_total", "counter", "Times the network thread waited on a full injection queue");
+		out("waynergy_inject_full_total %" PRIu64 "\n", metricsGet(&metrics.inject_full));
+	}
+	if ((first_event = __atomic_load_n(&latencyStats.first_event, __ATOMIC_RELAXED))) {
+		out_head("startup_first_event_seconds", "gauge", "Time from startup until the first event was injected");
+		out("waynergy_startup_first_event_seconds %.6f\n", (first_event - latencyStats.start) / 1e9);
+	}
+	if ((rss = get_rss()) != -1) {
+		out_head("resident_memory_bytes", "gauge", "Resident set size");
+		out("waynergy_resident_memory_bytes %ld\n", rss);
+	}
+#if defined(XMEM_COUNT)
+	out_head("allocations_total", "counter", "Heap allocations, by call site");
+	for (struct xmemSite *site = __atomic_load_n(&xmemSites, __ATOMIC_ACQUIRE); site; site = site->next) {
+		out("waynergy_allocations_total{site=\"%s:%d\"} %lu\n", site->file, site->line, __atomic_load_n(&site->count, __ATOMIC_RELAXED));
+	}
+	out_head("allocated_bytes_total", "counter", "Bytes asked for by heap allocations, by call site");
+	for (struct xmemSite *site = __atomic_load_n(&xmemSites, __ATOMIC_ACQUIRE); site; site = site->next) {
+		out("waynergy_allocated_bytes_total{site=\"%s:%d\"} %lu\n", site->file, site->line, __atomic_load_n(&site->bytes, __ATOMIC_RELAXED));
+	}
+#endif
+}
+
+const char *metricsFormat(size_t *len)
+{
+	format_metrics();
+	*len = out_buf.pos;
+	return out_buf.buf;
+}
+
+static void client_close(int fd, struct outBuf *client)
+{
+	loopRemove(fd);
+	close(fd);
+	outBufFree(client);
+	free(client);
+}
+
+static void client_proc(int fd, short revents, void *data)
+{
+	struct outBuf *client = data;
+
+	if (revents & (POLLHUP | POLLERR | POLLNVAL)) {
+		client_close(fd, client);
+		return;
+	}
+	if (!(revents & POLLOUT))
+		return;
+	if (!outBufFlush(client, fd) || !outBufPending(client))
+		client_close(fd, client);
+}
+
+static void metrics_proc(int listen_fd, short revents, void *data)
+{
+	struct outBuf rest, *client;
+	int fd;
+	bool formatted = false;
+
+	if (!(revents & POLLIN))
+		return;
+	/* most scrapes fit within the socket buffer, so get a single
+	 * non-blocking write and are closed immediately; anything left over is
+	 * written out as the client reads */
+	while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+		if (!formatted) {
+			format_metrics();
+			formatted = true;
+		}
+		rest = (struct outBuf){0};
+		if (!outBufSend(&rest, fd, out_buf.buf, out_buf.pos) || !outBufPending(&rest)) {
+			outBufFree(&rest);
+			close(fd);
+			continue;
+		}
+		logDbg("Short metrics write, %zu bytes left for later", outBufPending(&rest));
+		client = xmalloc(sizeof(*client));
+		*client = rest;
+		if (!loopAdd(fd, POLLOUT, LOOP_PRIO_NORMAL, client_proc, client)) {
+			close(fd);
+			outBufFree(client);
+			free(client);
+		}
+	}
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+		logPErr("metrics accept");
+	}
+}
+
+bool metricsInit(uSynergyContext *syn_ctx)
+{
+	char *path;
+	struct sockaddr_un addr = {0};
+
+	metrics_syn_ctx = syn_ctx;
+	if (!configTryBool("metrics/enable", false)) {
+		return true;
+	}
+	path = configTryString("metrics/path", NULL);
+	if (!path) {
+		path = osGetRuntimePath("waynergy-metrics-sock");
+	}
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		logErr("Metrics socket path %s is too long", path);
+		free(path);
+		return false;
+	}
+	strcpy(addr.sun_path, path);
+	addr.sun_family = AF_UNIX;
+	unlink(addr.sun_path);
+	free(path);
+	if ((metricsFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+		logPErr("metrics socket");
+		return false;
+	}
+	if (bind(metricsFd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		logPErr("metrics bind");
+		goto error;
+	}
+	if (listen(metricsFd, 8) == -1) {
+		logPErr("metrics listen");
+		goto error;
+	}
+	if (!loopAdd(metricsFd, POLLIN, LOOP_PRIO_NORMAL, metrics_proc, NULL))
+		goto error;
+	logInfo("Serving metrics on %s", addr.sun_path);
+	return true;
+error:
+	close(metricsFd);
+	metricsFd = -1;
+	return false;
+}
@@ -0,0 +1,1010 @@
+/* mock synergy server -- runs a scripted session against a real client, so
+ * the handshake, keepalives, clipboard streaming and error paths can be
+ * exercised, and round trips timed, without a Synergy or Barrier install */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <netdb.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <tls.h>
+#include "sopt.h"
+#include "xmem.h"
+#include "os.h"
+
+extern char **environ;
+
+static struct sopt optspec[] = {
+	SOPT_INITL('h', "help", "Help text"),
+	SOPT_INIT_ARGL('b', "bind", SOPT_ARGTYPE_STR, "address", "Address to listen on (default 127.0.0.1)"),
+	SOPT_INIT_ARGL('p', "port", SOPT_ARGTYPE_STR, "port", "Port (default 24800)"),
+	SOPT_INIT_ARGL('s', "script", SOPT_ARGTYPE_STR, "file", "Session script, or - for stdin (default: a short built-in session)"),
+	SOPT_INIT_ARGL('c', "cert", SOPT_ARGTYPE_STR, "file", "Enable TLS with this certificate, generating a self-signed one if it doesn't exist"),
+	SOPT_INIT_ARGL('k', "key", SOPT_ARGTYPE_STR, "file", "Private key for the certificate (default: certificate path with .key appended)"),
+	SOPT_INIT_ARGL('i', "implementation", SOPT_ARGTYPE_STR, "name", "Name sent in the hello -- Synergy or Barrier (default Barrier)"),
+	SOPT_INIT_END
+};
+
+static const char *default_script =
+	"accept\n"
+	"qinf\n"
+	"ciak\n"
+	"crop\n"
+	"heartbeat 3000\n"
+	"enter 0 0\n"
+	"calv 20\n"
+	"storm rel 1000 2000\n"
+	"storm rel 0 20000\n"
+	"paste 1048576\n"
+	"calv 1\n"
+	"leave\n"
+	"bye\n";
+
+#define WAIT_MS 5000
+/* keepalives that may be outstanding at once */
+#define CALV_QUEUE 64
+/* largest packet we accept from the client */
+#define IN_MAX 65536
+/* clipboard data goes out in chunks of this size */
+#define CLIP_CHUNK 16384
+
+static struct {
+	int listen_fd;
+	int fd;
+	struct tls *tls;
+	struct tls *cctx;
+	const char *imp;
+	/* received, not yet processed */
+	uint8_t in[IN_MAX + 4];
+	size_t in_len;
+	/* packets built, not yet sent */
+	uint8_t out[65536];
+	size_t out_len;
+	size_t pkt_start;
+	bool have_hello;
+	uint32_t seq;
+	/* automatic keepalives, if the heartbeat was set */
+	uint32_t heartbeat_ms;
+	uint64_t next_calv_ns;
+	/* send times of outstanding keepalives */
+	uint64_t calv[CALV_QUEUE];
+	uint64_t calv_head;
+	uint64_t calv_tail;
+	/* every round trip, for the summary */
+	uint64_t *rtt;
+	size_t rtt_count;
+	size_t rtt_size;
+	uint64_t dinf;
+	uint64_t cnop;
+	/* what a pump() is waiting for */
+	uint64_t wait;
+} srv = {
+	.listen_fd = -1,
+	.fd = -1,
+	.imp = "Barrier",
+};
+
+static void conn_close(void)
+{
+	if (srv.fd == -1)
+		return;
+	if (srv.cctx) {
+		tls_close(srv.cctx);
+		tls_free(srv.cctx);
+		srv.cctx = NULL;
+	}
+	shutdown(srv.fd, SHUT_RDWR);
+	close(srv.fd);
+	srv.fd = -1;
+	srv.in_len = 0;
+	srv.out_len = 0;
+	srv.have_hello = false;
+	srv.heartbeat_ms = 0;
+	srv.calv_tail = srv.calv_head;
+}
+
+/* like read(), but -1 with EAGAIN covers TLS wanting more too */
+static ssize_t conn_read(void *buf, size_t len)
+{
+	ssize_t ret;
+
+	if (!srv.cctx)
+		return read(srv.fd, buf, len);
+	ret = tls_read(srv.cctx, buf, len);
+	if (ret == TLS_WANT_POLLIN || ret == TLS_WANT_POLLOUT) {
+		errno = EAGAIN;
+		return -1;
+	}
+	if (ret == -1) {
+		fprintf(stderr, "tls_read: %s\n", tls_error(srv.cctx));
+		errno = EIO;
+	}
+	return ret;
+}
+static ssize_t conn_write(const void *buf, size_t len)
+{
+	ssize_t ret;
+
+	if (!srv.cctx)
+		return write(srv.fd, buf, len);
+	ret = tls_write(srv.cctx, buf, len);
+	if (ret == TLS_WANT_POLLIN || ret == TLS_WANT_POLLOUT) {
+		errno = EAGAIN;
+		return -1;
+	}
+	if (ret == -1) {
+		fprintf(stderr, "tls_write: %s\n", tls_error(srv.cctx));
+		errno = EIO;
+	}
+	return ret;
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+static uint16_t get_u16(const uint8_t *p)
+{
+	return (uint16_t)p[0] << 8 | p[1];
+}
+
+static void rtt_add(uint64_t ns)
+{
+	if (srv.rtt_count == srv.rtt_size) {
+		srv.rtt_size = srv.rtt_size ? srv.rtt_size * 2 : 256;
+		srv.rtt = xreallocarray(srv.rtt, srv.rtt_size, sizeof(*srv.rtt));
+	}
+	srv.rtt[srv.rtt_count++] = ns;
+}
+
+static void handle_pkt(const uint8_t *pkt, uint32_t len)
+{
+	uint32_t name_len;
+
+	if (!srv.have_hello) {
+		/* implementation, version, then the screen name */
+		if (len < strlen(srv.imp) + 8 || memcmp(pkt, srv.imp, strlen(srv.imp))) {
+			fprintf(stderr, "Bad hello from client\n");
+			conn_close();
+			return;
+		}
+		pkt += strlen(srv.imp);
+		len -= strlen(srv.imp);
+		name_len = get_u32(pkt + 4);
+		if (name_len > len - 8)
+			name_len = len - 8;
+		printf("hello: %.*s %" PRIu16 ".%" PRIu16 "\n", (int)name_len, (const char *)pkt + 8, get_u16(pkt), get_u16(pkt + 2));
+		srv.have_hello = true;
+		return;
+	}
+	if (len < 4) {
+		fprintf(stderr, "Short packet from client\n");
+		return;
+	}
+	if (!memcmp(pkt, "CNOP", 4)) {
+		++srv.cnop;
+	} else if (!memcmp(pkt, "CALV", 4)) {
+		if (srv.calv_tail == srv.calv_head) {
+			fprintf(stderr, "Unsolicited CALV from client\n");
+			return;
+		}
+		rtt_add(osGetMonoNs() - srv.calv[srv.calv_tail++ % CALV_QUEUE]);
+	} else if (!memcmp(pkt, "DINF", 4) && len >= 18) {
+		printf("dinf: %" PRIu16 "x%" PRIu16 "\n", get_u16(pkt + 8), get_u16(pkt + 10));
+		++srv.dinf;
+	} else if (!memcmp(pkt, "DCLP", 4) || !memcmp(pkt, "CCLP", 4)) {
+		printf("client clipboard: %.4s, %" PRIu32 " bytes\n", (const char *)pkt, len);
+	} else {
+		printf("client sent: %.4s, %" PRIu32 " bytes\n", (const char *)pkt, len);
+	}
+}
+
+/* read and handle whatever is available, false once the client is gone */
+static bool conn_recv(void)
+{
+	ssize_t ret;
+	size_t pos;
+	uint32_t len;
+
+	for (;;) {
+		ret = conn_read(srv.in + srv.in_len, sizeof(srv.in) - srv.in_len);
+		if (ret == -1 && (errno == EAGAIN || errno == EINTR))
+			return true;
+		if (ret < 1) {
+			if (ret == -1)
+				perror("read");
+			printf("client disconnected\n");
+			return false;
+		}
+		srv.in_len += ret;
+		for (pos = 0; srv.in_len - pos >= 4; pos += 4 + len) {
+			len = get_u32(srv.in + pos);
+			if (len > IN_MAX) {
+				fprintf(stderr, "Oversized packet from client\n");
+				return false;
+			}
+			if (srv.in_len - pos - 4 < len)
+				break;
+			handle_pkt(srv.in + pos + 4, len);
+			if (srv.fd == -1)
+				return false;
+		}
+		srv.in_len -= pos;
+		memmove(srv.in, srv.in + pos, srv.in_len);
+	}
+}
+
+static bool conn_send(const uint8_t *buf, size_t len)
+{
+	struct pollfd pfd;
+	ssize_t ret;
+
+	while (len) {
+		if ((ret = conn_write(buf, len)) > 0) {
+			buf += ret;
+			len -= ret;
+			continue;
+		}
+		if (ret == -1 && (errno == EAGAIN || errno == EINTR)) {
+			/* the client may well be stuck sending to us, so keep
+			 * reading until there's room */
+			pfd.fd = srv.fd;
+			pfd.events = POLLIN | POLLOUT;
+			if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+				perror("poll");
+				return false;
+			}
+			if ((pfd.revents & (POLLIN | POLLHUP | POLLERR)) && !conn_recv()) {
+				conn_close();
+				return false;
+			}
+			continue;
+		}
+		perror("write");
+		conn_close();
+		return false;
+	}
+	return true;
+}
+
+static bool flush(void)
+{
+	bool ret;
+
+	if (srv.fd == -1)
+		return false;
+	ret = conn_send(srv.out, srv.out_len);
+	srv.out_len = 0;
+	return ret;
+}
+
+static void put(const void *data, size_t len)
+{
+	memcpy(srv.out + srv.out_len, data, len);
+	srv.out_len += len;
+}
+static void put_u8(uint8_t v)
+{
+	put(&v, 1);
+}
+static void put_u16(uint16_t v)
+{
+	uint8_t b[2] = {v >> 8, v};
+	put(b, sizeof(b));
+}
+static void put_u32(uint32_t v)
+{
+	uint8_t b[4] = {v >> 24, v >> 16, v >> 8, v};
+	put(b, sizeof(b));
+}
+
+/* start a packet with room for len bytes after the id, flushing if needed */
+static bool pkt_begin(const char *id, size_t len)
+{
+	if (srv.out_len + 8 + len > sizeof(srv.out) && !flush())
+		return false;
+	srv.pkt_start = srv.out_len;
+	srv.out_len += 4;
+	put(id, strlen(id));
+	return true;
+}
+static void pkt_end(void)
+{
+	uint32_t len = srv.out_len - srv.pkt_start - 4;
+	uint8_t *p = srv.out + srv.pkt_start;
+
+	p[0] = len >> 24;
+	p[1] = len >> 16;
+	p[2] = len >> 8;
+	p[3] = len;
+}
+
+static bool send_calv(void)
+{
+	if (!pkt_begin("CALV", 0))
+		return false;
+	pkt_end();
+	/* don't count time spent queued behind earlier packets */
+	if (!flush())
+		return false;
+	if (srv.calv_head - srv.calv_tail == CALV_QUEUE)
+		++srv.calv_tail;
+	srv.calv[srv.calv_head++ % CALV_QUEUE] = osGetMonoNs();
+	if (srv.heartbeat_ms)
+		srv.next_calv_ns = osGetMonoNs() + srv.heartbeat_ms * 1000000ULL;
+	return true;
+}
+
+static bool calv_done(void)
+{
+	return srv.calv_tail >= srv.wait;
+}
+static bool dinf_done(void)
+{
+	return srv.dinf >= srv.wait;
+}
+static bool hello_done(void)
+{
+	return srv.have_hello;
+}
+
+/* handle input and keepalives until done() or the deadline (if nonzero);
+ * without done(), reaching the deadline is success */
+static bool pump(uint64_t deadline, bool (*done)(void))
+{
+	struct pollfd pfd;
+	uint64_t now, wake;
+	int timeout;
+
+	if (!flush())
+		return false;
+	while (srv.fd != -1) {
+		if (done && done())
+			return true;
+		now = osGetMonoNs();
+		if (srv.heartbeat_ms && now >= srv.next_calv_ns) {
+			send_calv();
+			continue;
+		}
+		if (deadline && now >= deadline)
+			return !done;
+		wake = deadline;
+		if (srv.heartbeat_ms && (!wake || srv.next_calv_ns < wake))
+			wake = srv.next_calv_ns;
+		timeout = wake ? (wake - now + 999999) / 1000000 : -1;
+		pfd.fd = srv.fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			return false;
+		}
+		if (pfd.revents && !conn_recv())
+			conn_close();
+	}
+	return false;
+}
+static uint64_t deadline_ms(long ms)
+{
+	return osGetMonoNs() + ms * 1000000ULL;
+}
+
+static bool gen_cert(const char *cert, const char *key)
+{
+	pid_t pid;
+	int status;
+	char *argv[] = {
+		"openssl", "req", "-x509", "-newkey", "rsa:2048", "-nodes",
+		"-keyout", (char *)key, "-out", (char *)cert, "-days", "365",
+		"-subj", "/CN=waynergy-mock-server", NULL
+	};
+
+	printf("generating self-signed certificate %s\n", cert);
+	if ((errno = posix_spawnp(&pid, "openssl", NULL, NULL, argv, environ))) {
+		perror("openssl spawn");
+		return false;
+	}
+	if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stderr, "Could not generate certificate\n");
+		return false;
+	}
+	return true;
+}
+
+static bool tls_setup(const char *cert, const char *key)
+{
+	struct tls_config *cfg;
+
+	if (access(cert, R_OK) == -1 && !gen_cert(cert, key))
+		return false;
+	if (!(cfg = tls_config_new())) {
+		fprintf(stderr, "tls_config_new failed\n");
+		return false;
+	}
+	if (tls_config_set_keypair_file(cfg, cert, key) == -1) {
+		fprintf(stderr, "Could not load keypair: %s\n", tls_config_error(cfg));
+		goto error;
+	}
+	if (!(srv.tls = tls_server()) || tls_configure(srv.tls, cfg) == -1) {
+		fprintf(stderr, "Could not set up TLS: %s\n", srv.tls ? tls_error(srv.tls) : "out of memory");
+		goto error;
+	}
+	tls_config_free(cfg);
+	return true;
+error:
+	tls_config_free(cfg);
+	return false;
+}
+
+static bool listen_setup(const char *addr, const char *port)
+{
+	struct addrinfo hints = {
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_PASSIVE,
+	};
+	struct addrinfo *res;
+	int on = 1;
+	int ret;
+
+	if ((ret = getaddrinfo(addr, port, &hints, &res))) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ret));
+		return false;
+	}
+	if ((srv.listen_fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC, res->ai_protocol)) == -1) {
+		perror("socket");
+		goto error;
+	}
+	setsockopt(srv.listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (bind(srv.listen_fd, res->ai_addr, res->ai_addrlen) == -1) {
+		perror("bind");
+		goto error;
+	}
+	if (listen(srv.listen_fd, 1) == -1) {
+		perror("listen");
+		goto error;
+	}
+	freeaddrinfo(res);
+	return true;
+error:
+	freeaddrinfo(res);
+	if (srv.listen_fd != -1)
+		close(srv.listen_fd);
+	srv.listen_fd = -1;
+	return false;
+}
+
+/* script commands; argv[0] is the command itself */
+static bool cmd_accept(int argc, char **argv)
+{
+	int on = 1;
+
+	conn_close();
+	printf("waiting for client\n");
+	if ((srv.fd = accept4(srv.listen_fd, NULL, NULL, SOCK_CLOEXEC)) == -1) {
+		perror("accept");
+		return false;
+	}
+	setsockopt(srv.fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	if (srv.tls) {
+		if (tls_accept_socket(srv.tls, &srv.cctx, srv.fd) == -1 || tls_handshake(srv.cctx) == -1) {
+			fprintf(stderr, "TLS handshake failed: %s\n", srv.cctx ? tls_error(srv.cctx) : tls_error(srv.tls));
+			conn_close();
+			return false;
+		}
+	}
+	fcntl(srv.fd, F_SETFL, fcntl(srv.fd, F_GETFL) | O_NONBLOCK);
+	if (!pkt_begin(srv.imp, 4))
+		return false;
+	/* the hello has no packet id as such */
+	put_u16(1);
+	put_u16(6);
+	pkt_end();
+	if (!pump(deadline_ms(WAIT_MS), hello_done)) {
+		fprintf(stderr, "No hello from client\n");
+		return false;
+	}
+	return true;
+}
+static bool cmd_simple(int argc, char **argv)
+{
+	char id[5];
+
+	/* the command is the packet id, in lower case */
+	for (int i = 0; i < 4; ++i) {
+		id[i] = argv[0][i] - 'a' + 'A';
+	}
+	id[4] = '\0';
+	if (!pkt_begin(id, 0))
+		return false;
+	pkt_end();
+	return true;
+}
+static bool cmd_qinf(int argc, char **argv)
+{
+	srv.wait = srv.dinf + 1;
+	if (!cmd_simple(argc, argv))
+		return false;
+	if (!pump(deadline_ms(WAIT_MS), dinf_done)) {
+		fprintf(stderr, "No DINF from client\n");
+		return false;
+	}
+	return true;
+}
+static bool cmd_heartbeat(int argc, char **argv)
+{
+	srv.heartbeat_ms = strtoul(argv[1], NULL, 0);
+	if (!pkt_begin("DSOP", 12))
+		return false;
+	put_u32(2);
+	put("HART", 4);
+	put_u32(srv.heartbeat_ms);
+	pkt_end();
+	srv.next_calv_ns = deadline_ms(srv.heartbeat_ms);
+	return true;
+}
+static bool cmd_mute(int argc, char **argv)
+{
+	srv.heartbeat_ms = 0;
+	return true;
+}
+static bool cmd_enter(int argc, char **argv)
+{
+	if (!pkt_begin("CINN", 10))
+		return false;
+	put_u16(strtol(argv[1], NULL, 0));
+	put_u16(strtol(argv[2], NULL, 0));
+	put_u32(++srv.seq);
+	put_u16(0);
+	pkt_end();
+	return true;
+}
+static bool cmd_leave(int argc, char **argv)
+{
+	if (!pkt_begin("COUT", 0))
+		return false;
+	pkt_end();
+	return true;
+}
+static bool send_xy(const char *id, int16_t x, int16_t y)
+{
+	if (!pkt_begin(id, 4))
+		return false;
+	put_u16(x);
+	put_u16(y);
+	pkt_end();
+	return true;
+}
+static bool cmd_move(int argc, char **argv)
+{
+	return send_xy("DMMV", strtol(argv[1], NULL, 0), strtol(argv[2], NULL, 0));
+}
+static bool cmd_rel(int argc, char **argv)
+{
+	return send_xy("DMRM", strtol(argv[1], NULL, 0), strtol(argv[2], NULL, 0));
+}
+static bool cmd_wheel(int argc, char **argv)
+{
+	return send_xy("DMWM", strtol(argv[1], NULL, 0), strtol(argv[2], NULL, 0));
+}
+static bool cmd_button(int argc, char **argv)
+{
+	if (!pkt_begin(strtol(argv[2], NULL, 0) ? "DMDN" : "DMUP", 1))
+		return false;
+	put_u8(strtol(argv[1], NULL, 0));
+	pkt_end();
+	return true;
+}
+static bool send_key(uint16_t id, uint16_t mod, uint16_t button, bool down)
+{
+	if (!pkt_begin(down ? "DKDN" : "DKUP", 6))
+		return false;
+	put_u16(id);
+	put_u16(mod);
+	put_u16(button);
+	pkt_end();
+	return true;
+}
+static bool cmd_key(int argc, char **argv)
+{
+	return send_key(strtoul(argv[1], NULL, 0),
+			strtoul(argv[2], NULL, 0),
+			strtoul(argv[3], NULL, 0),
+			strtol(argv[4], NULL, 0));
+}
+static bool cmd_screensaver(int argc, char **argv)
+{
+	if (!pkt_begin("CSEC", 1))
+		return false;
+	put_u8(strtol(argv[1], NULL, 0));
+	pkt_end();
+	return true;
+}
+static bool send_clip(const char *data, size_t len)
+{
+	char size[32];
+	size_t chunk;
+	uint64_t start = osGetMonoNs();
+
+	/* grab, then stream the data: a single text format */
+	if (!pkt_begin("CCLP", 5))
+		return false;
+	put_u8(0);
+	put_u32(0);
+	pkt_end();
+	snprintf(size, sizeof(size), "%zu", len + 12);
+	if (!pkt_begin("DCLP", 10 + strlen(size)))
+		return false;
+	put_u8(0);
+	put_u32(0);
+	put_u8(1);
+	put_u32(strlen(size));
+	put(size, strlen(size));
+	pkt_end();
+	if (!pkt_begin("DCLP", 22))
+		return false;
+	put_u8(0);
+	put_u32(0);
+	put_u8(2);
+	put_u32(12);
+	put_u32(1);
+	put_u32(0);
+	put_u32(len);
+	pkt_end();
+	for (; len; data += chunk, len -= chunk) {
+		chunk = len > CLIP_CHUNK ? CLIP_CHUNK : len;
+		if (!pkt_begin("DCLP", 10 + chunk))
+			return false;
+		put_u8(0);
+		put_u32(0);
+		put_u8(2);
+		put_u32(chunk);
+		put(data, chunk);
+		pkt_end();
+	}
+	if (!pkt_begin("DCLP", 10))
+		return false;
+	put_u8(0);
+	put_u32(0);
+	put_u8(3);
+	put_u32(0);
+	pkt_end();
+	if (!flush())
+		return false;
+	printf("clipboard: sent in %.1fms\n", (osGetMonoNs() - start) / 1e6);
+	return true;
+}
+static bool cmd_clip(int argc, char **argv)
+{
+	return send_clip(argv[1], strlen(argv[1]));
+}
+static bool cmd_paste(int argc, char **argv)
+{
+	size_t len = strtoul(argv[1], NULL, 0);
+	char *data = xmalloc(len);
+	bool ret;
+
+	for (size_t i = 0; i < len; ++i) {
+		data[i] = (i % 64 == 63) ? '\n' : 'a' + i % 26;
+	}
+	ret = send_clip(data, len);
+	free(data);
+	return ret;
+}
+static bool cmd_calv(int argc, char **argv)
+{
+	long count = argc > 1 ? strtol(argv[1], NULL, 0) : 1;
+	size_t first = srv.rtt_count;
+	uint64_t min = UINT64_MAX, max = 0, sum = 0;
+
+	for (long i = 0; i < count; ++i) {
+		if (!flush() || !send_calv())
+			return false;
+		srv.wait = srv.calv_head;
+		if (!pump(deadline_ms(WAIT_MS), calv_done)) {
+			fprintf(stderr, "No CALV from client\n");
+			return false;
+		}
+	}
+	for (size_t i = first; i < srv.rtt_count; ++i) {
+		min = srv.rtt[i] < min ? srv.rtt[i] : min;
+		max = srv.rtt[i] > max ? srv.rtt[i] : max;
+		sum += srv.rtt[i];
+	}
+	if (srv.rtt_count > first) {
+		printf("calv: n=%zu min=%.1fus avg=%.1fus max=%.1fus\n",
+				srv.rtt_count - first,
+				min / 1e3,
+				sum / 1e3 / (srv.rtt_count - first),
+				max / 1e3);
+	}
+	return true;
+}
+static bool cmd_storm(int argc, char **argv)
+{
+	const char *type = argv[1];
+	long rate = strtol(argv[2], NULL, 0);
+	long count = strtol(argv[3], NULL, 0);
+	uint64_t start, sent, done;
+	bool ret = true;
+
+	start = osGetMonoNs();
+	for (long i = 0; i < count && ret; ++i) {
+		/* keep the pointer where it was, and the keyboard released */
+		int16_t d = i % 2 ? -1 : 1;
+		if (!strcmp(type, "move")) {
+			ret = send_xy("DMMV", 100 + d, 100);
+		} else if (!strcmp(type, "rel")) {
+			ret = send_xy("DMRM", d, 0);
+		} else if (!strcmp(type, "wheel")) {
+			ret = send_xy("DMWM", 0, d * 120);
+		} else if (!strcmp(type, "key")) {
+			/* shift, which doesn't type anything */
+			ret = send_key(0xEFE1, 0, 50, i % 2 == 0);
+		} else {
+			fprintf(stderr, "Unknown storm type '%s'\n", type);
+			return false;
+		}
+		if (ret && rate > 0)
+			ret = pump(start + (i + 1) * 1000000000ULL / rate, NULL);
+	}
+	if (!ret || !flush())
+		return false;
+	sent = osGetMonoNs();
+	/* the client answers in order, so this is when it caught up */
+	if (!send_calv())
+		return false;
+	srv.wait = srv.calv_head;
+	if (!pump(deadline_ms(WAIT_MS), calv_done)) {
+		fprintf(stderr, "No CALV from client after storm\n");
+		return false;
+	}
+	done = osGetMonoNs();
+	printf("storm: %ld %s in %.1fms (%.0f/s), caught up %.1fus after the last\n",
+			count,
+			type,
+			(done - start) / 1e6,
+			count / ((done - start) / 1e9),
+			(done - sent) / 1e3);
+	return true;
+}
+static bool cmd_sleep(int argc, char **argv)
+{
+	pump(deadline_ms(strtol(argv[1], NULL, 0)), NULL);
+	return srv.fd != -1;
+}
+static bool cmd_wait_close(int argc, char **argv)
+{
+	uint64_t start = osGetMonoNs();
+
+	pump(argc > 1 ? deadline_ms(strtol(argv[1], NULL, 0)) : 0, NULL);
+	if (srv.fd != -1) {
+		fprintf(stderr, "Client is still connected\n");
+		return false;
+	}
+	printf("closed after %.1fms\n", (osGetMonoNs() - start) / 1e6);
+	return true;
+}
+static bool cmd_close(int argc, char **argv)
+{
+	if (!cmd_simple(argc, argv) || !flush())
+		return false;
+	conn_close();
+	return true;
+}
+static bool cmd_echo(int argc, char **argv)
+{
+	for (int i = 1; i < argc; ++i) {
+		printf("%s%c", argv[i], i == argc - 1 ? '\n' : ' ');
+	}
+	return true;
+}
+
+static const struct {
+	const char *name;
+	bool (*func)(int, char **);
+	int argc;
+	const char *help;
+} cmds[] = {
+	{"accept", cmd_accept, 0, "wait for a client and exchange hellos"},
+	{"qinf", cmd_qinf, 0, "ask for screen info, and wait for it"},
+	{"ciak", cmd_simple, 0, "acknowledge screen info"},
+	{"crop", cmd_simple, 0, "reset options"},
+	{"heartbeat", cmd_heartbeat, 1, "MS -- set the heartbeat, and send keepalives that often"},
+	{"mute", cmd_mute, 0, "stop sending keepalives, as a dead server would"},
+	{"enter", cmd_enter, 2, "X Y -- enter the screen"},
+	{"leave", cmd_leave, 0, "leave the screen"},
+	{"move", cmd_move, 2, "X Y -- absolute motion"},
+	{"rel", cmd_rel, 2, "DX DY -- relative motion"},
+	{"wheel", cmd_wheel, 2, "DX DY -- scroll"},
+	{"button", cmd_button, 2, "N DOWN -- press or release a button"},
+	{"key", cmd_key, 4, "ID MOD BUTTON DOWN -- press or release a key"},
+	{"screensaver", cmd_screensaver, 1, "ON -- start or stop the screensaver"},
+	{"clip", cmd_clip, 1, "TEXT -- send text to the clipboard"},
+	{"paste", cmd_paste, 1, "BYTES -- send that much text to the clipboard"},
+	{"calv", cmd_calv, 0, "[N] -- time N keepalive round trips"},
+	{"storm", cmd_storm, 3, "move|rel|wheel|key RATE COUNT -- send events at RATE per second (0 for no limit), then time how long it takes to catch up"},
+	{"sleep", cmd_sleep, 1, "MS -- keep the connection going for a while"},
+	{"wait-close", cmd_wait_close, 0, "[MS] -- wait for the client to disconnect"},
+	{"cbye", cmd_close, 0, "say goodbye and close the connection"},
+	{"ebsy", cmd_close, 0, "claim the screen name is in use and close the connection"},
+	{"ebad", cmd_close, 0, "report a protocol error and close the connection"},
+	{"echo", cmd_echo, 0, "TEXT -- print a note to the output"},
+};
+
+static bool run_line(char *line, int lineno)
+{
+	char *argv[8];
+	int argc = 0;
+	size_t i;
+	char *tok;
+
+	line[strcspn(line, "#\r\n")] = '\0';
+	line += strspn(line, " \t");
+	/* text to put on the clipboard is everything after the command */
+	if (!strncmp(line, "clip ", 5)) {
+		argv[argc++] = "clip";
+		argv[argc++] = line + 5;
+	}
+	for (tok = argc ? NULL : strtok(line, " \t"); tok && argc < 8; tok = strtok(NULL, " \t")) {
+		argv[argc++] = tok;
+	}
+	if (!argc)
+		return true;
+	if (!strcmp(argv[0], "bye"))
+		argv[0] = "cbye";
+	for (i = 0; i < sizeof(cmds)/sizeof(*cmds); ++i) {
+		if (strcmp(argv[0], cmds[i].name))
+			continue;
+		if (argc - 1 < cmds[i].argc) {
+			fprintf(stderr, "line %d: %s %s\n", lineno, cmds[i].name, cmds[i].help);
+			return false;
+		}
+		if (srv.fd == -1 && cmds[i].func != cmd_accept && cmds[i].func != cmd_echo) {
+			fprintf(stderr, "line %d: not connected\n", lineno);
+			return false;
+		}
+		if (!cmds[i].func(argc, argv)) {
+			fprintf(stderr, "line %d: %s failed\n", lineno, cmds[i].name);
+			return false;
+		}
+		return true;
+	}
+	fprintf(stderr, "line %d: unknown command '%s'\n", lineno, argv[0]);
+	return false;
+}
+
+static int rtt_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+static void rtt_summary(void)
+{
+	size_t n = srv.rtt_count;
+
+	if (!n)
+		return;
+	qsort(srv.rtt, n, sizeof(*srv.rtt), rtt_cmp);
+	printf("keepalive round trips: n=%zu min=%.1fus p50=%.1fus p99=%.1fus max=%.1fus\n",
+			n,
+			srv.rtt[0] / 1e3,
+			srv.rtt[n / 2] / 1e3,
+			srv.rtt[n * 99 / 100] / 1e3,
+			srv.rtt[n - 1] / 1e3);
+}
+
+static void usage_cmds(void)
+{
+	size_t i;
+
+	fprintf(stderr, "\nScript commands, one per line:\n");
+	for (i = 0; i < sizeof(cmds)/sizeof(*cmds); ++i) {
+		fprintf(stderr, "\t%s: %s\n", cmds[i].name, cmds[i].help);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int ret = EXIT_FAILURE;
+	int opt;
+	int lineno = 0;
+	union sopt_arg soptarg = {0};
+	char *addr = "127.0.0.1";
+	char *port = "24800";
+	char *script = NULL;
+	char *cert = NULL;
+	char *key = NULL;
+	char *key_alloc = NULL;
+	FILE *f = NULL;
+	char *line = NULL;
+	size_t line_size = 0;
+
+	sopt_usage_set(optspec, argv[0], "Scripted Synergy server, for testing and benchmarking clients");
+	while ((opt = sopt_getopt_s(argc, argv, optspec, NULL, NULL, &soptarg)) != -1) {
+		switch (opt) {
+			case 'h':
+				sopt_usage_s();
+				usage_cmds();
+				return EXIT_SUCCESS;
+			case 'b':
+				addr = soptarg.str;
+				break;
+			case 'p':
+				port = soptarg.str;
+				break;
+			case 's':
+				script = soptarg.str;
+				break;
+			case 'c':
+				cert = soptarg.str;
+				break;
+			case 'k':
+				key = soptarg.str;
+				break;
+			case 'i':
+				srv.imp = soptarg.str;
+				break;
+			default:
+				sopt_usage_s();
+				return EXIT_FAILURE;
+		}
+	}
+	/* we would rather know about a closed connection from write() */
+	signal(SIGPIPE, SIG_IGN);
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	if (cert) {
+		if (!key) {
+			key_alloc = xmalloc(strlen(cert) + sizeof(".key"));
+			sprintf(key_alloc, "%s.key", cert);
+			key = key_alloc;
+		}
+		if (!tls_setup(cert, key))
+			goto done;
+	}
+	if (!script) {
+		f = fmemopen((char *)default_script, strlen(default_script), "r");
+	} else if (!strcmp(script, "-")) {
+		f = stdin;
+	} else {
+		f = fopen(script, "r");
+	}
+	if (!f) {
+		perror("script");
+		goto done;
+	}
+	if (!listen_setup(addr, port))
+		goto done;
+	printf("listening on %s port %s%s\n", addr, port, srv.tls ? " with TLS" : "");
+	while (getline(&line, &line_size, f) != -1) {
+		if (!run_line(line, ++lineno))
+			goto done;
+	}
+	/* let the client finish with the last of it */
+	if (srv.fd != -1 && srv.out_len)
+		flush();
+	ret = EXIT_SUCCESS;
+done:
+	rtt_summary();
+	conn_close();
+	if (srv.listen_fd != -1)
+		close(srv.listen_fd);
+	if (f && f != stdin)
+		fclose(f);
+	if (srv.tls)
+		tls_free(srv.tls);
+	free(line);
+	free(key_alloc);
+	free(srv.rtt);
+	return ret;
+}
@@ -4,6 +4,12 @@
 #include "clip.h"
 #include "net.h"
 #include "os.h"
+#include "latency.h"
+#include "metrics.h"
+#include "ctl.h"
+#include "trace.h"
+#include "inject.h"
+#include "loop.h"
 #include <stdlib.h>
 #include <stdbool.h>
 #include <unistd.h>
@@ -14,12 +20,24 @@
 #include <errno.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
-#include <arpa/inet.h>
 #include <sys/stat.h>
-#include <netdb.h>
 #include <time.h>
 #include <tls.h>
 #include <assert.h>
+#include <pthread.h>
+
+/* receive timestamps, to stamp injected events with when they arrived */
+#if defined(SO_TIMESTAMPNS)
+#define NET_SO_TIMESTAMP SO_TIMESTAMPNS
+#define NET_SCM_TIMESTAMP SCM_TIMESTAMPNS
+typedef struct timespec net_stamp;
+#define NET_STAMP_NS(s) ((uint64_t)(s).tv_sec * 1000000000 + (s).tv_nsec)
+#elif defined(SO_TIMESTAMP)
+#define NET_SO_TIMESTAMP SO_TIMESTAMP
+#define NET_SCM_TIMESTAMP SCM_TIMESTAMP
+typedef struct timeval net_stamp;
+#define NET_STAMP_NS(s) ((uint64_t)(s).tv_sec * 1000000000 + (s).tv_usec * 1000)
+#endif
 
 static char *load_cert_hash(const char *host)
 {
@@ -41,136 +59,252 @@ static bool store_cert_hash(const char *host, const char *hash)
 	return ret;
 }
 
-static bool syn_connect_setup(struct synNetContext *snet_ctx, struct addrinfo *ai)
+/* read from the socket, noting when the kernel received the data; the stamp
+ * is in realtime, so it is carried over to the monotonic clock by its age */
+static ssize_t recv_stamped(struct synNetContext *snet_ctx, void *buf, size_t len)
+{
+	struct iovec iov = {
+		.iov_base = buf,
+		.iov_len = len,
+	};
+#if defined(NET_SO_TIMESTAMP)
+	union {
+		char buf[CMSG_SPACE(sizeof(net_stamp))];
+		struct cmsghdr align;
+	} control;
+	struct cmsghdr *cmsg;
+	struct timespec real;
+	net_stamp stamp;
+	uint64_t now, age;
+#endif
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+#if defined(NET_SO_TIMESTAMP)
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+#endif
+	};
+	ssize_t ret;
+
+	if ((ret = recvmsg(snet_ctx->fd, &msg, 0)) < 1)
+		return ret;
+	snet_ctx->rx_time = osGetMonoNs();
+#if defined(NET_SO_TIMESTAMP)
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != NET_SCM_TIMESTAMP)
+			continue;
+		memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+		clock_gettime(CLOCK_REALTIME, &real);
+		now = NET_STAMP_NS(real);
+		age = now > NET_STAMP_NS(stamp) ? now - NET_STAMP_NS(stamp) : 0;
+		if (age < snet_ctx->rx_time)
+			snet_ctx->rx_time -= age;
+		break;
+	}
+#endif
+	return ret;
+}
+
+static ssize_t syn_tls_read(struct tls *ctx, void *buf, size_t len, void *arg)
+{
+	ssize_t ret;
+
+	if ((ret = recv_stamped(arg, buf, len)) == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return TLS_WANT_POLLIN;
+	return ret;
+}
+
+static ssize_t syn_tls_write(struct tls *ctx, const void *buf, size_t len, void *arg)
+{
+	struct synNetContext *snet_ctx = arg;
+	ssize_t ret;
+
+	if ((ret = write(snet_ctx->fd, buf, len)) == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return TLS_WANT_POLLOUT;
+	return ret;
+}
+
+/* layer TLS over whatever the transport connected */
+static bool syn_tls_setup(struct synNetContext *snet_ctx)
 {
 	struct tls_config *cfg;
 	const char *peer_hash;
 	char *cert_path;
 
-	if ((snet_ctx->fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol)) == -1) {
-		logPErr("socket");
+	if (!(snet_ctx->tls_ctx = tls_client())) {
+		logErr("Could not create tls client context");
 		return false;
 	}
-	if (connect(snet_ctx->fd, ai->ai_addr, ai->ai_addrlen)) {
-		logPErr("connect");
+	if (!(cfg = tls_config_new())) {
+		logErr("Could not create tls configuration structure");
 		return false;
 	}
-	if (snet_ctx->tls) {
-		if (!(snet_ctx->tls_ctx = tls_client())) {
-			logErr("Could not create tls client context");
+	/* figure out certificate hash business */
+	if (!(snet_ctx->tls_hash = load_cert_hash(snet_ctx->tls_name))) {
+		if (!snet_ctx->tls_tofu) {
+			logErr("No certificate hash available");
 			return false;
 		}
-		if (!(cfg = tls_config_new())) {
-			logErr("Could not create tls configuration structure");
+		/* if we are trusting on first use we just defer this
+		 * until a successful handshake */
+	}
+	/* set client certificate */
+	cert_path = osGetHomeConfigPath("tls/cert");
+	if (osFileExists(cert_path)) {
+		if (tls_config_set_key_file(cfg, cert_path)) {
+			logErr("Could not load client key: %s", tls_error(snet_ctx->tls_ctx));
+			tls_config_free(cfg);
+			free(cert_path);
 			return false;
 		}
-		/* figure out certificate hash business */
-		if (!(snet_ctx->tls_hash = load_cert_hash(snet_ctx->host))) {
-			if (!snet_ctx->tls_tofu) {
-				logErr("No certificate hash available");
-				return false;
-			}
-			/* if we are trusting on first use we just defer this
-			 * until a successful handshake */
-		}
-		/* set client certificate */
-		cert_path = osGetHomeConfigPath("tls/cert");
-		if (osFileExists(cert_path)) {
-			if (tls_config_set_key_file(cfg, cert_path)) {
-				logErr("Could not load client key: %s", tls_error(snet_ctx->tls_ctx));
-				tls_config_free(cfg);
-				free(cert_path);
-				return false;
-			}
-			if (tls_config_set_cert_file(cfg, cert_path)) {
-				logErr("Could not load client certificate: %s", tls_error(snet_ctx->tls_ctx));
-				tls_config_free(cfg);
-				free(cert_path);
-				return false;
-			}
-		}
-		free(cert_path);
-		/* we operate on hashes instead -- this is fine for now */
-		tls_config_insecure_noverifycert(cfg);
-		tls_config_insecure_noverifyname(cfg);
-		if (tls_configure(snet_ctx->tls_ctx, cfg)) {
-			logErr("Could not configure TLS context: %s", tls_error(snet_ctx->tls_ctx));
+		if (tls_config_set_cert_file(cfg, cert_path)) {
+			logErr("Could not load client certificate: %s", tls_error(snet_ctx->tls_ctx));
 			tls_config_free(cfg);
+			free(cert_path);
 			return false;
 		}
+	}
+	free(cert_path);
+	/* we operate on hashes instead -- this is fine for now */
+	tls_config_insecure_noverifycert(cfg);
+	tls_config_insecure_noverifyname(cfg);
+	if (tls_configure(snet_ctx->tls_ctx, cfg)) {
+		logErr("Could not configure TLS context: %s", tls_error(snet_ctx->tls_ctx));
 		tls_config_free(cfg);
-		if (tls_connect_socket(snet_ctx->tls_ctx, snet_ctx->fd, snet_ctx->host)) {
-			logErr("tls_connect error: %s", tls_error(snet_ctx->tls_ctx));
-			return false;
-		}
-		if (tls_handshake(snet_ctx->tls_ctx)) {
-			logErr("tls_handshake error: %s", tls_error(snet_ctx->tls_ctx));
-			return false;
-		}
-		if (!(peer_hash = tls_peer_cert_hash(snet_ctx->tls_ctx))) {
-			logErr("Server provided no certificate");
-			return false;
-		}
-		if (!snet_ctx->tls_hash) {
-			logInfo("Trust-on-first-use enabled, saving hash %s", tls_peer_cert_hash(snet_ctx->tls_ctx));
-			snet_ctx->tls_hash = xstrdup(peer_hash);
-			if (!store_cert_hash(snet_ctx->host, peer_hash)) {
-				logErr("Could not save certificate hash");
-				/* we don't want the connection to proceed if
-				 * we can't save the hash -- otherwise, 'trust
-				 * on first use' just becomes 'trust on every
-				 * use' and a total waste of time */
-				return false;
-			}
-		}
-		if (strcasecmp(snet_ctx->tls_hash, peer_hash)) {
-			logErr("CERTIFICATE HASH MISMATCH: %s (client) != %s (server)", snet_ctx->tls_hash, peer_hash);
+		return false;
+	}
+	tls_config_free(cfg);
+	/* our own I/O, for the receive timestamps */
+	if (tls_connect_cbs(snet_ctx->tls_ctx, syn_tls_read, syn_tls_write, snet_ctx, snet_ctx->transport == SYN_NET_TCP ? snet_ctx->host : NULL)) {
+		logErr("tls_connect error: %s", tls_error(snet_ctx->tls_ctx));
+		return false;
+	}
+	if (tls_handshake(snet_ctx->tls_ctx)) {
+		logErr("tls_handshake error: %s", tls_error(snet_ctx->tls_ctx));
+		return false;
+	}
+	if (!(peer_hash = tls_peer_cert_hash(snet_ctx->tls_ctx))) {
+		logErr("Server provided no certificate");
+		return false;
+	}
+	if (!snet_ctx->tls_hash) {
+		logInfo("Trust-on-first-use enabled, saving hash %s", tls_peer_cert_hash(snet_ctx->tls_ctx));
+		snet_ctx->tls_hash = xstrdup(peer_hash);
+		if (!store_cert_hash(snet_ctx->tls_name, peer_hash)) {
+			logErr("Could not save certificate hash");
+			/* we don't want the connection to proceed if
+			 * we can't save the hash -- otherwise, 'trust
+			 * on first use' just becomes 'trust on every
+			 * use' and a total waste of time */
 			return false;
 		}
 	}
+	if (strcasecmp(snet_ctx->tls_hash, peer_hash)) {
+		logErr("CERTIFICATE HASH MISMATCH: %s (client) != %s (server)", snet_ctx->tls_hash, peer_hash);
+		return false;
+	}
 	return true;
 }
 
 
-static bool syn_connect(uSynergyCookie cookie)
+/* the first connection, made while the rest of startup carries on */
+static struct {
+	pthread_t thread;
+	bool pending;
+	bool ret;
+	sigset_t mask;
+} early;
+
+static bool syn_connect_now(struct synNetContext *snet_ctx)
 {
-	bool ret = false;
-	int gai_ret;
-	struct addrinfo *hostinfo, *h;
-	struct synNetContext *snet_ctx = cookie;
-	uSynergyContext *syn_ctx = snet_ctx->syn_ctx;
-	logInfo("Going to connect to %s at port %s", snet_ctx->host, snet_ctx->port);
-	struct addrinfo hints = {
-		.ai_family = AF_UNSPEC,
-		.ai_socktype = SOCK_STREAM
-	};
-	if ((gai_ret = getaddrinfo(snet_ctx->host, snet_ctx->port, &hints, &hostinfo))) {
-		if (gai_ret == EAI_SYSTEM) {
-			logPErr("getaddrinfo system error");
-			return false;
-		} else {
-			logErr("getaddrinfo failed: %s", gai_strerror(gai_ret));
-		}
-		return false;
-	}
+	bool ret;
+
 	synNetDisconnect(snet_ctx);
-	for (h = hostinfo; h; h = h->ai_next) {
-		/* catch connection timeouts */
+	ret = snet_ctx->connect(snet_ctx);
+#if defined(NET_SO_TIMESTAMP)
+	if (ret) {
+		int on = 1;
+		/* not every transport has them, which is fine */
+		if (setsockopt(snet_ctx->fd, SOL_SOCKET, NET_SO_TIMESTAMP, &on, sizeof(on)))
+			logPDbg("Could not enable receive timestamps");
+	}
+#endif
+	if (ret && snet_ctx->tls) {
+		/* catch handshake timeouts */
 		alarm(USYNERGY_IDLE_TIMEOUT/1000);
-		ret = syn_connect_setup(snet_ctx, h);
+		ret = syn_tls_setup(snet_ctx);
 		alarm(0);
+	}
+	if (!ret) {
+		/* it didn't work, so we aren't strictly connected...
+		 * but this prevents fd and memory leakage by cleaning
+		 * up after the partial failure */
+		synNetDisconnect(snet_ctx);
+	} else {
+		traceRecordConnect();
+	}
+	return ret;
+}
 
-		if (ret) {
-			syn_ctx->m_lastMessageTime = syn_ctx->m_getTimeFunc();
-			break;
-		} else {
-			/* it didn't work, so we aren't strictly connected...
-			 * but this prevents fd and memory leakage by cleaning
-			 * up after the partial failure */
-			synNetDisconnect(snet_ctx);
-		}
+static void *syn_connect_early(void *arg)
+{
+	sigset_t set;
+
+	/* the handshake timeout has to interrupt this thread, not the other */
+	sigemptyset(&set);
+	sigaddset(&set, SIGALRM);
+	pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+	early.ret = syn_connect_now(arg);
+	return NULL;
+}
+
+bool synNetConnectEarly(struct synNetContext *snet_ctx)
+{
+	sigset_t set;
+	int err;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGALRM);
+	pthread_sigmask(SIG_BLOCK, &set, &early.mask);
+	if ((err = pthread_create(&early.thread, NULL, syn_connect_early, snet_ctx))) {
+		logErr("Could not start connecting early: %s", strerror(err));
+		pthread_sigmask(SIG_SETMASK, &early.mask, NULL);
+		return false;
+	}
+	early.pending = true;
+	return true;
+}
+
+static void syn_poll_proc(int fd, short revents, void *data)
+{
+	struct synNetContext *snet_ctx = data;
+
+	latencyMark(LATENCY_STAGE_READY);
+	uSynergyUpdate(snet_ctx->syn_ctx);
+	/* ignore everything else until synergy is ready again */
+	if (!snet_ctx->syn_ctx->m_connected)
+		loopBreak();
+}
+
+static bool syn_connect(uSynergyCookie cookie)
+{
+	struct synNetContext *snet_ctx = cookie;
+	bool ret;
+
+	if (early.pending) {
+		pthread_join(early.thread, NULL);
+		pthread_sigmask(SIG_SETMASK, &early.mask, NULL);
+		early.pending = false;
+		latencyPhase("server connection");
+		ret = early.ret;
+	} else {
+		ret = syn_connect_now(snet_ctx);
 	}
-	freeaddrinfo(hostinfo);
+	/* done here rather than on connecting, which may be on another
+	 * thread */
+	if (ret)
+		snet_ctx->in_loop = loopAdd(snet_ctx->fd, POLLIN, LOOP_PRIO_INPUT, syn_poll_proc, snet_ctx);
 	return ret;
 }
 static bool tls_write_full(struct tls *ctx, const unsigned char *buf, size_t len)
@@ -194,57 +328,57 @@ static bool tls_write_full(struct tls *ctx, const unsigned char *buf, size_t len
 static bool syn_send(uSynergyCookie cookie, const uint8_t *buf, int len)
 {
 	struct synNetContext *snet_ctx = cookie;
-	return snet_ctx->tls_ctx ?
+	bool ret;
+
+	metrics.bytes_out += len;
+	ret = snet_ctx->tls_ctx ?
 		tls_write_full(snet_ctx->tls_ctx, buf, len) :
 		write_full(snet_ctx->fd, buf, len, 0);
+	if (ret && snet_ctx->heartbeat && len >= 8 && !memcmp(buf + 4, "CALV", 4))
+		snet_ctx->heartbeat(snet_ctx);
+	return ret;
 }
-struct pollfd netPollFd[POLLFD_COUNT];
-void netPollInit(void)
+static void wl_poll_proc(int fd, short revents, void *data)
 {
-	for (int i = 0; i < POLLFD_COUNT; ++i) {
-		netPollFd[i].events = POLLIN;
-		netPollFd[i].fd = -1;
-	}
+	wlPollProc(data, revents);
+}
+void netPollInit(struct wlContext *wl_ctx)
+{
+	/* the injection thread, if any, looks after the display itself,
+	 * and a headless run has no display to look after */
+	if (!injectThreaded() && !wl_ctx->headless)
+		loopAdd(wlPrepareFd(wl_ctx), POLLIN, LOOP_PRIO_NORMAL, wl_poll_proc, wl_ctx);
 }
 void netPoll(struct synNetContext *snet_ctx, struct wlContext *wl_ctx)
 {
-	int ret;
+	int ret, timeout;
 	uSynergyContext *syn_ctx = snet_ctx->syn_ctx;
+	bool wl_here = !injectThreaded();
 	if (snet_ctx->fd == -1) {
 		logErr("INVALID FILE DESCRIPTOR for synergy context");
 	}
-	int wlfd = wlPrepareFd(wl_ctx);
-	netPollFd[POLLFD_SYN].fd = snet_ctx->fd;
-	netPollFd[POLLFD_WL].fd = wlfd;
-	netPollFd[POLLFD_CLIP_MON].fd = clipMonitorFd;
-	int nfd = syn_ctx->m_connected ? POLLFD_COUNT : 1;
-	while ((ret = poll(netPollFd, nfd, USYNERGY_IDLE_TIMEOUT)) > 0) {
+	for (;;) {
+		/* wake up at least once per heartbeat period, so a dead server
+		 * is noticed after the configured number of misses */
+		timeout = uSynergyKeepAliveWait(syn_ctx, syn_ctx->m_getTimeFunc());
+		if (wl_here)
+			timeout = wlPollTimeout(wl_ctx, timeout);
+		if ((ret = loopWait(timeout)) < 0)
+			break;
 		sigHandleRun();
-		if (netPollFd[POLLFD_SYN].revents & POLLIN) {
-			uSynergyUpdate(syn_ctx);
-		}
-		if ((syn_ctx->m_getTimeFunc() - syn_ctx->m_lastMessageTime) > USYNERGY_IDLE_TIMEOUT) {
-			logErr("Synergy timeout encountered -- disconnecting");
+		if (!uSynergyKeepAliveCheck(syn_ctx, syn_ctx->m_getTimeFunc())) {
+			logErr("Server heartbeat lost -- disconnecting");
+			uSynergyDisconnect(syn_ctx, USYNERGY_ERROR_TIMEOUT);
 			synNetDisconnect(snet_ctx);
 			return;
 		}
-		sigHandleRun();
-		/* ignore everything else until synergy is ready */
-		if (syn_ctx->m_connected) {
-			wlPollProc(wl_ctx, netPollFd[POLLFD_WL].revents);
-			sigHandleRun();
-			clipMonitorPollProc(&netPollFd[POLLFD_CLIP_MON]);
-			sigHandleRun();
-			for (int i = POLLFD_CLIP_UPDATER; i < POLLFD_COUNT; ++i) {
-				clipMonitorPollProc(netPollFd + i);
-				sigHandleRun();
-			}
-		}
-		nfd = syn_ctx->m_connected ? POLLFD_COUNT : 1;
-	}
-	if (!ret) {
-		logErr("Poll timeout encountered -- disconnecting synergy");
-		synNetDisconnect(snet_ctx);
+		/* a reconnect may have been requested */
+		if (snet_ctx->fd == -1 || !syn_ctx->m_connected)
+			return;
+		/* deferred work may be due, whether or not the display was
+		 * ready */
+		if (wl_here)
+			wlPollProc(wl_ctx, 0);
 	}
 	sigHandleRun();
 }
@@ -260,7 +394,7 @@ static bool syn_recv(uSynergyCookie cookie, uint8_t *buf, int max_len, int *out_
 			*out_len = tls_read(snet_ctx->tls_ctx, buf, max_len);
 		} while (*out_len == TLS_WANT_POLLIN || *out_len == TLS_WANT_POLLOUT);
 	} else {
-		*out_len = read(snet_ctx->fd, buf, max_len);
+		*out_len = recv_stamped(snet_ctx, buf, max_len);
 	}
 	alarm(0);
 	if (*out_len < 1) {
@@ -268,6 +402,15 @@ static bool syn_recv(uSynergyCookie cookie, uint8_t *buf, int max_len, int *out_
 		snet_ctx->syn_ctx->m_lastError = USYNERGY_ERROR_TIMEOUT;
 		return false;
 	}
+	metrics.bytes_in += *out_len;
+	latencyArrival(snet_ctx->rx_time);
+	traceRecordRecv(buf, *out_len);
+#if defined(TCP_QUICKACK)
+	if (snet_ctx->quickack) {
+		int on = 1;
+		setsockopt(snet_ctx->fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+	}
+#endif
 	return true;
 }
 
@@ -286,14 +429,51 @@ static uint32_t syn_get_time(void)
 	return ms;
 }
 
+/* split an optional port off the end of an address, handling [v6] */
+static char *split_port(char *addr, const char *def)
+{
+	char *end;
+
+	if (*addr == '[' && (end = strchr(addr, ']'))) {
+		*end = '\0';
+		memmove(addr, addr + 1, end - addr);
+		return xstrdup(end[1] == ':' ? end + 2 : def);
+	}
+	if ((end = strrchr(addr, ':')) && end == strchr(addr, ':')) {
+		*end = '\0';
+		return xstrdup(end + 1);
+	}
+	return xstrdup(def);
+}
+
 bool synNetInit(struct synNetContext *snet_ctx, uSynergyContext *context, const char *host, const char *port, bool tls, bool tofu)
 {
-	snet_ctx->host = xstrdup(host);
-	snet_ctx->port = xstrdup(port);
+	bool ret;
+
 	snet_ctx->syn_ctx = context;
 	snet_ctx->fd = -1;
 	snet_ctx->tls = tls;
 	snet_ctx->tls_tofu = tofu;
+	if (!strncmp(host, "unix://", 7)) {
+		snet_ctx->host = xstrdup(host + 7);
+		snet_ctx->port = NULL;
+		ret = synNetInitUnix(snet_ctx);
+	} else if (!strncmp(host, "vsock://", 8)) {
+		snet_ctx->host = xstrdup(host + 8);
+		snet_ctx->port = split_port(snet_ctx->host, port);
+		ret = synNetInitVsock(snet_ctx);
+	} else if (!strncmp(host, "tcp://", 6)) {
+		snet_ctx->host = xstrdup(host + 6);
+		snet_ctx->port = split_port(snet_ctx->host, port);
+		ret = synNetInitTcp(snet_ctx);
+	} else {
+		/* plain host names are left alone, colons and all */
+		snet_ctx->host = xstrdup(host);
+		snet_ctx->port = xstrdup(port);
+		ret = synNetInitTcp(snet_ctx);
+	}
+	if (!ret)
+		return false;
 	context->m_connectFunc = syn_connect;
 	context->m_sendFunc = syn_send;
 	context->m_receiveFunc = syn_recv;
@@ -307,6 +487,7 @@ bool synNetDisconnect(struct synNetContext *snet_ctx)
 {
 	if (snet_ctx->fd == -1)
 		return false;
+	snet_ctx->quickack = false;
 	if (snet_ctx->tls_ctx) {
 		if (tls_close(snet_ctx->tls_ctx)) {
 			logErr("tls_close error: %s", snet_ctx->tls_ctx);
@@ -316,6 +497,10 @@ bool synNetDisconnect(struct synNetContext *snet_ctx)
 		tls_free(snet_ctx->tls_ctx);
 		snet_ctx->tls_ctx = NULL;
 	}
+	if (snet_ctx->in_loop) {
+		loopRemove(snet_ctx->fd);
+		snet_ctx->in_loop = false;
+	}
 	shutdown(snet_ctx->fd, SHUT_RDWR);
 	close(snet_ctx->fd);
 	snet_ctx->fd = -1;
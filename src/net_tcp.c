@@ -0,0 +1,167 @@
+#include "net.h"
+#include "config.h"
+#include "xmem.h"
+#include "log.h"
+#include "metrics.h"
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/* set a socket option from the net/ config section, if configured, logging
+ * and recording whatever the kernel actually settled on */
+static void tcp_sockopt(int fd, enum metricsSockopt id, int level, int opt, long def)
+{
+	char *key;
+	int val, got;
+	socklen_t len = sizeof(got);
+
+	xasprintf(&key, "net/%s", metricsSockoptName[id]);
+	val = configTryLong(key, def);
+	free(key);
+	metrics.sockopt[id] = -1;
+	if (val < 0)
+		return;
+	if (setsockopt(fd, level, opt, &val, sizeof(val)) == -1) {
+		logWarn("Could not set %s to %d: %s", metricsSockoptName[id], val, strerror(errno));
+		return;
+	}
+	if (getsockopt(fd, level, opt, &got, &len) == -1)
+		got = val;
+	logInfo("Socket option %s = %d", metricsSockoptName[id], got);
+	metrics.sockopt[id] = got;
+}
+
+static void tcp_sockopt_setup(struct synNetContext *snet_ctx, struct addrinfo *ai)
+{
+	int fd = snet_ctx->fd;
+
+	/* replies are tiny and latency-sensitive, so Nagle only hurts */
+	tcp_sockopt(fd, METRICS_SOCKOPT_NODELAY, IPPROTO_TCP, TCP_NODELAY, 1);
+#if defined(TCP_QUICKACK)
+	tcp_sockopt(fd, METRICS_SOCKOPT_QUICKACK, IPPROTO_TCP, TCP_QUICKACK, -1);
+	snet_ctx->quickack = metrics.sockopt[METRICS_SOCKOPT_QUICKACK] > 0;
+#endif
+#if defined(SO_PRIORITY)
+	tcp_sockopt(fd, METRICS_SOCKOPT_PRIORITY, SOL_SOCKET, SO_PRIORITY, -1);
+#endif
+	if (ai->ai_family == AF_INET6) {
+		tcp_sockopt(fd, METRICS_SOCKOPT_TOS, IPPROTO_IPV6, IPV6_TCLASS, -1);
+	} else {
+		tcp_sockopt(fd, METRICS_SOCKOPT_TOS, IPPROTO_IP, IP_TOS, -1);
+	}
+	tcp_sockopt(fd, METRICS_SOCKOPT_RCVBUF, SOL_SOCKET, SO_RCVBUF, -1);
+	tcp_sockopt(fd, METRICS_SOCKOPT_SNDBUF, SOL_SOCKET, SO_SNDBUF, -1);
+#if defined(SO_BUSY_POLL)
+	/* spins in the kernel on reads, trading CPU for latency */
+	tcp_sockopt(fd, METRICS_SOCKOPT_BUSY_POLL, SOL_SOCKET, SO_BUSY_POLL, -1);
+#endif
+}
+
+/* have the kernel give up on the connection within the same number of
+ * heartbeat periods we would, rather than retransmitting for minutes */
+static void tcp_keepalive_setup(struct synNetContext *snet_ctx)
+{
+	uSynergyContext *syn_ctx = snet_ctx->syn_ctx;
+	int on = 1;
+	int period, timeout, count = syn_ctx->m_keepAliveMisses;
+
+	snet_ctx->keepalive_rate = syn_ctx->m_keepAliveRate;
+	if (!configTryBool("net/tcp_keepalive", true))
+		return;
+	period = syn_ctx->m_keepAliveRate ? syn_ctx->m_keepAliveRate : USYNERGY_IDLE_TIMEOUT;
+	timeout = period * count + period / 2;
+	period = period < 1000 ? 1 : period / 1000;
+	logDbg("TCP keepalive every %ds, user timeout %dms", period, timeout);
+	if (setsockopt(snet_ctx->fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) == -1) {
+		logPWarn("SO_KEEPALIVE");
+		return;
+	}
+#if defined(TCP_KEEPIDLE) && defined(TCP_KEEPINTVL) && defined(TCP_KEEPCNT)
+	if (setsockopt(snet_ctx->fd, IPPROTO_TCP, TCP_KEEPIDLE, &period, sizeof(period)) == -1)
+		logPWarn("TCP_KEEPIDLE");
+	if (setsockopt(snet_ctx->fd, IPPROTO_TCP, TCP_KEEPINTVL, &period, sizeof(period)) == -1)
+		logPWarn("TCP_KEEPINTVL");
+	if (setsockopt(snet_ctx->fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count)) == -1)
+		logPWarn("TCP_KEEPCNT");
+#endif
+#if defined(TCP_USER_TIMEOUT)
+	if (setsockopt(snet_ctx->fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, sizeof(timeout)) == -1)
+		logPWarn("TCP_USER_TIMEOUT");
+#endif
+}
+
+/* sample the kernel's RTT estimate as each heartbeat is answered, and
+ * follow any change in the heartbeat period */
+static void tcp_heartbeat(struct synNetContext *snet_ctx)
+{
+	if (snet_ctx->syn_ctx->m_keepAliveRate != snet_ctx->keepalive_rate)
+		tcp_keepalive_setup(snet_ctx);
+#if defined(__linux__)
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+
+	if (getsockopt(snet_ctx->fd, IPPROTO_TCP, TCP_INFO, &info, &len) == -1) {
+		logPDbg("TCP_INFO");
+		return;
+	}
+	metrics.keepalive_rtt_ns = (uint64_t)info.tcpi_rtt * 1000;
+#endif
+}
+
+static bool tcp_connect_setup(struct synNetContext *snet_ctx, struct addrinfo *ai)
+{
+	if ((snet_ctx->fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol)) == -1) {
+		logPErr("socket");
+		return false;
+	}
+	if (connect(snet_ctx->fd, ai->ai_addr, ai->ai_addrlen)) {
+		logPErr("connect");
+		return false;
+	}
+	tcp_sockopt_setup(snet_ctx, ai);
+	tcp_keepalive_setup(snet_ctx);
+	return true;
+}
+
+static bool tcp_connect(struct synNetContext *snet_ctx)
+{
+	bool ret = false;
+	int gai_ret;
+	struct addrinfo *hostinfo, *h;
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM
+	};
+
+	logInfo("Going to connect to %s at port %s", snet_ctx->host, snet_ctx->port);
+	if ((gai_ret = getaddrinfo(snet_ctx->host, snet_ctx->port, &hints, &hostinfo))) {
+		if (gai_ret == EAI_SYSTEM) {
+			logPErr("getaddrinfo system error");
+		} else {
+			logErr("getaddrinfo failed: %s", gai_strerror(gai_ret));
+		}
+		return false;
+	}
+	for (h = hostinfo; h; h = h->ai_next) {
+		/* catch connection timeouts */
+		alarm(USYNERGY_IDLE_TIMEOUT/1000);
+		ret = tcp_connect_setup(snet_ctx, h);
+		alarm(0);
+		if (ret)
+			break;
+		/* clean up after the partial failure before the next try */
+		synNetDisconnect(snet_ctx);
+	}
+	freeaddrinfo(hostinfo);
+	return ret;
+}
+
+bool synNetInitTcp(struct synNetContext *snet_ctx)
+{
+	snet_ctx->transport = SYN_NET_TCP;
+	snet_ctx->connect = tcp_connect;
+	snet_ctx->heartbeat = tcp_heartbeat;
+	/* plain host names, as certificate hashes have always been keyed */
+	snet_ctx->tls_name = xstrdup(snet_ctx->host);
+	xasprintf(&snet_ctx->url, "tcp://%s:%s", snet_ctx->host, snet_ctx->port);
+	return true;
+}
@@ -0,0 +1,46 @@
+#include "net.h"
+#include "xmem.h"
+#include "log.h"
+
+/* for a local endpoint, such as socat or stunnel forwarding to the server */
+static bool unix_connect(struct synNetContext *snet_ctx)
+{
+	struct sockaddr_un addr = {0};
+
+	logInfo("Going to connect to socket at %s", snet_ctx->host);
+	if (strlen(snet_ctx->host) >= sizeof(addr.sun_path)) {
+		logErr("Socket path %s too long", snet_ctx->host);
+		return false;
+	}
+	strcpy(addr.sun_path, snet_ctx->host);
+	addr.sun_family = AF_UNIX;
+	if ((snet_ctx->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+		logPErr("socket");
+		return false;
+	}
+	alarm(USYNERGY_IDLE_TIMEOUT/1000);
+	if (connect(snet_ctx->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		alarm(0);
+		logPErr("connect");
+		return false;
+	}
+	alarm(0);
+	return true;
+}
+
+bool synNetInitUnix(struct synNetContext *snet_ctx)
+{
+	char *c;
+
+	snet_ctx->transport = SYN_NET_UNIX;
+	snet_ctx->connect = unix_connect;
+	snet_ctx->heartbeat = NULL;
+	/* paths can't be used as config names as-is */
+	xasprintf(&snet_ctx->tls_name, "unix%s", snet_ctx->host);
+	for (c = snet_ctx->tls_name; *c; ++c) {
+		if (*c == '/')
+			*c = '_';
+	}
+	xasprintf(&snet_ctx->url, "unix://%s", snet_ctx->host);
+	return true;
+}
@@ -0,0 +1,71 @@
+#include "net.h"
+#include "xmem.h"
+#include "log.h"
+#if defined(__linux__)
+#include <linux/vm_sockets.h>
+
+/* for a server on the hypervisor host (or another guest), without going
+ * through the IP stack at all */
+static bool vsock_connect(struct synNetContext *snet_ctx)
+{
+	char *end;
+	unsigned long cid, port;
+	struct sockaddr_vm addr = {
+		.svm_family = AF_VSOCK,
+	};
+
+	/* the well-known CIDs may be given by name */
+	if (!strcmp(snet_ctx->host, "host")) {
+		cid = VMADDR_CID_HOST;
+#if defined(VMADDR_CID_LOCAL)
+	/* only in linux 5.6 and later */
+	} else if (!strcmp(snet_ctx->host, "local")) {
+		cid = VMADDR_CID_LOCAL;
+#endif
+	} else {
+		errno = 0;
+		cid = strtoul(snet_ctx->host, &end, 0);
+		if (errno || end == snet_ctx->host || *end || cid > UINT32_MAX) {
+			logErr("Invalid vsock CID %s", snet_ctx->host);
+			return false;
+		}
+	}
+	errno = 0;
+	port = strtoul(snet_ctx->port, &end, 0);
+	if (errno || end == snet_ctx->port || *end || port > UINT32_MAX) {
+		logErr("Invalid vsock port %s", snet_ctx->port);
+		return false;
+	}
+	addr.svm_cid = cid;
+	addr.svm_port = port;
+	logInfo("Going to connect to vsock CID %lu at port %lu", cid, port);
+	if ((snet_ctx->fd = socket(AF_VSOCK, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+		logPErr("socket");
+		return false;
+	}
+	alarm(USYNERGY_IDLE_TIMEOUT/1000);
+	if (connect(snet_ctx->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		alarm(0);
+		logPErr("connect");
+		return false;
+	}
+	alarm(0);
+	return true;
+}
+
+bool synNetInitVsock(struct synNetContext *snet_ctx)
+{
+	snet_ctx->transport = SYN_NET_VSOCK;
+	snet_ctx->connect = vsock_connect;
+	snet_ctx->heartbeat = NULL;
+	xasprintf(&snet_ctx->tls_name, "vsock_%s", snet_ctx->host);
+	xasprintf(&snet_ctx->url, "vsock://%s:%s", snet_ctx->host, snet_ctx->port);
+	return true;
+}
+#else
+bool synNetInitVsock(struct synNetContext *snet_ctx)
+{
+	logErr("vsock is not supported on this platform");
+	return false;
+}
+#endif /* defined(__linux__) */
@@ -3,6 +3,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <limits.h>
+#include <string.h>
 #include <fcntl.h>
 #include <grp.h>
 #include <unistd.h>
@@ -53,6 +55,26 @@ bool osMakeParentDir(const char *path, mode_t mode)
 	return true;
 }
 
+bool osFindExec(const char *name)
+{
+	const char *path, *end;
+	char buf[PATH_MAX];
+	int len;
+
+	if (!(path = getenv("PATH")))
+		path = "/usr/bin:/bin";
+	for (; *path; path = *end ? end + 1 : end) {
+		end = strchrnul(path, ':');
+		/* an empty entry is the current directory */
+		len = end == path ?
+			snprintf(buf, sizeof(buf), "./%s", name) :
+			snprintf(buf, sizeof(buf), "%.*s/%s", (int)(end - path), path, name);
+		if (len < sizeof(buf) && !access(buf, X_OK))
+			return true;
+	}
+	return false;
+}
+
 int osGetAnonFd(void)
 {
 	#if defined(__linux__) || ((defined(__FreeBSD__) && (__FreeBSD_version >= 1300048)))
@@ -0,0 +1,67 @@
+#include "outbuf.h"
+#include "log.h"
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+/* write out as much as the socket will take, returning how much, or -1 if the
+ * client is gone */
+static ssize_t write_some(int fd, const char *buf, size_t len)
+{
+	size_t pos = 0;
+	ssize_t ret;
+
+	while (pos < len) {
+		if ((ret = write(fd, buf + pos, len - pos)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			logPDbg("Client write");
+			return -1;
+		}
+		pos += ret;
+	}
+	return pos;
+}
+
+bool outBufSend(struct outBuf *out, int fd, const char *data, size_t len)
+{
+	ssize_t ret = 0;
+
+	/* nothing may overtake what is already waiting */
+	if (!outBufPending(out)) {
+		if ((ret = write_some(fd, data, len)) == -1)
+			return false;
+		if (ret == len)
+			return true;
+		ssb_rewind(&out->pending);
+		out->sent = 0;
+	}
+	len -= ret;
+	if (out->pending.size - out->pending.pos <= len)
+		ssb_xtruncate(&out->pending, out->pending.pos + len);
+	memcpy(out->pending.buf + out->pending.pos, data + ret, len);
+	out->pending.pos += len;
+	out->pending.buf[out->pending.pos] = '\0';
+	return true;
+}
+
+bool outBufFlush(struct outBuf *out, int fd)
+{
+	ssize_t ret;
+
+	if ((ret = write_some(fd, out->pending.buf + out->sent, outBufPending(out))) == -1)
+		return false;
+	if ((out->sent += ret) == out->pending.pos) {
+		ssb_rewind(&out->pending);
+		out->sent = 0;
+	}
+	return true;
+}
+
+void outBufFree(struct outBuf *out)
+{
+	ssb_free(&out->pending);
+	out->sent = 0;
+}
@@ -2,6 +2,7 @@
 #include "sig.h"
 #include "clip.h"
 #include "wayland.h"
+#include "inject.h"
 
 
 
@@ -9,6 +10,7 @@
 
 volatile sig_atomic_t sigDoExit = 0;
 volatile sig_atomic_t sigDoRestart = 0;
+volatile sig_atomic_t sigDoDump = 0;
 extern struct wlContext wlContext;
 extern uSynergyContext synContext;
 extern struct synNetContext synNetContext;
@@ -22,11 +24,17 @@ static void cleanup(enum sigExitStatus status)
 			kill(clipMonitorPid[i], SIGTERM);
 		}
 	}
+	/* keep a record of what led up to this */
+	if (status != SES_SUCCESS) {
+		flightDumpFile();
+	}
+	latencyDump();
 	/*close stuff*/
 	synNetDisconnect(&synNetContext);
 	if (status != SES_ERROR_WL) {
 		/* this stuff will crash and burn if we are exiting because of
 		 * a wayland error */
+		injectStop();
 		wlIdleInhibit(&wlContext, false);
 		wlClose(&wlContext);
 	}
@@ -36,11 +44,14 @@ static void cleanup(enum sigExitStatus status)
 
 void Exit(enum sigExitStatus status)
 {
+	/* the network thread does the cleaning up */
+	injectExit(status, false);
 	cleanup(status);
 	exit(status);
 }
 void Restart(enum sigExitStatus status)
 {
+	injectExit(status, true);
 	cleanup(status);
 	errno = 0;
 	execvp(argv_reexec[0], argv_reexec);
@@ -78,6 +89,9 @@ static void sig_handle(int sig, siginfo_t *si, void *context)
 		case SIGUSR1:
 			sigDoRestart = true;
 			break;
+		case SIGUSR2:
+			sigDoDump = true;
+			break;
 		case SIGCHLD:
 			if (si && si->si_code == CLD_EXITED) {
 				level = si->si_status ? LOG_WARN : LOG_DBG;
@@ -131,12 +145,14 @@ void sigHandleInit(char **argv)
 	sigaction(SIGINT, &sa, NULL);
 	sigaction(SIGQUIT, &sa, NULL);
 	sigaction(SIGUSR1, &sa, NULL);
+	sigaction(SIGUSR2, &sa, NULL);
 	sigaction(SIGPIPE, &sa, NULL);
 	//don't zombify
 	sa.sa_flags |= SA_NOCLDWAIT;
 	sigaction(SIGCHLD, &sa, NULL);
 	sigemptyset(&set);
 	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGUSR2);
 	sigaddset(&set, SIGTERM);
 	sigaddset(&set, SIGINT);
 	sigaddset(&set, SIGQUIT);
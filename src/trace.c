@@ -0,0 +1,214 @@
+#include "trace.h"
+#include "fdio_full.h"
+#include "xmem.h"
+#include "log.h"
+#include "sig.h"
+#include "latency.h"
+#include "metrics.h"
+#include <stdio.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+int traceFd = -1;
+static uint64_t record_last_ns;
+
+bool traceRecordOpen(const char *path)
+{
+	struct traceHeader hdr = {
+		.magic = TRACE_MAGIC,
+		.record_size = sizeof(struct traceRecord),
+	};
+
+	if ((traceFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR)) == -1) {
+		logPErr("Could not open trace");
+		return false;
+	}
+	if (!write_full(traceFd, &hdr, sizeof(hdr), 0)) {
+		logPErr("Could not write trace header");
+		close(traceFd);
+		traceFd = -1;
+		return false;
+	}
+	record_last_ns = osGetMonoNs();
+	logInfo("Recording protocol trace to %s", path);
+	return true;
+}
+
+/* unbuffered, so whatever led up to a crash is still there */
+void traceRecordWrite(const void *buf, size_t len)
+{
+	uint64_t now = osGetMonoNs();
+	uint64_t us = (now - record_last_ns) / 1000;
+	struct traceRecord rec = {
+		.us = us > UINT32_MAX ? UINT32_MAX : us,
+		.len = len,
+	};
+
+	/* carry the remainder over, so rounding doesn't add up */
+	record_last_ns = us > UINT32_MAX ? now : record_last_ns + us * 1000;
+	if (!write_full(traceFd, &rec, sizeof(rec), 0) || (len && !write_full(traceFd, buf, len, 0))) {
+		logPErr("Could not write trace, recording stopped");
+		close(traceFd);
+		traceFd = -1;
+	}
+}
+
+static struct {
+	FILE *f;
+	bool fast;
+	/* a connection marker has been read, but not acted on */
+	bool connect;
+	/* data of the current record, and how much has been handed out */
+	uint8_t *buf;
+	size_t buf_size;
+	size_t len;
+	size_t pos;
+	uint64_t start_ns;
+	uint64_t trace_ns;
+	uint64_t records;
+	uint64_t bytes;
+	uint64_t connects;
+} replay;
+
+/* read the next record, waiting for its time to come unless going fast */
+static bool replay_next(void)
+{
+	struct traceRecord rec;
+	struct timespec ts;
+	uint64_t due;
+
+	if (fread(&rec, sizeof(rec), 1, replay.f) != 1) {
+		if (ferror(replay.f))
+			logPErr("Could not read trace");
+		return false;
+	}
+	if (rec.len > replay.buf_size) {
+		replay.buf = xrealloc(replay.buf, rec.len);
+		replay.buf_size = rec.len;
+	}
+	if (rec.len && fread(replay.buf, rec.len, 1, replay.f) != 1) {
+		logErr("Trace is truncated");
+		return false;
+	}
+	replay.trace_ns += (uint64_t)rec.us * 1000;
+	replay.len = rec.len;
+	replay.pos = 0;
+	if (!rec.len) {
+		replay.connect = true;
+		++replay.connects;
+		return true;
+	}
+	++replay.records;
+	replay.bytes += rec.len;
+	if (!replay.fast) {
+		due = replay.start_ns + replay.trace_ns;
+		ts.tv_sec = due / 1000000000;
+		ts.tv_nsec = due % 1000000000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+			if (sigHandleCheck())
+				break;
+		}
+	}
+	return true;
+}
+
+static bool replay_connect(uSynergyCookie cookie)
+{
+	/* a trace that doesn't start with a connection is fed as-is */
+	replay.connect = false;
+	return true;
+}
+
+static bool replay_recv(uSynergyCookie cookie, uint8_t *buf, int max_len, int *out_len)
+{
+	size_t len;
+
+	/* the original connection was lost here */
+	if (replay.connect) {
+		*out_len = 0;
+		return false;
+	}
+	len = replay.len - replay.pos;
+	if (len > (size_t)max_len)
+		len = max_len;
+	memcpy(buf, replay.buf + replay.pos, len);
+	replay.pos += len;
+	*out_len = len;
+	latencyMark(LATENCY_STAGE_READY);
+	metrics.bytes_in += len;
+	return true;
+}
+
+static bool replay_send(uSynergyCookie cookie, const uint8_t *buf, int len)
+{
+	metrics.bytes_out += len;
+	return true;
+}
+
+static void replay_sleep(uSynergyCookie cookie, int ms)
+{
+	return;
+}
+
+/* trace time, so heartbeats line up no matter how fast we go */
+static uint32_t replay_get_time(void)
+{
+	return replay.trace_ns / 1000000;
+}
+
+bool traceReplay(uSynergyContext *context, const char *path, bool fast)
+{
+	struct traceHeader hdr;
+	uint64_t elapsed;
+	uint64_t packets = 0;
+	int i;
+
+	if (!(replay.f = fopen(path, "r"))) {
+		logPErr("Could not open trace");
+		return false;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, replay.f) != 1 ||
+			memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) ||
+			hdr.record_size != sizeof(struct traceRecord)) {
+		logErr("%s is not a protocol trace", path);
+		fclose(replay.f);
+		return false;
+	}
+	replay.fast = fast;
+	context->m_cookie = NULL;
+	context->m_connectFunc = replay_connect;
+	context->m_receiveFunc = replay_recv;
+	context->m_sendFunc = replay_send;
+	context->m_sleepFunc = replay_sleep;
+	context->m_getTimeFunc = replay_get_time;
+	logInfo("Replaying protocol trace %s%s", path, fast ? " as fast as possible" : "");
+	replay.start_ns = osGetMonoNs();
+	for (;;) {
+		sigHandleRun();
+		/* always have something for the callbacks to hand out */
+		if (replay.pos == replay.len && !replay.connect && !replay_next())
+			break;
+		uSynergyUpdate(context);
+	}
+	elapsed = osGetMonoNs() - replay.start_ns;
+	for (i = 0; i <= METRICS_PKT_COUNT; ++i) {
+		packets += metrics.pkt[i];
+	}
+	printf("%" PRIu64 " connections, %" PRIu64 " reads, %" PRIu64 " bytes, %" PRIu64 " packets in %.3fs\n",
+			replay.connects,
+			replay.records,
+			replay.bytes,
+			packets,
+			elapsed / 1e9);
+	if (packets) {
+		printf("%.0f packets/s, %.0fns per packet\n",
+				packets / (elapsed / 1e9),
+				(double)elapsed / packets);
+	}
+	fclose(replay.f);
+	free(replay.buf);
+	return true;
+}
@@ -26,11 +26,12 @@ freely, subject to the following restrictions:
 #include "uSynergy.h"
 #include <stdio.h>
 #include <string.h>
-#include "sig.h"
 #include "xmem.h"
 #include "ssp.h"
 #include <stdlib.h>
 #include "log.h"
+#include "flight.h"
+#include "metrics.h"
 #include <inttypes.h>
 
 //---------------------------------------------------------------------------------------------------------------------
@@ -127,21 +128,38 @@ static bool sAddUInt32(uSynergyContext *context, uint32_t value)
 
 
 /**
-@brief Mark context as being disconnected
+@brief Forget all state belonging to a single connection
 **/
-static void sSetDisconnected(uSynergyContext *context, enum uSynergyError err)
+static void sResetConnection(uSynergyContext *context)
 {
-	context->m_connected		= false;
 	context->m_hasReceivedHello = false;
 	context->m_isCaptured		= false;
 	context->m_receiveOfs = 0;
+	context->m_receiveSkip = 0;
+	/* anything not yet sent was meant for the connection just lost */
+	context->m_sendLen = 0;
 	context->m_replyCur			= context->m_replyBuffer + 4;
 	context->m_sequenceNumber	= 0;
+	context->m_keepAliveRate = USYNERGY_KEEPALIVE_RATE;
+	context->m_keepAlivesMissed = 0;
+}
+
+/**
+@brief Mark context as being disconnected
+**/
+static void sSetDisconnected(uSynergyContext *context, enum uSynergyError err)
+{
+	if (err >= 0 && context->m_connected) {
+		++metrics.disconnects[err];
+	}
+	context->m_connected		= false;
+	sResetConnection(context);
 	context->m_lastError = err;
+	flightRecord(FLIGHT_CONN, "DISC", err, 0, 0);
 }
 
 /**
-@brief Send reply packet
+@brief Queue reply packet
 **/
 static bool sSendReply(uSynergyContext *context)
 {
@@ -149,92 +167,132 @@ static bool sSendReply(uSynergyContext *context)
 	uint8_t		*reply_buf	= context->m_replyBuffer;
 	uint32_t	reply_len	= (uint32_t)(context->m_replyCur - reply_buf);				/* Total size of reply */
 	uint32_t	body_len	= reply_len - 4;											/* Size of body */
-	bool ret;
 	reply_buf[0] = (uint8_t)(body_len >> 24);
 	reply_buf[1] = (uint8_t)(body_len >> 16);
 	reply_buf[2] = (uint8_t)(body_len >> 8);
 	reply_buf[3] = (uint8_t)body_len;
 
-	// Send reply
-	ret = context->m_sendFunc(context->m_cookie, context->m_replyBuffer, reply_len);
+	// Append to output
+	if (context->m_sendLen + reply_len > context->m_sendSize) {
+		context->m_sendSize = (context->m_sendLen + reply_len) * 2;
+		context->m_sendBuffer = xrealloc(context->m_sendBuffer, context->m_sendSize);
+	}
+	memcpy(context->m_sendBuffer + context->m_sendLen, reply_buf, reply_len);
+	context->m_sendLen += reply_len;
 
 	// Reset reply buffer write pointer
 	context->m_replyCur = context->m_replyBuffer+4;
-	return ret;
+	return true;
 }
 
 
-/* mouse callbacks */
-static void sSendMouseWheelCallback(uSynergyContext *context, int16_t x, int16_t y)
+/**
+@brief Add an event to the batch being filled
+**/
+static struct uSynergyEvent *sAddEvent(uSynergyContext *context, enum uSynergyEventType type)
 {
-	if (!context->m_mouseWheelCallback)
-		return;
-	if (context->m_resChanged || !context->m_infoCurrent)
-		return;
-	context->m_mouseWheelCallback(context->m_cookie, x, y);
+	struct uSynergyEvent *ev;
+
+	/* room is checked before each packet, see USYNERGY_BATCH_RESERVE */
+	if (context->m_batch->count == USYNERGY_BATCH_SIZE) {
+		logWarn("Event batch full, dropping event");
+		return NULL;
+	}
+	ev = context->m_batch->ev + context->m_batch->count++;
+	ev->type = type;
+	return ev;
 }
-static void sSendMouseButtonDownCallback(uSynergyContext *context, enum uSynergyMouseButton button)
+
+
+/* mouse events */
+static void sAddMouseWheelEvent(uSynergyContext *context, int16_t x, int16_t y)
 {
-	if (!context->m_mouseButtonDownCallback)
+	struct uSynergyEvent *ev;
+
+	if (context->m_resChanged || !context->m_infoCurrent)
 		return;
-	context->m_mouseButtonDownCallback(context->m_cookie, button);
+	/* a flick arrives as a run of these; make it one event */
+	if (context->m_batch->count) {
+		ev = context->m_batch->ev + context->m_batch->count - 1;
+		if (ev->type == USYNERGY_EVENT_MOUSE_WHEEL &&
+				ev->wheel.x + x >= INT16_MIN && ev->wheel.x + x <= INT16_MAX &&
+				ev->wheel.y + y >= INT16_MIN && ev->wheel.y + y <= INT16_MAX) {
+			ev->wheel.x += x;
+			ev->wheel.y += y;
+			return;
+		}
+	}
+	if (!(ev = sAddEvent(context, USYNERGY_EVENT_MOUSE_WHEEL)))
+		return;
+	ev->wheel.x = x;
+	ev->wheel.y = y;
 }
-static void sSendMouseButtonUpCallback(uSynergyContext *context, enum uSynergyMouseButton button)
+static void sAddMouseButtonEvent(uSynergyContext *context, enum uSynergyMouseButton button, bool down)
 {
-	if (!context->m_mouseButtonUpCallback)
+	struct uSynergyEvent *ev;
+
+	if (!(ev = sAddEvent(context, USYNERGY_EVENT_MOUSE_BUTTON)))
 		return;
-	context->m_mouseButtonUpCallback(context->m_cookie, button);
+	ev->button.button = button;
+	ev->button.down = down;
 }
-static void sSendMouseMoveCallback(uSynergyContext *context, bool rel, int16_t x, int16_t y)
+static void sAddMouseMoveEvent(uSynergyContext *context, bool rel, int16_t x, int16_t y)
 {
-	if (!context->m_mouseMoveCallback)
+	struct uSynergyEvent *ev;
+
+	if (!(ev = sAddEvent(context, USYNERGY_EVENT_MOUSE_MOVE)))
 		return;
-	context->m_mouseMoveCallback(context->m_cookie, rel, x, y);
+	ev->move.rel = rel;
+	ev->move.x = x;
+	ev->move.y = y;
 }
 
 /**
-@brief Send screensaver callback
+@brief Add screen active or screensaver event
 **/
-static void sSendScreensaverCallback(uSynergyContext *context, bool state)
+static void sAddActiveEvent(uSynergyContext *context, enum uSynergyEventType type, bool state)
 {
-	if (!context->m_screensaverCallback)
+	struct uSynergyEvent *ev;
+
+	if (!(ev = sAddEvent(context, type)))
 		return;
-	context->m_screensaverCallback(context->m_cookie, state);
+	ev->active = state;
 }
 
 /**
-@brief Send keyboard callback when a key has been pressed or released
+@brief Add keyboard event when a key has been pressed or released
 **/
-static void sSendKeyboardCallback(uSynergyContext *context, uint16_t key, uint16_t id, uint16_t modifiers, bool down, bool repeat)
+static void sAddKeyboardEvent(uSynergyContext *context, uint16_t key, uint16_t id, uint16_t modifiers, bool down, bool repeat)
 {
-	// Skip if no callback is installed
-	if (context->m_keyboardCallback == 0L)
-		return;
+	struct uSynergyEvent *ev;
 
-	// Send callback
-	context->m_keyboardCallback(context->m_cookie, key, id, modifiers, down, repeat);
+	if (!(ev = sAddEvent(context, USYNERGY_EVENT_KEY)))
+		return;
+	ev->key.key = key;
+	ev->key.id = id;
+	ev->key.modifiers = modifiers;
+	ev->key.down = down;
+	ev->key.repeat = repeat;
 }
 
 
 
 /**
-@brief Send joystick callback
+@brief Add joystick event
 **/
-static void sSendJoystickCallback(uSynergyContext *context, uint8_t joyNum)
+static void sAddJoystickEvent(uSynergyContext *context, uint8_t joyNum)
 {
-	int8_t *sticks;
+	struct uSynergyEvent *ev;
 
-	// Skip if no callback is installed
-	if (context->m_joystickCallback == 0L)
+	if (!(ev = sAddEvent(context, USYNERGY_EVENT_JOYSTICK)))
 		return;
-
-	// Send callback
-	sticks = context->m_joystickSticks[joyNum];
-	context->m_joystickCallback(context->m_cookie, joyNum, context->m_joystickButtons[joyNum], sticks[0], sticks[1], sticks[2], sticks[3]);
+	ev->joystick.num = joyNum;
+	ev->joystick.buttons = context->m_joystickButtons[joyNum];
+	memcpy(ev->joystick.sticks, context->m_joystickSticks[joyNum], sizeof(ev->joystick.sticks));
 }
 
 /**
-@brief Send clipboard data
+@brief Queue clipboard data
 **/
 void uSynergySendClipboard(uSynergyContext *context, int id, uint32_t len, const unsigned char *text)
 {
@@ -253,6 +311,7 @@ void uSynergySendClipboard(uSynergyContext *context, int id, uint32_t len, const
 	uint32_t max_length = USYNERGY_REPLY_BUFFER_SIZE - overhead_size;
 	unsigned char chunk[max_length];
 
+	metrics.clip_bytes_out += len;
 	// Assemble start packet.
 	sprintf(buffer, "%" PRIu32, len);
 	if (!(sAddString(context, "DCLP") &&
@@ -315,7 +374,7 @@ static char *sIsWelcome(struct sspBuf *msg)
 
 
 /**
-@brief Parse a single client message, update state, send callbacks and send replies
+@brief Parse a single client message, update state, add events and queue replies
 **/
 static void sProcessMessage(uSynergyContext *context, struct sspBuf *msg)
 {
@@ -332,6 +391,7 @@ static void sProcessMessage(uSynergyContext *context, struct sspBuf *msg)
 			PARSE_ERROR();
 		}
 		logInfo("Server is %s %" PRIu16 ".%" PRIu16, imp, server_major, server_minor);
+		flightRecord(FLIGHT_PKT, "HELO", server_major, server_minor, 0);
 
 		// Initialize position in reply buffer -- discards leftovers from
 		// failed send attempts, ensures no protocol errors on initialization
@@ -344,26 +404,20 @@ static void sProcessMessage(uSynergyContext *context, struct sspBuf *msg)
 		      sAddString(context, context->m_clientName))) {
 			REPLY_ERROR();
 		}
-		if (!sSendReply(context))
-		{
-			// Send reply failed, let's try to reconnect
-			logErr("SendReply failed, trying to reconnect in a second");
-			context->m_connected = false;
-			context->m_sleepFunc(context->m_cookie, 1000);
-		}
-		else
-		{
-			// Let's assume we're connected
-			logInfo("Connected as client \"%s\"", context->m_clientName);
-			context->m_hasReceivedHello = true;
-			context->m_implementation = imp;
-		}
+		sSendReply(context);
+		// Let's assume we're connected -- if the reply can't be sent,
+		// we'll find out soon enough
+		logInfo("Connected as client \"%s\"", context->m_clientName);
+		context->m_hasReceivedHello = true;
+		context->m_implementation = imp;
 		return;
 	}
 	if (!sspMemMove(pkt_id, msg, 4)) {
 		PARSE_ERROR();
 	}
-	else if (!strcmp(pkt_id, "QINF"))
+	flightRecord(FLIGHT_PKT, pkt_id, 0, 0, 0);
+	metricsPacket(pkt_id);
+	if (!strcmp(pkt_id, "QINF"))
 	{
 		// Screen info. Reply with DINF
 		//		kMsgQInfo			= "QINF"
@@ -391,8 +445,8 @@ static void sProcessMessage(uSynergyContext *context, struct sspBuf *msg)
 	}
 	else if (!strcmp(pkt_id, "CROP"))
 	{
-		// Do nothing?
 		//		kMsgCResetOptions	= "CROP"
+		context->m_keepAliveRate = USYNERGY_KEEPALIVE_RATE;
 		return;
 	}
 	else if (!strcmp(pkt_id, "CINN"))
@@ -405,11 +459,10 @@ static void sProcessMessage(uSynergyContext *context, struct sspBuf *msg)
 		      sspNetU32(msg, &context->m_sequenceNumber))) {
 			PARSE_ERROR();
 		}
+		flightAmend(context->m_sequenceNumber, 0, 0);
 		context->m_isCaptured = true;
 
-		// Call callback
-		if (context->m_screenActiveCallback != 0L)
-			context->m_screenActiveCallback(context->m_cookie, true);
+		sAddActiveEvent(context, USYNERGY_EVENT_SCREEN_ACTIVE, true);
 	}
 	else if (!strcmp(pkt_id, "COUT"))
 	{
@@ -425,9 +478,7 @@ static void sProcessMessage(uSynergyContext *context, struct sspBuf *msg)
 			}
 		}
 
-		// Call callback
-		if (context->m_screenActiveCallback != 0L)
-			context->m_screenActiveCallback(context->m_cookie, false);
+		sAddActiveEvent(context, USYNERGY_EVENT_SCREEN_ACTIVE, false);
 	}
 	else if (!strcmp(pkt_id, "CSEC"))
 	{
@@ -436,7 +487,8 @@ static void sProcessMessage(uSynergyContext *context, struct sspBuf *msg)
 		if (!sspChar(msg, &active)) {
 			PARSE_ERROR();
 		}
-		sSendScreensaverCallback(context, active);
+		flightAmend(active, 0, 0);
+		sAddActiveEvent(context, USYNERGY_EVENT_SCREENSAVER, active);
 	}
 	else if (!strcmp(pkt_id, "DMDN"))
 	{
@@ -446,8 +498,9 @@ static void sProcessMessage(uSynergyContext *context, struct sspBuf *msg)
 		if (!sspChar(msg, &btn)) {
 			PARSE_ERROR();
 		}
+		flightAmend(btn, 0, 0);
 		//logDbgSyn("DMDN: btn %hhd", btn);
-		sSendMouseButtonDownCallback(context, btn);
+		sAddMouseButtonEvent(context, btn, true);
 	}
 	else if (!strcmp(pkt_id, "DMUP"))
 	{
@@ -457,8 +510,9 @@ static void sProcessMessage(uSynergyContext *context, struct sspBuf *msg)
 		if (!sspChar(msg, &btn)) {
 			PARSE_ERROR();
 		}
+		flightAmend(btn, 0, 0);
 		//logDbgSyn("DMUP: btn %hhd", btn);
-		sSendMouseButtonUpCallback(context, btn);
+		sAddMouseButtonEvent(context, btn, false);
 	}
 	else if (!strcmp(pkt_id, "DMMV"))
 	{
@@ -468,8 +522,9 @@ static void sProcessMessage(uSynergyContext *context, struct sspBuf *msg)
 		if (!(sspNet16(msg, &x) && sspNet16(msg, &y))) {
 			PARSE_ERROR();
 		}
+		flightAmend(x, y, 0);
 		//logDbgSyn("DKMV: x %" PRId16 ", y %" PRId16, x, y);
-		sSendMouseMoveCallback(context, false, x, y);
+		sAddMouseMoveEvent(context, false, x, y);
 	}
 	else if (!strcmp(pkt_id, "DMRM"))
 	{
@@ -478,8 +533,9 @@ static void sProcessMessage(uSynergyContext *context, struct sspBuf *msg)
 		if (!(sspNet16(msg, &x) && sspNet16(msg, &y))) {
 			PARSE_ERROR();
 		}
+		flightAmend(x, y, 0);
 		//logDbgSyn("DKRM: x %" PRId16 ", y %" PRId16, x, y);
-		sSendMouseMoveCallback(context, true, x, y);
+		sAddMouseMoveEvent(context, true, x, y);
 	}
 	else if (!strcmp(pkt_id, "DMWM"))
 	{
@@ -490,8 +546,9 @@ static void sProcessMessage(uSynergyContext *context, struct sspBuf *msg)
 		if (!(sspNet16(msg, &x) && sspNet16(msg, &y))) {
 			PARSE_ERROR();
 		}
+		flightAmend(x, y, 0);
 		//logDbgSyn("DKWM: x %" PRId16 ", y %" PRId16, x, y);
-		sSendMouseWheelCallback(context, x, y);
+		sAddMouseWheelEvent(context, x, y);
 	}
 	else if (!strcmp(pkt_id, "DKDN"))
 	{
@@ -502,8 +559,9 @@ static void sProcessMessage(uSynergyContext *context, struct sspBuf *msg)
 		if (!(sspNetU16(msg, &id) && sspNetU16(msg, &mod) && sspNetU16(msg, &key))) {
 			PARSE_ERROR();
 		}
+		flightAmend(id, mod, key);
 		logDbgSyn("DKDN: id %" PRIu16 ", mod %" PRIx16 ", key %" PRIu16, id, mod, key);
-		sSendKeyboardCallback(context, context->m_useRawKeyCodes ? key : id, id, mod, true, false);
+		sAddKeyboardEvent(context, context->m_useRawKeyCodes ? key : id, id, mod, true, false);
 	}
 	else if (!strcmp(pkt_id, "DKRP"))
 	{
@@ -517,8 +575,9 @@ static void sProcessMessage(uSynergyContext *context, struct sspBuf *msg)
 		      sspNetU16(msg, &key))) {
 			PARSE_ERROR();
 		}
+		flightAmend(id, count, key);
 		logDbgSyn("DKRP: id %" PRIu16 ", mod %" PRIx16 ", count %" PRIu16 ", key %" PRIu16, id, mod, count, key);
-		sSendKeyboardCallback(context, context->m_useRawKeyCodes ? key : id, id, mod, true, true);
+		sAddKeyboardEvent(context, context->m_useRawKeyCodes ? key : id, id, mod, true, true);
 	}
 	else if (!strcmp(pkt_id, "DKUP"))
 	{
@@ -529,8 +588,9 @@ static void sProcessMessage(uSynergyContext *context, struct sspBuf *msg)
 		if (!(sspNetU16(msg, &id) && sspNetU16(msg, &mod) && sspNetU16(msg, &key))) {
 			PARSE_ERROR();
 		}
+		flightAmend(id, mod, key);
 		logDbgSyn("DKUP: id %" PRIu16 ", mod %" PRIx16 ", key %" PRIu16, id, mod, key);
-		sSendKeyboardCallback(context, context->m_useRawKeyCodes ? key : id, id, mod, false, false);
+		sAddKeyboardEvent(context, context->m_useRawKeyCodes ? key : id, id, mod, false, false);
 	}
 	else if (!strcmp(pkt_id, "DGBT"))
 	{
@@ -544,7 +604,7 @@ static void sProcessMessage(uSynergyContext *context, struct sspBuf *msg)
 		if (joy_num<USYNERGY_NUM_JOYSTICKS)
 		{
 			context->m_joystickButtons[joy_num] = state;
-			sSendJoystickCallback(context, joy_num);
+			sAddJoystickEvent(context, joy_num);
 		}
 	}
 	else if (!strcmp(pkt_id, "DGST"))
@@ -560,19 +620,37 @@ static void sProcessMessage(uSynergyContext *context, struct sspBuf *msg)
 		{
 			// Copy stick state, then send callback
 			memcpy(context->m_joystickSticks[joy_num], state, sizeof(state));
-			sSendJoystickCallback(context, joy_num);
+			sAddJoystickEvent(context, joy_num);
 		}
 	}
 	else if (!strcmp(pkt_id, "DSOP"))
 	{
 		// Set options
 		//		kMsgDSetOptions		= "DSOP%4I"
+		// list of option/value pairs, options being 4 character codes
+		uint32_t count, opt;
+		int32_t val;
+		if (!sspNetU32(msg, &count)) {
+			PARSE_ERROR();
+		}
+		for (; count >= 2; count -= 2) {
+			if (!(sspNetU32(msg, &opt) && sspNet32(msg, &val))) {
+				PARSE_ERROR();
+			}
+			if (opt == ((uint32_t)'H' << 24 | 'A' << 16 | 'R' << 8 | 'T')) {
+				context->m_keepAliveRate = val > 0 ? val : 0;
+				logInfo("Server heartbeat set to %" PRIu32 "ms", context->m_keepAliveRate);
+			} else {
+				logDbg("Ignoring option %c%c%c%c = %" PRId32, opt >> 24, (opt >> 16) & 0xFF, (opt >> 8) & 0xFF, opt & 0xFF, val);
+			}
+		}
 	}
 	else if (!strcmp(pkt_id, "CALV"))
 	{
 		// Keepalive, reply with CALV and then CNOP
 		//		kMsgCKeepAlive		= "CALV"
 		logDbg("Got CALV");
+		metricsKeepalive();
 		if (!sAddString(context, "CALV")) {
 			REPLY_ERROR();
 		}
@@ -593,6 +671,7 @@ static void sProcessMessage(uSynergyContext *context, struct sspBuf *msg)
 		if (!(sspUChar(msg, &id) && sspNetU32(msg, &seq))) {
 			PARSE_ERROR();
 		}
+		flightAmend(id, seq, 0);
 		/* XXX: I think the sequence number is always zero on receive?*/
 		context->m_clipGrabbed[id] = false;
 	}
@@ -620,12 +699,16 @@ static void sProcessMessage(uSynergyContext *context, struct sspBuf *msg)
 		      sspNetU32(msg, &len))) {
 			PARSE_ERROR();
 		}
+		flightAmend(id, mark, len);
 		if (mark ==  SYN_DATA_START) {
 			context->m_clipGrabbed[id] = false;
 			context->m_clipInStream[id] = true;
 			context->m_clipPos[id] = 0;
-			char expected_len[len + 1];
-			sspMemMove(expected_len, msg, len);
+			/* decimal length, so never anywhere near this long */
+			char expected_len[16];
+			if (len >= sizeof(expected_len) || !sspMemMove(expected_len, msg, len)) {
+				PARSE_ERROR();
+			}
 			expected_len[len] = '\0';
 			context->m_clipPosExpect[id] = atoi(expected_len);
 			if (context->m_clipPosExpect[id] > context->m_clipLen[id]) {
@@ -638,6 +721,7 @@ static void sProcessMessage(uSynergyContext *context, struct sspBuf *msg)
 			}
 			sspMemMove(context->m_clipBuf[id] + context->m_clipPos[id], msg, len);
 			context->m_clipPos[id] += len;
+			metrics.clip_bytes_in += len;
 		} else if (mark ==  SYN_DATA_END && context->m_clipInStream[id]) {
 			struct sspBuf clipmsg = {
 				.data = context->m_clipBuf[id],
@@ -656,13 +740,16 @@ static void sProcessMessage(uSynergyContext *context, struct sspBuf *msg)
 					PARSE_ERROR();
 				}
 
-				// Call callback
-				if (context->m_clipboardCallback) {
-					//First check size against buffer
-					if (clipmsg.pos + size > clipmsg.len) {
-						PARSE_ERROR();
-					}
-					context->m_clipboardCallback(context->m_cookie, id, format, clipmsg.data + clipmsg.pos, size);
+				//First check size against buffer
+				if (clipmsg.pos + size > clipmsg.len) {
+					PARSE_ERROR();
+				}
+				struct uSynergyEvent *ev = sAddEvent(context, USYNERGY_EVENT_CLIPBOARD);
+				if (ev) {
+					ev->clipboard.id = id;
+					ev->clipboard.format = format;
+					ev->clipboard.data = clipmsg.data + clipmsg.pos;
+					ev->clipboard.size = size;
 				}
 				if (!sspSeek(&clipmsg, size)) {
 					PARSE_ERROR();
@@ -716,53 +803,113 @@ static void sProcessMessage(uSynergyContext *context, struct sspBuf *msg)
 
 
 
+//---------------------------------------------------------------------------------------------------------------------
+//	Public interface
+//---------------------------------------------------------------------------------------------------------------------
+
+
+
 /**
-@brief Update a connected context
+@brief Initialize uSynergy context
 **/
-static void sUpdateContext(uSynergyContext *context)
+void uSynergyInit(uSynergyContext *context)
 {
-	/* Receive data (blocking) */
-	int receive_size = USYNERGY_RECEIVE_BUFFER_SIZE - context->m_receiveOfs;
-	int num_received = 0;
-	uint32_t packlen = 0;
-	if (context->m_receiveFunc(context->m_cookie, context->m_receiveBuffer + context->m_receiveOfs, receive_size, &num_received) == false)
-	{
-		/* Receive failed, let's try to reconnect */
-		logErr("Receive failed (%d bytes asked, %d bytes received), trying to reconnect in a second", receive_size, num_received);
-		/* The *only* way this can occur normally is with a timeout so that's what we assume*/
-		sSetDisconnected(context, USYNERGY_ERROR_TIMEOUT);
-		context->m_sleepFunc(context->m_cookie, 1000);
-		return;
-	}
-	context->m_receiveOfs += num_received;
+	/* Zero memory */
+	memset(context, 0, sizeof(uSynergyContext));
+	context->m_keepAliveMisses = USYNERGY_KEEPALIVE_MISSES;
+
+	/* Initialize to default state */
+	sSetDisconnected(context, USYNERGY_ERROR__INIT);
+}
 
-	/*	If we didn't receive any data then we're probably still polling to get connected and
-		therefore not getting any data back. To avoid overloading the system with a Synergy
-		thread that would hammer on polling, we let it rest for a bit if there's no data. */
-	if (num_received == 0)
-		context->m_sleepFunc(context->m_cookie, 500);
 
-	/* Check for timeouts */
-	if (context->m_hasReceivedHello)
-	{
-		uint32_t cur_time = context->m_getTimeFunc();
-		if (num_received == 0)
-		{
-			/* Timeout after 2 secs of inactivity (we received no CALV) */
-			if ((cur_time - context->m_lastMessageTime) > USYNERGY_IDLE_TIMEOUT)
-				sSetDisconnected(context, USYNERGY_ERROR_TIMEOUT);
+/**
+@brief Start a connection
+
+Nothing from a previous connection carries over, however it was torn down.
+**/
+void uSynergyStart(uSynergyContext *context, uint32_t now)
+{
+	sResetConnection(context);
+	context->m_connected = true;
+	context->m_lastMessageTime = now;
+	flightRecord(FLIGHT_CONN, "CONN", 0, 0, 0);
+}
+
+
+/**
+@brief Mark a connection as lost
+**/
+void uSynergyDisconnect(uSynergyContext *context, enum uSynergyError err)
+{
+	sSetDisconnected(context, err);
+}
+
+
+/**
+@brief Receive space
+**/
+uint8_t *uSynergyRecvSpace(uSynergyContext *context, size_t *len)
+{
+	*len = USYNERGY_RECEIVE_BUFFER_SIZE - context->m_receiveOfs;
+	return context->m_receiveBuffer + context->m_receiveOfs;
+}
+
+
+/**
+@brief Feed received data
+**/
+size_t uSynergyFeed(uSynergyContext *context, const uint8_t *buf, size_t len, uint32_t now, struct uSynergyBatch *batch)
+{
+	size_t used = 0, n;
+	uint32_t packlen;
+
+	batch->count = 0;
+	batch->more = false;
+	/* discard the tail of an oversized packet */
+	if (context->m_receiveSkip) {
+		n = len < context->m_receiveSkip ? len : context->m_receiveSkip;
+		context->m_receiveSkip -= n;
+		buf += n;
+		len -= n;
+		used += n;
+	}
+	n = USYNERGY_RECEIVE_BUFFER_SIZE - context->m_receiveOfs;
+	if (len > n)
+		len = n;
+	if (len) {
+		/* no copy needed for data read in place, see uSynergyRecvSpace() */
+		if (buf != context->m_receiveBuffer + context->m_receiveOfs)
+			memmove(context->m_receiveBuffer + context->m_receiveOfs, buf, len);
+		context->m_receiveOfs += len;
+		used += len;
+		if (context->m_hasReceivedHello) {
+			context->m_lastMessageTime = now;
+			context->m_keepAlivesMissed = 0;
 		}
-		else
-			context->m_lastMessageTime = cur_time;
 	}
 
 	/* Eat packets */
-	for (;;)
+	context->m_batch = batch;
+	while (context->m_receiveOfs >= 4)
 	{
 		/* Grab packet length and bail out if the packet goes beyond the end of the buffer */
 		packlen = sNetToNative32(context->m_receiveBuffer);
+		if (packlen > USYNERGY_RECEIVE_BUFFER_SIZE - 4)
+		{
+			/* Oversized packet, ditch tail end */
+			logWarn("Oversized packet: '%c%c%c%c' (length %" PRIu32 ")", context->m_receiveBuffer[4], context->m_receiveBuffer[5], context->m_receiveBuffer[6], context->m_receiveBuffer[7], packlen);
+			context->m_receiveSkip = packlen + 4 - context->m_receiveOfs;
+			context->m_receiveOfs = 0;
+			break;
+		}
 		if (packlen+4 > context->m_receiveOfs)
 			break;
+		/* leave it for the next batch if this one might overflow */
+		if (batch->count > USYNERGY_BATCH_SIZE - USYNERGY_BATCH_RESERVE) {
+			batch->more = true;
+			break;
+		}
 
 		/* Process message */
 		struct sspBuf msg = {
@@ -775,93 +922,83 @@ static void sUpdateContext(uSynergyContext *context)
 		/* if we've lost the connection, don't bother with further
 		 * processing */
 		if (!context->m_connected)
-			return;
+			break;
 
 		/* Move packet to front of buffer */
 		memmove(context->m_receiveBuffer, context->m_receiveBuffer+packlen+4, context->m_receiveOfs-packlen-4);
 		context->m_receiveOfs -= packlen+4;
 	}
-
-	/* Throw away over-sized packets */
-	if (packlen > USYNERGY_RECEIVE_BUFFER_SIZE)
-	{
-		/* Oversized packet, ditch tail end */
-		logWarn("Oversized packet: '%c%c%c%c' (length %d)", context->m_receiveBuffer[4], context->m_receiveBuffer[5], context->m_receiveBuffer[6], context->m_receiveBuffer[7], packlen);
-		num_received = context->m_receiveOfs-4; // 4 bytes for the size field
-		while (num_received != packlen)
-		{
-			int buffer_left = packlen - num_received;
-			int to_receive = buffer_left < USYNERGY_RECEIVE_BUFFER_SIZE ? buffer_left : USYNERGY_RECEIVE_BUFFER_SIZE;
-			int ditch_received = 0;
-			if (context->m_receiveFunc(context->m_cookie, context->m_receiveBuffer, to_receive, &ditch_received) == false)
-			{
-				/* Receive failed, let's try to reconnect */
-				logErr("Receive failed, trying to reconnect in a second");
-				/* this only happens with timeout*/
-				sSetDisconnected(context, USYNERGY_ERROR_TIMEOUT);
-				context->m_sleepFunc(context->m_cookie, 1000);
-				break;
-			}
-			else
-			{
-				num_received += ditch_received;
-			}
-		}
-		context->m_receiveOfs = 0;
-	}
+	context->m_batch = NULL;
+	return used;
 }
 
 
-//---------------------------------------------------------------------------------------------------------------------
-//	Public interface
-//---------------------------------------------------------------------------------------------------------------------
-
+/**
+@brief Pending output
+**/
+const uint8_t *uSynergyOutput(uSynergyContext *context, size_t *len)
+{
+	*len = context->m_sendLen;
+	return context->m_sendBuffer;
+}
 
 
 /**
-@brief Initialize uSynergy context
+@brief Consume pending output
 **/
-void uSynergyInit(uSynergyContext *context)
+void uSynergyOutputDone(uSynergyContext *context, size_t len)
 {
-	/* Zero memory */
-	memset(context, 0, sizeof(uSynergyContext));
+	if (len >= context->m_sendLen) {
+		context->m_sendLen = 0;
+		return;
+	}
+	memmove(context->m_sendBuffer, context->m_sendBuffer + len, context->m_sendLen - len);
+	context->m_sendLen -= len;
+}
 
-	/* Initialize to default state */
-	sSetDisconnected(context, USYNERGY_ERROR__INIT);
+
+/**
+@brief Heartbeat wait time
+**/
+int uSynergyKeepAliveWait(uSynergyContext *context, uint32_t now)
+{
+	uint32_t elapsed, rate = context->m_keepAliveRate;
+
+	elapsed = now - context->m_lastMessageTime;
+	/* without a heartbeat, fall back to an idle timeout, so a peer that
+	 * vanished without closing the connection is still noticed */
+	if (!rate)
+		return elapsed < USYNERGY_IDLE_TIMEOUT ? USYNERGY_IDLE_TIMEOUT - elapsed : 0;
+	/* wake up half a period after each heartbeat is due, so misses are
+	 * noticed as they happen without tripping over ordinary jitter */
+	return rate - ((elapsed + rate / 2) % rate);
 }
 
 
 /**
-@brief Update uSynergy
+@brief Check for missed heartbeats
 **/
-void uSynergyUpdate(uSynergyContext *context)
+bool uSynergyKeepAliveCheck(uSynergyContext *context, uint32_t now)
 {
-	if (context->m_connected)
-	{
-		/* Update context, receive data, call callbacks */
-		sUpdateContext(context);
+	uint32_t elapsed, missed, rate = context->m_keepAliveRate;
+
+	elapsed = now - context->m_lastMessageTime;
+	if (!rate) {
+		if (elapsed <= USYNERGY_IDLE_TIMEOUT)
+			return true;
+		logWarn("Nothing heard from the server in %" PRIu32 "ms", elapsed);
+		return false;
 	}
-	else
-	{
-		/* Try to connect */
-		if (context->m_lastError > 0) {
-			if (context->m_errorIsFatal[context->m_lastError]) {
-				logErr("Last error received (code %d) is configured as fatal, exiting", context->m_lastError);
-				Exit(SES_ERROR_SYN);
-			}
-		}
-		if (context->m_connectFunc(context->m_cookie)) {
-			context->m_connected = true;
-		} else {
-			logErr("Connection attempt failed, trying to reconnect in a second");
-			context->m_sleepFunc(context->m_cookie, 1000);
-		}
+	missed = elapsed < rate / 2 ? 0 : (elapsed - rate / 2) / rate;
+	if (missed > context->m_keepAlivesMissed) {
+		metrics.keepalives_missed += missed - context->m_keepAlivesMissed;
+		logWarn("Missed %" PRIu32 " of %" PRIu32 " heartbeats", missed, context->m_keepAliveMisses);
+		context->m_keepAlivesMissed = missed;
 	}
+	return missed < context->m_keepAliveMisses;
 }
 
 
-
-
 /* check all formats in the clipboard message buffer */
 static bool uSynergyClipBufContains(uSynergyContext *context, enum uSynergyClipboardId id, uint32_t len, const char *data)
 {
@@ -924,6 +1061,10 @@ void uSynergyUpdateClipBuf(uSynergyContext *context, enum uSynergyClipboardId id
 	buf = buf_add_int32(buf, USYNERGY_CLIPBOARD_FORMAT_TEXT); //type, text only for now
 	buf = buf_add_int32(buf, len); //length of actual data
 	memmove(buf, data, len);
+	/* nobody to tell about the grab; the data is still sent on leaving
+	 * the screen once connected again */
+	if (!context->m_connected)
+		return;
 	/* send CCLP  -- CCLP%1i%4i */
 	if (!(sAddString(context, "CCLP") &&
 	      sAddUInt8(context, id) &&
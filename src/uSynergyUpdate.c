@@ -0,0 +1,178 @@
+/*
+ * Callback interface to uSynergy
+ *
+ * Drives the protocol core in uSynergy.c with the blocking I/O functions and
+ * callbacks set in the context, as the original uSynergy did.
+ */
+#include "uSynergy.h"
+#include "sig.h"
+#include "log.h"
+#include "latency.h"
+#include "os.h"
+
+
+
+/**
+@brief Pass a batch of events on to the callbacks
+**/
+static void sDispatch(uSynergyContext *context, struct uSynergyBatch *batch, uint64_t parsed)
+{
+	struct uSynergyEvent *ev;
+	int i;
+
+	if (batch->count && context->m_batchCallback)
+		context->m_batchCallback(context->m_cookie, batch);
+	for (i = 0; i < batch->count && context->m_connected; ++i) {
+		ev = batch->ev + i;
+		latencyState.ts[LATENCY_STAGE_PARSE] = parsed;
+		latencyEventTime(i, batch->count);
+		switch (ev->type) {
+		case USYNERGY_EVENT_SCREEN_ACTIVE:
+			if (context->m_screenActiveCallback)
+				context->m_screenActiveCallback(context->m_cookie, ev->active);
+			break;
+		case USYNERGY_EVENT_SCREENSAVER:
+			if (context->m_screensaverCallback)
+				context->m_screensaverCallback(context->m_cookie, ev->active);
+			break;
+		case USYNERGY_EVENT_MOUSE_MOVE:
+			if (context->m_mouseMoveCallback)
+				context->m_mouseMoveCallback(context->m_cookie, ev->move.rel, ev->move.x, ev->move.y);
+			break;
+		case USYNERGY_EVENT_MOUSE_BUTTON:
+			if (ev->button.down && context->m_mouseButtonDownCallback)
+				context->m_mouseButtonDownCallback(context->m_cookie, ev->button.button);
+			else if (!ev->button.down && context->m_mouseButtonUpCallback)
+				context->m_mouseButtonUpCallback(context->m_cookie, ev->button.button);
+			break;
+		case USYNERGY_EVENT_MOUSE_WHEEL:
+			if (context->m_mouseWheelCallback)
+				context->m_mouseWheelCallback(context->m_cookie, ev->wheel.x, ev->wheel.y);
+			break;
+		case USYNERGY_EVENT_KEY:
+			if (context->m_keyboardCallback)
+				context->m_keyboardCallback(context->m_cookie, ev->key.key, ev->key.id, ev->key.modifiers, ev->key.down, ev->key.repeat);
+			break;
+		case USYNERGY_EVENT_JOYSTICK:
+			if (context->m_joystickCallback)
+				context->m_joystickCallback(context->m_cookie, ev->joystick.num, ev->joystick.buttons, ev->joystick.sticks[0], ev->joystick.sticks[1], ev->joystick.sticks[2], ev->joystick.sticks[3]);
+			break;
+		case USYNERGY_EVENT_CLIPBOARD:
+			if (context->m_clipboardCallback)
+				context->m_clipboardCallback(context->m_cookie, ev->clipboard.id, ev->clipboard.format, ev->clipboard.data, ev->clipboard.size);
+			break;
+		}
+	}
+	latencyState.ts[LATENCY_STAGE_PARSE] = 0;
+	latencyState.event_time = 0;
+}
+
+
+
+/**
+@brief Send pending output
+**/
+bool uSynergyFlush(uSynergyContext *context)
+{
+	const uint8_t *buf;
+	size_t len;
+
+	/* a lost connection has already been dealt with, and took any
+	 * pending output with it */
+	if (!context->m_connected)
+		return true;
+	buf = uSynergyOutput(context, &len);
+	if (!len)
+		return true;
+	if (!context->m_sendFunc(context->m_cookie, buf, len)) {
+		logErr("Could not send %zu bytes to server", len);
+		uSynergyOutputDone(context, len);
+		uSynergyDisconnect(context, USYNERGY_ERROR_NONE);
+		return false;
+	}
+	uSynergyOutputDone(context, len);
+	return true;
+}
+
+
+
+/**
+@brief Update a connected context
+**/
+static void sUpdateContext(uSynergyContext *context)
+{
+	struct uSynergyBatch batch;
+	uint8_t *buf;
+	size_t space, used;
+	uint32_t now;
+	int num_received = 0;
+
+	/* Receive data (blocking) */
+	buf = uSynergyRecvSpace(context, &space);
+	if (context->m_receiveFunc(context->m_cookie, buf, space, &num_received) == false)
+	{
+		/* Receive failed, let's try to reconnect */
+		logErr("Receive failed (%zu bytes asked, %d bytes received), trying to reconnect in a second", space, num_received);
+		/* The *only* way this can occur normally is with a timeout so that's what we assume*/
+		uSynergyDisconnect(context, USYNERGY_ERROR_TIMEOUT);
+		context->m_sleepFunc(context->m_cookie, 1000);
+		return;
+	}
+
+	/*	If we didn't receive any data then we're probably still polling to get connected and
+		therefore not getting any data back. To avoid overloading the system with a Synergy
+		thread that would hammer on polling, we let it rest for a bit if there's no data. */
+	if (num_received == 0)
+		context->m_sleepFunc(context->m_cookie, 500);
+
+	now = context->m_getTimeFunc();
+	/* Timeout after enough missed heartbeats (we received no CALV) */
+	if (num_received == 0 && context->m_hasReceivedHello && !uSynergyKeepAliveCheck(context, now)) {
+		uSynergyDisconnect(context, USYNERGY_ERROR_TIMEOUT);
+		return;
+	}
+
+	/* Parse, then hand over each batch of events */
+	do {
+		used = uSynergyFeed(context, buf, num_received, now, &batch);
+		buf += used;
+		num_received -= used;
+		sDispatch(context, &batch, osGetMonoNs());
+		if (!uSynergyFlush(context))
+			break;
+	} while (context->m_connected && (batch.more || (num_received && used)));
+
+	/* lost the connection, so give it a moment */
+	if (!context->m_connected)
+		context->m_sleepFunc(context->m_cookie, 1000);
+}
+
+
+
+/**
+@brief Update uSynergy
+**/
+void uSynergyUpdate(uSynergyContext *context)
+{
+	if (context->m_connected)
+	{
+		/* Update context, receive data, call callbacks */
+		sUpdateContext(context);
+	}
+	else
+	{
+		/* Try to connect */
+		if (context->m_lastError > 0) {
+			if (context->m_errorIsFatal[context->m_lastError]) {
+				logErr("Last error received (code %d) is configured as fatal, exiting", context->m_lastError);
+				Exit(SES_ERROR_SYN);
+			}
+		}
+		if (context->m_connectFunc(context->m_cookie)) {
+			uSynergyStart(context, context->m_getTimeFunc());
+		} else {
+			logErr("Connection attempt failed, trying to reconnect in a second");
+			context->m_sleepFunc(context->m_cookie, 1000);
+		}
+	}
+}
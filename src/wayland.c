@@ -16,6 +16,9 @@
 #include <stdbool.h>
 #include "log.h"
 #include "sig.h"
+#include "flight.h"
+#include "latency.h"
+#include "metrics.h"
 
 
 static char *display_strerror(int error)
@@ -96,11 +99,27 @@ static bool wl_display_flush_block(struct wlContext *ctx)
 
 void wlDisplayFlush(struct wlContext *ctx)
 {
+	if (!ctx->display) {
+		latencyMark(LATENCY_STAGE_FLUSH);
+		return;
+	}
+	if (ctx->flush_defer) {
+		ctx->flush_pending = true;
+		latencyMark(LATENCY_STAGE_FLUSH);
+		return;
+	}
+	ctx->flush_pending = false;
+	metricsAdd(&metrics.wl_flushes, 1);
 	if (!wl_display_flush_base(ctx)) {
+		metricsAdd(&metrics.wl_flushes_blocked, 1);
+		flightRecord(FLIGHT_FLUSH, "FLSH", 1, 0, 0);
 		if (!wl_display_flush_block(ctx)) {
 			ExitOrRestart(SES_ERROR_WL);
 		}
+	} else {
+		flightRecord(FLIGHT_FLUSH, "FLSH", 0, 0, 0);
 	}
+	latencyMark(LATENCY_STAGE_FLUSH);
 }
 
 void wlOutputAppend(struct wlOutput **outputs, struct wl_output *output, struct zxdg_output_v1 *xdg_output, uint32_t wl_name)
@@ -211,6 +230,7 @@ static void output_mode(void *data, struct wl_output *wl_output, uint32_t flags,
 			logInfo("Not using preferred mode on output -- check config");
 		}
 		logDbg("Mutating output...");
+		output->refresh = refresh;
 		if (output->have_log_size) {
 			logDbg("Except not really, because logical size outweighs this");
 			return;
@@ -233,6 +253,30 @@ static void output_scale(void *data, struct wl_output *wl_output, int32_t factor
 	output->complete = false;
 	output->scale = factor;
 }
+/* tell whoever cares about the new layout -- straight away while setting up,
+ * then once things have been quiet for a moment, so that a dock coming or
+ * going reconfigures everything once rather than for every step of it */
+static void output_update(struct wlContext *ctx)
+{
+	if (!ctx->on_output_update)
+		return;
+	if (!ctx->output_debounce) {
+		ctx->on_output_update(ctx);
+		return;
+	}
+	ctx->output_update_due = osGetMonoNs() + ctx->output_debounce * 1000000;
+}
+
+static void output_update_run(struct wlContext *ctx)
+{
+	if (!ctx->output_update_due || osGetMonoNs() < ctx->output_update_due)
+		return;
+	ctx->output_update_due = 0;
+	logDbg("Outputs settled, triggering event");
+	if (ctx->on_output_update)
+		ctx->on_output_update(ctx);
+}
+
 static void output_done(void *data, struct wl_output *wl_output)
 {
 	struct wlContext *ctx = data;
@@ -261,9 +305,8 @@ static void output_done(void *data, struct wl_output *wl_output)
 		complete = complete && output->complete;
 	}
 	if (complete) {
-		logDbg("All outputs updated, triggering event");
-		if (ctx->on_output_update)
-			ctx->on_output_update(ctx);
+		logDbg("All outputs updated");
+		output_update(ctx);
 	}
 }
 
@@ -405,12 +448,11 @@ static void seat_capabilities(void *data, struct wl_seat *wl_seat, uint32_t caps
 	if (caps & WL_SEAT_CAPABILITY_POINTER) {
 		logDbg("Seat has pointer");
 	}
-	if (caps & WL_SEAT_CAPABILITY_KEYBOARD) {
+	/* the keymap follows, picked up by wlSetup() or the main loop */
+	if ((caps & WL_SEAT_CAPABILITY_KEYBOARD) && !ctx->kb) {
 		logDbg("Seat has keyboard");
 		ctx->kb = wl_seat_get_keyboard(wl_seat);
 		wl_keyboard_add_listener(ctx->kb, &keyboard_listener, ctx);
-		wl_display_dispatch(ctx->display);
-		wl_display_roundtrip(ctx->display);
 	}
 }
 
@@ -481,7 +523,7 @@ static void handle_global_remove(void *data, struct wl_registry *registry, uint3
 	if (output) {
 		logInfo("Lost output %s", output->name ? output->name : "");
 		wlOutputRemove(&ctx->outputs, output);
-		ctx->on_output_update(ctx);
+		output_update(ctx);
 	}
 }
 
@@ -492,18 +534,73 @@ static const struct wl_registry_listener registry_listener = {
 
 uint32_t wlTS(struct wlContext *ctx)
 {
-	struct timespec ts;
-	if (ctx->epoch == -1) {
-		ctx->epoch = time(NULL);
-	}
-	clock_gettime(CLOCK_MONOTONIC, &ts);
-	ts.tv_sec -= ctx->epoch;
-	return (ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+	/* events from the server are stamped with when they arrived */
+	if (latencyState.event_time)
+		return latencyState.event_time / 1000000;
+	return osGetMonoNs() / 1000000;
 }
 
 void wlClose(struct wlContext *ctx)
 {
-	return;
+	if (ctx->input.cleanup)
+		ctx->input.cleanup(&ctx->input);
+}
+
+/* without a compositor to hand us its keymap, build one the way xkbcommon
+ * does by default -- from the XKB_DEFAULT_* environment variables */
+static bool headless_keymap(struct wlContext *ctx)
+{
+	struct xkb_context *xkb_ctx;
+	struct xkb_keymap *xkb_map;
+
+	if (!(xkb_ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS))) {
+		logErr("Could not create xkb context");
+		return false;
+	}
+	if (!(xkb_map = xkb_keymap_new_from_names(xkb_ctx, NULL, XKB_KEYMAP_COMPILE_NO_FLAGS))) {
+		logErr("Could not compile default keymap");
+		xkb_context_unref(xkb_ctx);
+		return false;
+	}
+	ctx->kb_map = xkb_keymap_get_as_string(xkb_map, XKB_KEYMAP_FORMAT_TEXT_V1);
+	xkb_keymap_unref(xkb_map);
+	xkb_context_unref(xkb_ctx);
+	return ctx->kb_map;
+}
+
+static bool headless_setup(struct wlContext *ctx, char *backend)
+{
+	bool input_init = false;
+
+	if (!(ctx->width && ctx->height)) {
+		logErr("Running headless requires manual dimensions");
+		return false;
+	}
+	if (backend) {
+		if (!strcmp(backend, "null")) {
+			input_init = wlInputInitNull(ctx);
+		} else if (!strcmp(backend, "record")) {
+			input_init = wlInputInitRecord(ctx);
+		}
+	}
+	if (!input_init) {
+		logErr("Running headless requires the null or record backend");
+		return false;
+	}
+	if (ctx->uinput_fd[0] != -1)
+		close(ctx->uinput_fd[0]);
+	if (ctx->uinput_fd[1] != -1)
+		close(ctx->uinput_fd[1]);
+	ctx->uinput_fd[0] = -1;
+	ctx->uinput_fd[1] = -1;
+	if (!headless_keymap(ctx))
+		return false;
+	if (wlKeySetConfigLayout(ctx)) {
+		logErr("Could not configure virtual keyboard");
+		return false;
+	}
+	logInfo("Running headless, without a display connection");
+	return true;
 }
 
 bool wlSetup(struct wlContext *ctx, int width, int height, char *backend)
@@ -516,6 +613,9 @@ bool wlSetup(struct wlContext *ctx, int width, int height, char *backend)
 
 	ctx->width = width;
 	ctx->height = height;
+	wlMotionInit(ctx);
+	if (ctx->headless)
+		return headless_setup(ctx, backend);
 	ctx->display = wl_display_connect(NULL);
 	if (!ctx->display) {
 		logPErr("Could not connect to display");
@@ -523,8 +623,13 @@ bool wlSetup(struct wlContext *ctx, int width, int height, char *backend)
 	}
 	ctx->registry = wl_display_get_registry(ctx->display);
 	wl_registry_add_listener(ctx->registry, &registry_listener, ctx);
-	wl_display_dispatch(ctx->display);
+	/* the globals, then what binding them sends (seat capabilities and
+	 * output details), then the keymap of the keyboard that got us */
+	wl_display_roundtrip(ctx->display);
 	wl_display_roundtrip(ctx->display);
+	if (ctx->kb)
+		wl_display_roundtrip(ctx->display);
+	latencyPhase("wayland connection");
 
 	/* figure out which compositor we are using */
 	fd = wl_display_get_fd(ctx->display);
@@ -538,6 +643,10 @@ bool wlSetup(struct wlContext *ctx, int width, int height, char *backend)
 			input_init = wlInputInitKde(ctx);
 		} else if (!strcmp(backend, "uinput")) {
 			input_init = wlInputInitUinput(ctx);
+		} else if (!strcmp(backend, "null")) {
+			input_init = wlInputInitNull(ctx);
+		} else if (!strcmp(backend, "record")) {
+			input_init = wlInputInitRecord(ctx);
 		}
 		if (!input_init) {
 			logErr("Input backend %s not supported", backend);
@@ -561,11 +670,13 @@ bool wlSetup(struct wlContext *ctx, int width, int height, char *backend)
 		close(ctx->uinput_fd[0]);
 	if (ctx->uinput_fd[1] != -1)
 		close(ctx->uinput_fd[1]);
+	latencyPhase("input backend");
 
 	if(wlKeySetConfigLayout(ctx)) {
 		logErr("Could not configure virtual keyboard");
 		return false;
 	}
+	latencyPhase("keymap");
 
 	/* initiailize idle inhibition */
 	if (configTryBool("idle-inhibit/enable", true)) {
@@ -581,6 +692,12 @@ bool wlSetup(struct wlContext *ctx, int width, int height, char *backend)
 	} else {
 		logInfo("Idle inhibition explicitly disabled");
 	}
+	latencyPhase("idle inhibition");
+	/* from here on output changes are batched up */
+	if ((ctx->output_debounce = configTryLong("wayland/output_debounce", 100)) < 0) {
+		logWarn("wayland/output_debounce must not be negative");
+		ctx->output_debounce = 0;
+	}
 
 	/* set FD_CLOEXEC */
 	int flags = fcntl(fd, F_GETFD);
@@ -603,6 +720,8 @@ int wlPrepareFd(struct wlContext *ctx)
 {
 	int fd;
 
+	if (!ctx->display)
+		return -1;
 	fd = wl_display_get_fd(ctx->display);
 //	while (wl_display_prepare_read(display) != 0) {
 //		wl_display_dispatch(display);
@@ -611,8 +730,25 @@ int wlPrepareFd(struct wlContext *ctx)
 	return fd;
 }
 
+int wlPollTimeout(struct wlContext *ctx, int timeout)
+{
+	uint64_t now;
+	int due;
+
+	timeout = wlMotionTimeout(ctx, timeout);
+	if (!ctx->output_update_due)
+		return timeout;
+	now = osGetMonoNs();
+	due = now < ctx->output_update_due ? (ctx->output_update_due - now + 999999) / 1000000 : 0;
+	return (timeout < 0 || due < timeout) ? due : timeout;
+}
+
 void wlPollProc(struct wlContext *ctx, short revents)
 {
+	wlMotionRun(ctx);
+	if (!ctx->display)
+		return;
+	output_update_run(ctx);
 	if (revents & POLLIN) {
 //		wl_display_cancel_read(display);
 		wl_display_dispatch(ctx->display);
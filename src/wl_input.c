@@ -3,6 +3,8 @@
 #include <stdbool.h>
 #include "log.h"
 #include "fdio_full.h"
+#include "flight.h"
+#include "latency.h"
 #include <xkbcommon/xkbcommon.h>
 
 
@@ -37,6 +39,21 @@ void wlLoadButtonMap(struct wlContext *ctx)
 */
 
 
+static void local_mod_free(struct wlContext *wl_ctx) {
+	if (wl_ctx->input.xkb_state) {
+		xkb_state_unref(wl_ctx->input.xkb_state);
+		wl_ctx->input.xkb_state = NULL;
+	}
+	if (wl_ctx->input.xkb_map) {
+		xkb_map_unref(wl_ctx->input.xkb_map);
+		wl_ctx->input.xkb_map = NULL;
+	}
+	if (wl_ctx->input.xkb_ctx) {
+		xkb_context_unref(wl_ctx->input.xkb_ctx);
+		wl_ctx->input.xkb_ctx = NULL;
+	}
+}
+
 static bool local_mod_init(struct wlContext *wl_ctx, char *keymap_str) {
 	wl_ctx->input.xkb_ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
 	if (!wl_ctx->input.xkb_ctx) {
@@ -53,6 +70,10 @@ static bool local_mod_init(struct wlContext *wl_ctx, char *keymap_str) {
 		xkb_context_unref(wl_ctx->input.xkb_ctx);
 		return false;
 	}
+	wl_ctx->input.mods_depressed = 0;
+	wl_ctx->input.mods_latched = 0;
+	wl_ctx->input.mods_locked = 0;
+	wl_ctx->input.group = 0;
 	return true;
 }
 
@@ -117,41 +138,182 @@ static void load_raw_keymap(struct wlContext *ctx)
 	strfreev(val);
 }
 
+/* shared by every page of the id keymap without a mapping, never written */
+static struct wlIdKey id_page_empty[WL_INPUT_ID_PAGE_SIZE] = {
+	[0 ... WL_INPUT_ID_PAGE_SIZE - 1] = { .key = WL_INPUT_ID_UNMAPPED }
+};
+
+static void free_id_keymap(struct wlContext *ctx)
+{
+	int i;
+
+	for (i = 0; i < WL_INPUT_ID_PAGES; ++i) {
+		if (ctx->input.id_keymap[i] != id_page_empty) {
+			free(ctx->input.id_keymap[i]);
+		}
+		ctx->input.id_keymap[i] = id_page_empty;
+	}
+}
+
+static bool set_id(struct wlContext *ctx, int id, int key, xkb_mod_mask_t mods)
+{
+	struct wlIdKey **page;
+
+	if (id < 0 || id >= WL_INPUT_ID_PAGES * WL_INPUT_ID_PAGE_SIZE) {
+		logWarn("Id %d outside synergy range, not mapping", id);
+		return false;
+	}
+	page = ctx->input.id_keymap + (id >> WL_INPUT_ID_PAGE_BITS);
+	if (*page == id_page_empty) {
+		if (key == WL_INPUT_ID_UNMAPPED)
+			return true;
+		*page = xmalloc(sizeof(id_page_empty));
+		memcpy(*page, id_page_empty, sizeof(id_page_empty));
+	}
+	(*page)[id & (WL_INPUT_ID_PAGE_SIZE - 1)] = (struct wlIdKey){ .key = key, .mods = mods };
+	return true;
+}
+
+bool wlKeySetId(struct wlContext *ctx, int id, int key)
+{
+	return set_id(ctx, id, key, 0);
+}
+
+/* synergy key ids are mostly keysyms: unicode below 0xE000, and the keysyms
+ * from 0xFE00 moved down by 0x1000. Dead keys are the combining characters. */
+static const struct {
+	xkb_keysym_t sym;
+	int id;
+} id_dead[] = {
+	{XKB_KEY_dead_grave, 0x0300},
+	{XKB_KEY_dead_acute, 0x0301},
+	{XKB_KEY_dead_circumflex, 0x0302},
+	{XKB_KEY_dead_tilde, 0x0303},
+	{XKB_KEY_dead_macron, 0x0304},
+	{XKB_KEY_dead_breve, 0x0306},
+	{XKB_KEY_dead_abovedot, 0x0307},
+	{XKB_KEY_dead_diaeresis, 0x0308},
+	{XKB_KEY_dead_abovering, 0x030a},
+	{XKB_KEY_dead_doubleacute, 0x030b},
+	{XKB_KEY_dead_caron, 0x030c},
+	{XKB_KEY_dead_cedilla, 0x0327},
+	{XKB_KEY_dead_ogonek, 0x0328},
+};
+
+static int keysym_to_id(xkb_keysym_t sym)
+{
+	uint32_t c;
+	size_t i;
+
+	for (i = 0; i < sizeof(id_dead)/sizeof(*id_dead); ++i) {
+		if (sym == id_dead[i].sym)
+			return id_dead[i].id;
+	}
+	if (sym >= 0xFE00 && sym <= 0xFFFF)
+		return sym - 0x1000;
+	c = xkb_keysym_to_utf32(sym);
+	if (!c || (c >= 0xE000 && c < 0xF000) || c > 0xFFFF)
+		return -1;
+	return c;
+}
+
+static xkb_keysym_t id_to_keysym(int id)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(id_dead)/sizeof(*id_dead); ++i) {
+		if (id == id_dead[i].id)
+			return id_dead[i].sym;
+	}
+	if (id >= 0xE000 && id < 0xF000)
+		return id + 0x1000;
+	if (id <= 0 || id > 0xFFFF)
+		return XKB_KEY_NoSymbol;
+	return xkb_utf32_to_keysym(id);
+}
+
+/* the modifiers that pick between the levels of a key */
+static xkb_mod_mask_t level_mods(struct xkb_keymap *map, xkb_keycode_t key)
+{
+	xkb_mod_mask_t masks[16], all = 0;
+	xkb_level_index_t level, count;
+	size_t i, n;
+
+	count = xkb_keymap_num_levels_for_key(map, key, 0);
+	for (level = 0; level < count; ++level) {
+		n = xkb_keymap_key_get_mods_for_level(map, key, 0, level, masks, sizeof(masks)/sizeof(*masks));
+		for (i = 0; i < n; ++i) {
+			all |= masks[i];
+		}
+	}
+	return all;
+}
+
+/* map every id the keymap can type in its first layout to the key and
+ * modifiers that type it, so the ids the server sends work no matter what the
+ * layout is. Lower levels go first, to need as few modifiers as possible. */
+static void load_id_keymap_auto(struct wlContext *ctx)
+{
+	struct xkb_keymap *map = ctx->input.xkb_map;
+	const xkb_keysym_t *syms;
+	xkb_keycode_t key, min, max;
+	xkb_level_index_t level;
+	xkb_mod_mask_t masks[16], mods;
+	size_t i, n;
+	int id, mapped = 0, skipped = 0;
+	bool more;
+
+	if (!map)
+		return;
+	min = xkb_keymap_min_keycode(map);
+	max = xkb_keymap_max_keycode(map);
+	for (level = 0, more = true; more; ++level) {
+		more = false;
+		for (key = min; key <= max; ++key) {
+			if (level >= xkb_keymap_num_levels_for_key(map, key, 0))
+				continue;
+			more = true;
+			if (xkb_keymap_key_get_syms_by_level(map, key, 0, level, &syms) != 1)
+				continue;
+			if ((id = keysym_to_id(syms[0])) == -1)
+				continue;
+			if (ctx->input.id_keymap[id >> WL_INPUT_ID_PAGE_BITS][id & (WL_INPUT_ID_PAGE_SIZE - 1)].key != WL_INPUT_ID_UNMAPPED)
+				continue;
+			/* of the ways to reach the level, the one with the fewest
+			 * modifiers */
+			if (!(n = xkb_keymap_key_get_mods_for_level(map, key, 0, level, masks, sizeof(masks)/sizeof(*masks))))
+				continue;
+			mods = masks[0];
+			for (i = 1; i < n; ++i) {
+				if (__builtin_popcount(masks[i]) < __builtin_popcount(mods))
+					mods = masks[i];
+			}
+			if (mods && !ctx->input.key_mods) {
+				++skipped;
+				continue;
+			}
+			set_id(ctx, id, key, mods);
+			++mapped;
+		}
+	}
+	logDbg("Mapped %d ids from the keymap, skipped %d needing modifiers the backend can't set", mapped, skipped);
+}
+
 static void load_id_keymap(struct wlContext *ctx)
 {
 	char **key, **val, *endstr;
 	int i, count,lkey, rkey;
 	key = NULL;
 	val = NULL;
-	if (ctx->input.id_keymap) {
-		free(ctx->input.id_keymap);
-	}
-	/* start with the known synergy maximum */
-	ctx->input.id_count = 0xF000;
-	logDbg("max key: %zu", ctx->input.id_count);
-	if ((count = configReadFullSection("id-keymap", &key, &val)) != -1) {
-		/* slightly inefficient approach, but it will actually work
-		 * First pass -- just find the *real* maximum id keycode */
-		for (i = 0; i < count; ++i) {
-			errno = 0;
-			lkey = strtol(key[i], &endstr, 0);
-			if (errno || endstr == key[i])
-				continue;
-			if (lkey >= ctx->input.id_count) {
-				ctx->input.id_count = lkey + 1;
-				logDbg("max id update: %zu", ctx->input.id_count);
 
-			}
-		}
-	}
-	/* initialize everything */
-	ctx->input.id_keymap = xcalloc(ctx->input.id_count, sizeof(*ctx->input.id_keymap));
-	/* and set everything as invalid initially, to trigger raw key map */
-	if (ctx->input.id_keymap_valid) {
-		free(ctx->input.id_keymap_valid);
+	/* set everything as unmapped initially, to trigger raw key map */
+	free_id_keymap(ctx);
+	/* explicit mappings still take precedence */
+	if ((ctx->input.id_auto = configTryBool("id-keymap/auto", false))) {
+		load_id_keymap_auto(ctx);
 	}
-	ctx->input.id_keymap_valid = xcalloc(ctx->input.id_count, sizeof(*ctx->input.id_keymap_valid));
-	/* and second pass -- store any actually mappings, set valid */
+	if ((count = configReadFullSection("id-keymap", &key, &val)) == -1)
+		return;
 	for (i = 0; i < count; ++i) {
 		errno = 0;
 		lkey = strtol(key[i], &endstr, 0);
@@ -161,9 +323,9 @@ static void load_id_keymap(struct wlContext *ctx)
 		rkey = strtol(val[i], &endstr, 0);
 		if (errno || endstr == val[i])
 			continue;
-		ctx->input.id_keymap[lkey] = rkey;
-		ctx->input.id_keymap_valid[lkey] = true;
-		logDbg("set id key map: %d = %d", lkey, ctx->input.id_keymap[lkey]);
+		if (!wlKeySetId(ctx, lkey, rkey))
+			continue;
+		logDbg("set id key map: %d = %d", lkey, rkey);
 		if (rkey >= ctx->input.key_press_state_len) {
 			ctx->input.key_press_state_len = rkey + 1;
 			logDbg("Set maximum raw keycode to %d", rkey + 1);
@@ -180,15 +342,18 @@ int wlKeySetConfigLayout(struct wlContext *ctx)
 
 	/* ensure that we've given everything a chance to give us a proper
 	   default */
-	if (!ctx->kb_map) {
-		wl_display_dispatch(ctx->display);
+	if (!ctx->kb_map && ctx->display) {
 		wl_display_roundtrip(ctx->display);
 	}
 
 	char *default_map = ctx->kb_map;
 	logDbg("Will default to map %s", default_map);
 	char *keymap_str = configTryStringFull("xkb_keymap", default_map);
+	/* this may be a reload */
+	local_mod_free(ctx);
+	free(ctx->input.key_press_state);
 	local_mod_init(ctx, keymap_str);
+	flightRecord(FLIGHT_INPUT, "KMAP", strlen(keymap_str), 0, 0);
 	ret = !ctx->input.key_map(&ctx->input, keymap_str);
 	ctx->input.key_press_state_len = 0;
 	load_raw_keymap(ctx);
@@ -198,9 +363,23 @@ int wlKeySetConfigLayout(struct wlContext *ctx)
 	return ret;
 }
 
+static void mods_update(struct wlInput *input)
+{
+	input->mods_depressed = xkb_state_serialize_mods(input->xkb_state, XKB_STATE_MODS_DEPRESSED);
+	input->mods_latched = xkb_state_serialize_mods(input->xkb_state, XKB_STATE_MODS_LATCHED);
+	input->mods_locked = xkb_state_serialize_mods(input->xkb_state, XKB_STATE_MODS_LOCKED);
+	input->group = xkb_state_serialize_layout(input->xkb_state, XKB_STATE_LAYOUT_EFFECTIVE);
+	logDbg("Modifiers: depressed: %x latched: %x locked: %x group: %x",
+			input->mods_depressed,
+			input->mods_latched,
+			input->mods_locked,
+			input->group);
+}
+
 void wlKeyRaw(struct wlContext *ctx, int key, int state)
 {
 	size_t i;
+	enum xkb_state_component changed = 0;
 
 	/* keep track of raw keystate size */
 	if (key >= ctx->input.key_press_state_len) {
@@ -220,27 +399,89 @@ void wlKeyRaw(struct wlContext *ctx, int key, int state)
 	if (key > xkb_keymap_max_keycode(ctx->input.xkb_map)) {
 		logDbg("keycode greater than xkb maximum, mod not tracked");
 	} else {
-		xkb_state_update_key(ctx->input.xkb_state, key, state);
-		xkb_mod_mask_t depressed = xkb_state_serialize_mods(ctx->input.xkb_state, XKB_STATE_MODS_DEPRESSED);
-		xkb_mod_mask_t latched = xkb_state_serialize_mods(ctx->input.xkb_state, XKB_STATE_MODS_LATCHED);
-		xkb_mod_mask_t locked = xkb_state_serialize_mods(ctx->input.xkb_state, XKB_STATE_MODS_LOCKED);
-		xkb_layout_index_t group = xkb_state_serialize_layout(ctx->input.xkb_state, XKB_STATE_LAYOUT_EFFECTIVE);
-		logDbg("Modifiers: depressed: %x latched: %x locked: %x group: %x", depressed, latched, locked, group);
+		changed = xkb_state_update_key(ctx->input.xkb_state, key, state);
 	}
+	/* most keys aren't modifiers, so only serialize when they matter */
+	if ((ctx->input.mods_changed = changed & WL_INPUT_MODS_COMPONENTS))
+		mods_update(&ctx->input);
 
 	logDbg("Keycode: %d, state %d", key, state);
 	ctx->input.key_press_state[key] += state ? 1 : -1;
+	flightRecord(FLIGHT_INPUT, "KEY ", key, state, ctx->input.key_press_state[key]);
+	latencyDispatch(LATENCY_KEY);
 	ctx->input.key(&ctx->input, key, state);
+	latencyDone();
 }
 
 
+/* a keycode bound by the backend for an id the keymap can't type */
+static int spare_key(struct wlContext *ctx, int id)
+{
+	xkb_keysym_t sym;
+	int key;
+
+	if (!ctx->input.id_auto || !ctx->input.key_spare)
+		return -1;
+	if ((sym = id_to_keysym(id)) == XKB_KEY_NoSymbol)
+		return -1;
+	if ((key = ctx->input.key_spare(&ctx->input, sym)) == -1)
+		return -1;
+	logDbg("Id %d bound to spare key %d", id, key);
+	return key;
+}
+
+void wlKeyPrepare(struct wlContext *ctx, int id)
+{
+	if ((unsigned)id < WL_INPUT_ID_PAGES * WL_INPUT_ID_PAGE_SIZE &&
+			ctx->input.id_keymap[id >> WL_INPUT_ID_PAGE_BITS][id & (WL_INPUT_ID_PAGE_SIZE - 1)].key != WL_INPUT_ID_UNMAPPED)
+		return;
+	spare_key(ctx, id);
+}
+
+/* press a key with just the modifiers that pick the level wanted, then go
+ * back to those actually held */
+static void key_press_level(struct wlContext *ctx, int key, xkb_mod_mask_t mods)
+{
+	struct wlInput *input = &ctx->input;
+	xkb_mod_mask_t relevant;
+
+	relevant = level_mods(input->xkb_map, key);
+	if (((input->mods_depressed | input->mods_latched | input->mods_locked) & relevant) == mods) {
+		wlKeyRaw(ctx, key, 1);
+		return;
+	}
+	input->mods_depressed = (input->mods_depressed & ~relevant) | mods;
+	input->mods_latched &= ~relevant;
+	input->mods_locked &= ~relevant;
+	input->key_mods(input);
+	wlKeyRaw(ctx, key, 1);
+	mods_update(input);
+	input->key_mods(input);
+}
+
 void wlKey(struct wlContext *ctx, int key, int id, int state)
 {
+	const struct wlIdKey *entry = NULL;
 	int oldkey = key;
+	int mapped;
+	xkb_mod_mask_t mods = 0;
+
+	if (ctx->input.paused) {
+		logDbg("Input paused, dropping key %d", key);
+		return;
+	}
+	wlMotionFlush(ctx);
 
-	if ((id < ctx->input.id_count) && ctx->input.id_keymap_valid[id]) {
-		key = ctx->input.id_keymap[id];
+	if ((unsigned)id < WL_INPUT_ID_PAGES * WL_INPUT_ID_PAGE_SIZE)
+		entry = ctx->input.id_keymap[id >> WL_INPUT_ID_PAGE_BITS] + (id & (WL_INPUT_ID_PAGE_SIZE - 1));
+	if (entry && entry->key != WL_INPUT_ID_UNMAPPED) {
+		key = entry->key;
+		mods = entry->mods;
 		logDbg("Key %d remapped to %d by id %d", oldkey, key, id);
+	} else if ((mapped = spare_key(ctx, id)) != -1) {
+		key = mapped;
+		if (ctx->input.key_spare_commit)
+			ctx->input.key_spare_commit(&ctx->input);
 	} else {
 		if (key >= ctx->input.key_count) {
 			logWarn("Key %d outside configured keymap, dropping", key);
@@ -255,7 +496,11 @@ void wlKey(struct wlContext *ctx, int key, int id, int state)
 		logDbg("Dropping key mapped to -1");
 		return;
 	}
-	wlKeyRaw(ctx, key, state);
+	if (state && mods) {
+		key_press_level(ctx, key, mods);
+	} else {
+		wlKeyRaw(ctx, key, state);
+	}
 }
 
 void wlKeyReleaseAll(struct wlContext *ctx)
@@ -270,24 +515,76 @@ void wlKeyReleaseAll(struct wlContext *ctx)
 }
 
 
+void wlInputPause(struct wlContext *ctx, bool paused)
+{
+	if (paused == ctx->input.paused)
+		return;
+	logInfo("Input %s", paused ? "paused" : "resumed");
+	/* nothing should be left held down while we aren't listening */
+	if (paused) {
+		wlMotionFlush(ctx);
+		wlKeyReleaseAll(ctx);
+	}
+	ctx->input.paused = paused;
+}
+
 void wlMouseRelativeMotion(struct wlContext *ctx, int dx, int dy)
 {
+	if (ctx->input.paused)
+		return;
+	flightRecord(FLIGHT_INPUT, "MREL", dx, dy, 0);
+	if (wlMotionQueue(ctx, true, dx, dy))
+		return;
+	latencyDispatch(LATENCY_MOTION);
 	ctx->input.mouse_rel_motion(&ctx->input, dx, dy);
+	latencyDone();
 }
 void wlMouseMotion(struct wlContext *ctx, int x, int y)
 {
+	if (ctx->input.paused)
+		return;
+	flightRecord(FLIGHT_INPUT, "MABS", x, y, 0);
+	if (wlMotionQueue(ctx, false, x, y))
+		return;
+	latencyDispatch(LATENCY_MOTION);
 	ctx->input.mouse_motion(&ctx->input, x, y);
+	latencyDone();
 }
 void wlMouseButton(struct wlContext *ctx, int button, int state)
 {
+	if (ctx->input.paused)
+		return;
 	if (button >= WL_INPUT_BUTTON_COUNT) {
 		logWarn("Mouse button %d exceeds maximum %d, dropping", button, WL_INPUT_BUTTON_COUNT);
 		return;
 	}
 	logDbg("Mouse button: %d (mapped to %d), state: %d", button, ctx->input.button_map[button], state);
+	flightRecord(FLIGHT_INPUT, "MBTN", button, ctx->input.button_map[button], state);
+	wlMotionFlush(ctx);
+	latencyDispatch(LATENCY_BUTTON);
 	ctx->input.mouse_button(&ctx->input, ctx->input.button_map[button], state);
+	latencyDone();
+}
+int wlInputWheelSteps(struct wlInput *input, int axis, int delta)
+{
+	int *rest = input->wheel_rest + axis;
+	int steps;
+
+	/* turning the other way starts over */
+	if ((*rest > 0 && delta < 0) || (*rest < 0 && delta > 0))
+		*rest = 0;
+	*rest += delta;
+	steps = *rest / WL_INPUT_WHEEL_STEP;
+	*rest -= steps * WL_INPUT_WHEEL_STEP;
+	return steps;
 }
 void wlMouseWheel(struct wlContext *ctx, signed short dx, signed short dy)
 {
+	if (ctx->input.paused)
+		return;
+	flightRecord(FLIGHT_INPUT, "MWHL", dx, dy, 0);
+	wlMotionFlush(ctx);
+	latencyDispatch(LATENCY_WHEEL);
 	ctx->input.mouse_wheel(&ctx->input, dx, dy);
+	latencyDone();
 }
@@ -35,18 +35,15 @@ static void mouse_button(struct wlInput *input, int button, int state)
 	wlDisplayFlush(input->wl_ctx);
 }
 
+/* 15 to a notch, as with a real wheel, but in proportion to the delta */
 static void mouse_wheel(struct wlInput *input, signed short dx, signed short dy)
 {
 	struct org_kde_kwin_fake_input *fake = input->state;
-	if (dx < 0) {
-		org_kde_kwin_fake_input_axis(fake, 1, wl_fixed_from_int(15));
-	}else if (dx > 0) {
-		org_kde_kwin_fake_input_axis(fake, 1, wl_fixed_from_int(-15));
+	if (dx) {
+		org_kde_kwin_fake_input_axis(fake, 1, -dx * (15 * 256 / WL_INPUT_WHEEL_STEP));
 	}
-	if (dy < 0) {
-		org_kde_kwin_fake_input_axis(fake, 0, wl_fixed_from_int(15));
-	} else if (dy > 0) {
-		org_kde_kwin_fake_input_axis(fake, 0, wl_fixed_from_int(-15));
+	if (dy) {
+		org_kde_kwin_fake_input_axis(fake, 0, -dy * (15 * 256 / WL_INPUT_WHEEL_STEP));
 	}
 	wlDisplayFlush(input->wl_ctx);
 }
@@ -0,0 +1,40 @@
+/* input that goes nowhere, for benchmarks and running without a display */
+
+#include "wayland.h"
+#include "log.h"
+
+static void mouse_rel_motion(struct wlInput *input, int dx, int dy)
+{
+}
+static void mouse_motion(struct wlInput *input, int x, int y)
+{
+}
+static void mouse_button(struct wlInput *input, int button, int state)
+{
+}
+static void mouse_wheel(struct wlInput *input, signed short dx, signed short dy)
+{
+}
+static void key(struct wlInput *input, int key, int state)
+{
+}
+static bool key_map(struct wlInput *input, char *keymap_str)
+{
+	return true;
+}
+
+bool wlInputInitNull(struct wlContext *ctx)
+{
+	ctx->input = (struct wlInput) {
+		.wl_ctx = ctx,
+		.mouse_rel_motion = mouse_rel_motion,
+		.mouse_motion = mouse_motion,
+		.mouse_button = mouse_button,
+		.mouse_wheel = mouse_wheel,
+		.key = key,
+		.key_map = key_map,
+	};
+	wlLoadButtonMap(ctx);
+	logInfo("Using null input backend, input will be dropped");
+	return true;
+}
@@ -0,0 +1,91 @@
+/* input written out as text, one call per line, for checking what the
+ * client would have done and timing it without a compositor in the way */
+
+#include "wayland.h"
+#include "log.h"
+#include <inttypes.h>
+
+struct state_record {
+	FILE *f;
+	uint64_t start;
+};
+
+static void out(struct wlInput *input, const char *call, int a, int b)
+{
+	struct state_record *rec = input->state;
+
+	fprintf(rec->f, "%" PRIu64 " %s %d %d\n", osGetMonoNs() - rec->start, call, a, b);
+}
+
+static void mouse_rel_motion(struct wlInput *input, int dx, int dy)
+{
+	out(input, "rel", dx, dy);
+}
+static void mouse_motion(struct wlInput *input, int x, int y)
+{
+	out(input, "motion", x, y);
+}
+static void mouse_button(struct wlInput *input, int button, int state)
+{
+	out(input, "button", button, state);
+}
+static void mouse_wheel(struct wlInput *input, signed short dx, signed short dy)
+{
+	out(input, "wheel", dx, dy);
+}
+static void key(struct wlInput *input, int key, int state)
+{
+	out(input, "key", key, state);
+}
+static bool key_map(struct wlInput *input, char *keymap_str)
+{
+	out(input, "keymap", strlen(keymap_str), 0);
+	return true;
+}
+static void update_geom(struct wlInput *input)
+{
+	out(input, "geom", input->wl_ctx->width, input->wl_ctx->height);
+}
+static void cleanup(struct wlInput *input)
+{
+	struct state_record *rec = input->state;
+
+	fclose(rec->f);
+	free(rec);
+	input->state = NULL;
+	input->cleanup = NULL;
+}
+
+bool wlInputInitRecord(struct wlContext *ctx)
+{
+	struct state_record *rec;
+	char *path;
+
+	if (!(path = configTryString("input-record/path", NULL))) {
+		path = osGetRuntimePath("waynergy-input-record");
+	}
+	rec = xmalloc(sizeof(*rec));
+	if (!(rec->f = fopen(path, "w"))) {
+		logPErr("Could not open input record file");
+		free(path);
+		free(rec);
+		return false;
+	}
+	rec->start = osGetMonoNs();
+	ctx->input = (struct wlInput) {
+		.state = rec,
+		.wl_ctx = ctx,
+		.mouse_rel_motion = mouse_rel_motion,
+		.mouse_motion = mouse_motion,
+		.mouse_button = mouse_button,
+		.mouse_wheel = mouse_wheel,
+		.key = key,
+		.key_map = key_map,
+		.update_geom = update_geom,
+		.cleanup = cleanup,
+	};
+	wlLoadButtonMap(ctx);
+	logInfo("Recording input to %s", path);
+	free(path);
+	return true;
+}
@@ -23,9 +23,15 @@ bool wlInputInitUinput(struct wlContext *ctx)
 struct state_uinput {
 	int key_fd;
 	int mouse_fd;
+	/* screen to device coordinates, in 16.16 fixed point */
+	int64_t scale_x;
+	int64_t scale_y;
 };
 
 #define UINPUT_KEY_MAX 256
+/* the absolute axes cover this range whatever the screen size, so that a
+ * change of geometry only needs the scale updated rather than a new device */
+#define UINPUT_ABS_MAX 32767
 
 static void emit(int fd, int type, int code, int val)
 {
@@ -51,8 +57,8 @@ static void mouse_motion(struct wlInput *input, int x, int y)
 {
 	struct state_uinput *ui = input->state;
 
-	emit(ui->mouse_fd, EV_ABS, ABS_X, x);
-	emit(ui->mouse_fd, EV_ABS, ABS_Y, y);
+	emit(ui->mouse_fd, EV_ABS, ABS_X, (x * ui->scale_x) >> 16);
+	emit(ui->mouse_fd, EV_ABS, ABS_Y, (y * ui->scale_y) >> 16);
 	emit(ui->mouse_fd, EV_SYN, SYN_REPORT, 0);
 }
 
@@ -64,19 +70,26 @@ static void mouse_button(struct wlInput *input, int button, int state)
 	emit(ui->mouse_fd, EV_SYN, SYN_REPORT, 0);
 }
 
+/* the high resolution axes use the same 120 to a notch as the server, while
+ * the plain ones only get whole notches */
 static void mouse_wheel(struct wlInput *input, signed short dx, signed short dy)
 {
 	struct state_uinput *ui = input->state;
+	int steps;
 
-	if (dx < 0) {
-		emit(ui->mouse_fd, EV_REL, REL_HWHEEL, -1);
-	} else if (dx > 0) {
-		emit(ui->mouse_fd, EV_REL, REL_HWHEEL, 1);
+	if (dx) {
+#if defined(REL_HWHEEL_HI_RES)
+		emit(ui->mouse_fd, EV_REL, REL_HWHEEL_HI_RES, dx);
+#endif
+		if ((steps = wlInputWheelSteps(input, 1, dx)))
+			emit(ui->mouse_fd, EV_REL, REL_HWHEEL, steps);
 	}
-	if (dy < 0) {
-		emit(ui->mouse_fd, EV_REL, REL_WHEEL, -1);
-	} else if (dy > 0) {
-		emit(ui->mouse_fd, EV_REL, REL_WHEEL, 1);
+	if (dy) {
+#if defined(REL_WHEEL_HI_RES)
+		emit(ui->mouse_fd, EV_REL, REL_WHEEL_HI_RES, dy);
+#endif
+		if ((steps = wlInputWheelSteps(input, 0, dy)))
+			emit(ui->mouse_fd, EV_REL, REL_WHEEL, steps);
 	}
 	emit(ui->mouse_fd, EV_SYN, SYN_REPORT, 0);
 }
@@ -138,7 +151,7 @@ static bool init_key(struct state_uinput *ui)
 	return true;
 }
 
-static bool init_mouse(struct wlContext *ctx, struct state_uinput *ui, int max_x, int max_y)
+static bool init_mouse(struct wlContext *ctx, struct state_uinput *ui)
 {
 	int i;
 
@@ -151,13 +164,13 @@ static bool init_mouse(struct wlContext *ctx, struct state_uinput *ui, int max_x
 	struct uinput_abs_setup x = {
 		.code = ABS_X,
 		.absinfo = {
-			.maximum = max_x,
+			.maximum = UINPUT_ABS_MAX,
 		},
 	};
 	struct uinput_abs_setup y = {
 		.code = ABS_Y,
 		.absinfo = {
-			.maximum = max_y,
+			.maximum = UINPUT_ABS_MAX,
 		},
 	};
 
@@ -172,6 +185,10 @@ static bool init_mouse(struct wlContext *ctx, struct state_uinput *ui, int max_x
 	TRY_IOCTL(ui->mouse_fd, UI_SET_RELBIT, REL_Y);
 	TRY_IOCTL(ui->mouse_fd, UI_SET_RELBIT, REL_WHEEL);
 	TRY_IOCTL(ui->mouse_fd, UI_SET_RELBIT, REL_HWHEEL);
+#if defined(REL_WHEEL_HI_RES)
+	TRY_IOCTL(ui->mouse_fd, UI_SET_RELBIT, REL_WHEEL_HI_RES);
+	TRY_IOCTL(ui->mouse_fd, UI_SET_RELBIT, REL_HWHEEL_HI_RES);
+#endif
 	TRY_IOCTL(ui->mouse_fd, UI_SET_EVBIT, EV_ABS);
 	TRY_IOCTL(ui->mouse_fd, UI_SET_ABSBIT, ABS_X);
 	TRY_IOCTL(ui->mouse_fd, UI_SET_ABSBIT, ABS_Y);
@@ -186,19 +203,14 @@ static bool init_mouse(struct wlContext *ctx, struct state_uinput *ui, int max_x
 	return true;
 }
 
-static bool reinit_mouse(struct wlInput *input)
+static void update_geom(struct wlInput *input)
 {
 	struct state_uinput *ui = input->state;
-	TRY_IOCTL0(ui->mouse_fd, UI_DEV_DESTROY);
-	return init_mouse(input->wl_ctx, ui, input->wl_ctx->width, input->wl_ctx->height);
-}
+	struct wlContext *ctx = input->wl_ctx;
 
-static void update_geom(struct wlInput *input)
-{
-	logDbg("uinput: updating geometry for mouse");
-	if (!reinit_mouse(input)) {
-		logErr("Could not reinitialize uinput for mouse");
-	}
+	ui->scale_x = ctx->width > 0 ? ((int64_t)UINPUT_ABS_MAX << 16) / ctx->width : 0;
+	ui->scale_y = ctx->height > 0 ? ((int64_t)UINPUT_ABS_MAX << 16) / ctx->height : 0;
+	logDbg("uinput: mouse scaled for %dx%d", ctx->width, ctx->height);
 }
 
 bool wlInputInitUinput(struct wlContext *ctx)
@@ -210,7 +222,7 @@ bool wlInputInitUinput(struct wlContext *ctx)
 		return false;
 	}
 
-	ui = xmalloc(sizeof(*ui));
+	ui = xcalloc(1, sizeof(*ui));
 	ui->key_fd = ctx->uinput_fd[0];
 	ui->mouse_fd = ctx->uinput_fd[1];
 	/* we've consumed these */
@@ -234,8 +246,9 @@ bool wlInputInitUinput(struct wlContext *ctx)
 
 	if (!init_key(ui))
 		goto error;
-	if (!init_mouse(ctx, ui, ctx->width, ctx->height))
+	if (!init_mouse(ctx, ui))
 		goto error;
+	update_geom(&ctx->input);
 
 	logInfo("Using uinput");
 	return true;
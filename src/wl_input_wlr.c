@@ -6,41 +6,199 @@
 #include <xkbcommon/xkbcommon.h>
 #include <spawn.h>
 #include <ctype.h>
+#include "ssb.h"
 
 extern char **environ;
 
+#define WLR_SPARE_MAX 64
+
+/* a keycode the keymap doesn't use, which keysyms it lacks are bound to */
+struct spare_key {
+	xkb_keycode_t code;
+	/* from the keymap, or made up if it had none */
+	char name[8];
+	bool named;
+	xkb_keysym_t sym;
+	uint64_t used;
+	/* bound for a key that hasn't been pressed yet */
+	bool pinned;
+};
+
 struct state_wlr {
 	struct zwlr_virtual_pointer_v1 *pointer;
 	int wheel_mult;
 	struct zwp_virtual_keyboard_v1 *keyboard;
+	/* keymap as last set, which spare keys are added to */
+	char *keymap;
+	struct spare_key spare[WLR_SPARE_MAX];
+	int spare_count;
+	uint64_t spare_clock;
+	bool spare_dirty;
+	/* a new keymap resets the compositor's idea of the modifiers */
+	bool mods_stale;
 };
 
-/* create a layout file descriptor */
-static bool key_map(struct wlInput *input, char *keymap_str)
+static bool send_keymap(struct state_wlr *wlr, const char *keymap_str)
 {
-	logDbg("Setting virtual keymap");
-	struct state_wlr *wlr = input->state;
 	int fd;
+	size_t keymap_size = strlen(keymap_str) + 1;
+
 	if ((fd = osGetAnonFd()) == -1) {
 		return false;
 	}
-	size_t keymap_size = strlen(keymap_str) + 1;
 	if (!write_full(fd, keymap_str, keymap_size, 0)) {
+		close(fd);
 		return false;
 	}
 	zwp_virtual_keyboard_v1_keymap(wlr->keyboard, WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1, fd, keymap_size);
+	close(fd);
+	wlr->mods_stale = true;
 	return true;
 }
 
+/* keycodes with no symbols in any layout are free to use */
+static void find_spare_keys(struct wlInput *input)
+{
+	struct state_wlr *wlr = input->state;
+	xkb_keycode_t code, max;
+	const char *name;
+	int count;
+
+	count = configTryLong("wlr/spare_keys", 16);
+	if (count > WLR_SPARE_MAX)
+		count = WLR_SPARE_MAX;
+	max = xkb_keymap_max_keycode(input->xkb_map);
+	wlr->spare_count = 0;
+	for (code = xkb_keymap_min_keycode(input->xkb_map); code <= max && wlr->spare_count < count; ++code) {
+		if (xkb_keymap_num_layouts_for_key(input->xkb_map, code))
+			continue;
+		struct spare_key *spare = wlr->spare + wlr->spare_count;
+		*spare = (struct spare_key){ .code = code };
+		if ((name = xkb_keymap_key_get_name(input->xkb_map, code)) && strlen(name) < sizeof(spare->name)) {
+			strcpy(spare->name, name);
+			spare->named = true;
+		} else {
+			snprintf(spare->name, sizeof(spare->name), "WS%d", wlr->spare_count);
+		}
+		++wlr->spare_count;
+	}
+	logDbg("%d spare keycodes for keysyms missing from the layout", wlr->spare_count);
+}
+
+/* create a layout file descriptor */
+static bool key_map(struct wlInput *input, char *keymap_str)
+{
+	logDbg("Setting virtual keymap");
+	struct state_wlr *wlr = input->state;
+
+	free(wlr->keymap);
+	wlr->keymap = xstrdup(keymap_str);
+	find_spare_keys(input);
+	wlr->spare_dirty = false;
+	return send_keymap(wlr, keymap_str);
+}
+
+static int key_spare(struct wlInput *input, xkb_keysym_t sym)
+{
+	struct state_wlr *wlr = input->state;
+	struct spare_key *spare, *lru = NULL;
+	int i;
+
+	for (i = 0; i < wlr->spare_count; ++i) {
+		spare = wlr->spare + i;
+		if (spare->sym == sym) {
+			spare->used = ++wlr->spare_clock;
+			spare->pinned = true;
+			return spare->code;
+		}
+		/* anything held down, or about to be, has to stay as it is */
+		if (spare->pinned)
+			continue;
+		if (spare->code < input->key_press_state_len && input->key_press_state[spare->code])
+			continue;
+		if (!lru || spare->used < lru->used)
+			lru = spare;
+	}
+	if (!lru) {
+		logWarn("No spare keycode left for keysym 0x%x", sym);
+		return -1;
+	}
+	lru->sym = sym;
+	lru->used = ++wlr->spare_clock;
+	lru->pinned = true;
+	wlr->spare_dirty = true;
+	return lru->code;
+}
+
+/* the keymap again, with the spare keys declared in the keycodes and bound in
+ * the symbols */
+static void key_spare_commit(struct wlInput *input)
+{
+	struct state_wlr *wlr = input->state;
+	static struct ssb buf;
+	char *codes, *syms, sym_name[64];
+	int i;
+
+	if (!wlr->spare_dirty)
+		return;
+	wlr->spare_dirty = false;
+	if (!(codes = strstr(wlr->keymap, "xkb_keycodes")) || !(codes = strchr(codes, '{')) ||
+			!(syms = strstr(codes, "xkb_symbols")) || !(syms = strchr(syms, '{'))) {
+		logErr("Could not find where to add spare keys to the keymap");
+		return;
+	}
+	++codes;
+	++syms;
+	ssb_rewind(&buf);
+	ssb_xprintf(&buf, "%.*s", (int)(codes - wlr->keymap), wlr->keymap);
+	for (i = 0; i < wlr->spare_count; ++i) {
+		if (!wlr->spare[i].named)
+			ssb_xprintf(&buf, "\n\t<%s> = %u;", wlr->spare[i].name, wlr->spare[i].code);
+	}
+	ssb_xprintf(&buf, "%.*s", (int)(syms - codes), codes);
+	for (i = 0; i < wlr->spare_count; ++i) {
+		if (wlr->spare[i].sym == XKB_KEY_NoSymbol)
+			continue;
+		xkb_keysym_get_name(wlr->spare[i].sym, sym_name, sizeof(sym_name));
+		ssb_xprintf(&buf, "\n\tkey <%s> { [ %s ] };", wlr->spare[i].name, sym_name);
+	}
+	ssb_xprintf(&buf, "%s", syms);
+	logDbg("Updating virtual keymap with spare keys");
+	send_keymap(wlr, buf.buf);
+}
+
+static void send_mods(struct wlInput *input)
+{
+	struct state_wlr *wlr = input->state;
+	zwp_virtual_keyboard_v1_modifiers(wlr->keyboard,
+			input->mods_depressed,
+			input->mods_latched,
+			input->mods_locked,
+			input->group);
+	wlr->mods_stale = false;
+}
+
 static void key(struct wlInput *input, int key, int state)
 {
 	struct state_wlr *wlr = input->state;
-	xkb_mod_mask_t depressed = xkb_state_serialize_mods(input->xkb_state, XKB_STATE_MODS_DEPRESSED);
-	xkb_mod_mask_t latched = xkb_state_serialize_mods(input->xkb_state, XKB_STATE_MODS_LATCHED);
-	xkb_mod_mask_t locked = xkb_state_serialize_mods(input->xkb_state, XKB_STATE_MODS_LOCKED);
-	xkb_layout_index_t group = xkb_state_serialize_layout(input->xkb_state, XKB_STATE_LAYOUT_EFFECTIVE);
+	int i;
+
+	/* once pressed, a spare is kept by being held instead */
+	if (state) {
+		for (i = 0; i < wlr->spare_count; ++i) {
+			if (wlr->spare[i].code == key)
+				wlr->spare[i].pinned = false;
+		}
+	}
 	zwp_virtual_keyboard_v1_key(wlr->keyboard, wlTS(input->wl_ctx), key - 8, state);
-	zwp_virtual_keyboard_v1_modifiers(wlr->keyboard, depressed, latched, locked, group);
+	if (input->mods_changed || wlr->mods_stale)
+		send_mods(input);
+	wlDisplayFlush(input->wl_ctx);
+}
+
+static void key_mods(struct wlInput *input)
+{
+	send_mods(input);
 	wlDisplayFlush(input->wl_ctx);
 }
 
@@ -65,21 +223,30 @@ static void mouse_button(struct wlInput *input, int button, int state)
 	zwlr_virtual_pointer_v1_frame(wlr->pointer);
 	wlDisplayFlush(input->wl_ctx);
 }
+/* one axis of a wheel event; value is 15 to a notch as with a real wheel,
+ * and the notches are scaled by wheel_mult, so that with 120 they are the
+ * server's deltas untouched */
+static void wheel_axis(struct wlInput *input, int axis, int delta)
+{
+	struct state_wlr *wlr = input->state;
+	wl_fixed_t value = -delta * (15 * 256 / WL_INPUT_WHEEL_STEP);
+	int steps;
+
+	if (!delta)
+		return;
+	if ((steps = wlInputWheelSteps(input, axis, -delta * wlr->wheel_mult))) {
+		zwlr_virtual_pointer_v1_axis_discrete(wlr->pointer, wlTS(input->wl_ctx), axis, value, steps);
+	} else {
+		zwlr_virtual_pointer_v1_axis(wlr->pointer, wlTS(input->wl_ctx), axis, value);
+	}
+}
 static void mouse_wheel(struct wlInput *input, signed short dx, signed short dy)
 {
 	struct state_wlr *wlr = input->state;
 	//we are a wheel, after all
 	zwlr_virtual_pointer_v1_axis_source(wlr->pointer, 0);
-	if (dx < 0) {
-		zwlr_virtual_pointer_v1_axis_discrete(wlr->pointer, wlTS(input->wl_ctx), 1, wl_fixed_from_int(15), wlr->wheel_mult);
-	}else if (dx > 0) {
-		zwlr_virtual_pointer_v1_axis_discrete(wlr->pointer, wlTS(input->wl_ctx), 1, wl_fixed_from_int(-15), -1 * wlr->wheel_mult);
-	}
-	if (dy < 0) {
-		zwlr_virtual_pointer_v1_axis_discrete(wlr->pointer, wlTS(input->wl_ctx), 0, wl_fixed_from_int(15), wlr->wheel_mult);
-	} else if (dy > 0) {
-		zwlr_virtual_pointer_v1_axis_discrete(wlr->pointer, wlTS(input->wl_ctx), 0, wl_fixed_from_int(-15), -1 * wlr->wheel_mult);
-	}
+	wheel_axis(input, 1, dx);
+	wheel_axis(input, 0, dy);
 	zwlr_virtual_pointer_v1_frame(wlr->pointer);
 	wlDisplayFlush(input->wl_ctx);
 }
@@ -91,7 +258,7 @@ bool wlInputInitWlr(struct wlContext *ctx)
 	if (!(ctx->pointer_manager && ctx->keyboard_manager)) {
 		return false;
 	}
-	wlr = xmalloc(sizeof(*wlr));
+	wlr = xcalloc(1, sizeof(*wlr));
 	wlr->pointer = zwlr_virtual_pointer_manager_v1_create_virtual_pointer(ctx->pointer_manager, ctx->seat);
 
 	wlr->keyboard = zwp_virtual_keyboard_manager_v1_create_virtual_keyboard(ctx->keyboard_manager, ctx->seat);
@@ -112,6 +279,9 @@ bool wlInputInitWlr(struct wlContext *ctx)
 		.mouse_wheel = mouse_wheel,
 		.key = key,
 		.key_map = key_map,
+		.key_spare = key_spare,
+		.key_spare_commit = key_spare_commit,
+		.key_mods = key_mods,
 	};
 	wlLoadButtonMap(ctx);
 	logInfo("Using wlroots virtual input protocols");
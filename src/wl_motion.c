@@ -0,0 +1,208 @@
+/* jitter buffer for pointer motion
+ *
+ * Over a lossy link, motion arrives in clumps, and injecting it as it comes
+ * makes the cursor stutter. With motion-buffer/enable, motion is played out at
+ * the pace it usually arrives at, held back by up to a target delay worked out
+ * from how irregularly it has been arriving (the same way RTP estimates
+ * interarrival jitter), and handed on once per frame of the fastest output,
+ * the latest position winning within a frame. Anything
+ * else -- buttons, keys, the wheel -- lets whatever motion is held go first,
+ * so that it still lands where it was meant to. */
+#include "wayland.h"
+#include "latency.h"
+#include "metrics.h"
+#include "log.h"
+
+/* arrivals further apart than this mean the pointer stopped, not jitter */
+#define MOTION_STREAM_MAX 100000000
+/* frame rate to assume without an output that says otherwise */
+#define MOTION_DEFAULT_RATE 60
+
+void wlMotionInit(struct wlContext *ctx)
+{
+	struct wlMotion *m = &ctx->motion;
+	long min, max, rate;
+
+	*m = (struct wlMotion){0};
+	if (!(m->enable = configTryBool("motion-buffer/enable", false)))
+		return;
+	min = configTryLong("motion-buffer/min_delay", 2);
+	max = configTryLong("motion-buffer/max_delay", 20);
+	rate = configTryLong("motion-buffer/rate", 0);
+	if (min < 0 || max < min) {
+		logWarn("motion-buffer delays must satisfy 0 <= min_delay <= max_delay");
+		min = 2;
+		max = 20;
+	}
+	m->min_delay = min * 1000000;
+	m->max_delay = max * 1000000;
+	m->delay = m->min_delay;
+	m->rate = rate > 0 ? rate * 1000 : 0;
+	logInfo("Buffering motion by %ld to %ld ms", min, max);
+}
+
+/* once per frame of the fastest output, in ns */
+static uint64_t frame_period(struct wlContext *ctx)
+{
+	struct wlOutput *output;
+	int32_t rate = ctx->motion.rate;
+
+	if (!rate) {
+		for (output = ctx->outputs; output; output = output->next) {
+			if (output->refresh > rate)
+				rate = output->refresh;
+		}
+	}
+	if (!rate)
+		rate = MOTION_DEFAULT_RATE * 1000;
+	/* refresh is in mHz */
+	return 1000000000000ULL / rate;
+}
+
+static void inject(struct wlContext *ctx, bool rel, int x, int y)
+{
+	if (ctx->input.paused)
+		return;
+	metricsAdd(&metrics.motion_emitted, 1);
+	if (rel) {
+		ctx->input.mouse_rel_motion(&ctx->input, x, y);
+	} else {
+		ctx->input.mouse_motion(&ctx->input, x, y);
+	}
+}
+
+/* hand on everything due by a given time, merging what can be merged: only
+ * the last of a run of absolute positions matters, and a run of relative
+ * moves adds up */
+static void emit(struct wlContext *ctx, uint64_t now)
+{
+	struct wlMotion *m = &ctx->motion;
+	struct wlMotionSample *s, run = {0};
+	bool have_run = false;
+
+	while (m->count) {
+		s = m->queue + m->head;
+		if (s->due > now)
+			break;
+		metricsAdd(&metrics.motion_held_ns, now - s->arrival);
+		if (have_run && s->rel == run.rel) {
+			if (s->rel) {
+				run.x += s->x;
+				run.y += s->y;
+			} else {
+				run.x = s->x;
+				run.y = s->y;
+			}
+			metricsAdd(&metrics.motion_merged, 1);
+		} else {
+			if (have_run)
+				inject(ctx, run.rel, run.x, run.y);
+			run = *s;
+			have_run = true;
+		}
+		m->head = (m->head + 1) % WL_MOTION_QUEUE;
+		--m->count;
+	}
+	if (have_run)
+		inject(ctx, run.rel, run.x, run.y);
+}
+
+/* keep track of how irregularly motion arrives, and so how long to hold it */
+static void estimate(struct wlMotion *m, uint64_t arrival)
+{
+	uint64_t gap, dev;
+
+	gap = arrival - m->last_arrival;
+	if (!m->last_arrival || arrival < m->last_arrival || gap > MOTION_STREAM_MAX) {
+		m->last_arrival = arrival;
+		return;
+	}
+	m->last_arrival = arrival;
+	m->interval = m->interval ? (m->interval * 7 + gap) / 8 : gap;
+	dev = gap > m->interval ? gap - m->interval : m->interval - gap;
+	m->jitter += ((int64_t)dev - (int64_t)m->jitter) / 16;
+	/* enough to cover most of the spread, within bounds */
+	m->delay = m->jitter * 2;
+	if (m->delay < m->min_delay)
+		m->delay = m->min_delay;
+	if (m->delay > m->max_delay)
+		m->delay = m->max_delay;
+	metricsSet(&metrics.motion_jitter_ns, m->jitter);
+	metricsSet(&metrics.motion_delay_ns, m->delay);
+}
+
+bool wlMotionQueue(struct wlContext *ctx, bool rel, int x, int y)
+{
+	struct wlMotion *m = &ctx->motion;
+	uint64_t now, due;
+
+	if (!m->enable)
+		return false;
+	now = osGetMonoNs();
+	/* irregularity is judged by when it reached us, but the schedule by
+	 * when it would have, had a burst not been held up */
+	estimate(m, latencyState.arrival ? latencyState.arrival : now);
+	/* played out at the usual pace, holding nothing for longer than the
+	 * jitter calls for */
+	due = (latencyState.event_time ? latencyState.event_time : now) + m->min_delay;
+	if (m->last_due && due < m->last_due + m->interval)
+		due = m->last_due + m->interval;
+	if (due > now + m->delay)
+		due = now + m->delay;
+	m->last_due = due;
+	if (m->count == WL_MOTION_QUEUE) {
+		logDbg("Motion buffer full, letting the oldest go early");
+		emit(ctx, m->queue[m->head].due);
+	}
+	m->queue[(m->head + m->count++) % WL_MOTION_QUEUE] = (struct wlMotionSample){
+		.arrival = now,
+		.due = due,
+		.rel = rel,
+		.x = x,
+		.y = y,
+	};
+	metricsAdd(&metrics.motion_buffered, 1);
+	return true;
+}
+
+void wlMotionFlush(struct wlContext *ctx)
+{
+	if (ctx->motion.count)
+		emit(ctx, UINT64_MAX);
+	/* and what comes after needn't wait behind it */
+	ctx->motion.last_due = 0;
+}
+
+int wlMotionTimeout(struct wlContext *ctx, int timeout)
+{
+	struct wlMotion *m = &ctx->motion;
+	uint64_t now, due;
+	int ms;
+
+	if (!m->count)
+		return timeout;
+	due = m->queue[m->head].due;
+	if (due < m->next_tick)
+		due = m->next_tick;
+	now = osGetMonoNs();
+	ms = now < due ? (due - now + 999999) / 1000000 : 0;
+	return (timeout < 0 || ms < timeout) ? ms : timeout;
+}
+
+void wlMotionRun(struct wlContext *ctx)
+{
+	struct wlMotion *m = &ctx->motion;
+	uint64_t now, period;
+
+	if (!m->count)
+		return;
+	now = osGetMonoNs();
+	if (now < m->next_tick || now < m->queue[m->head].due)
+		return;
+	emit(ctx, now);
+	/* keep to the frame rate from here, rather than from whenever the
+	 * poll happened to wake up */
+	period = frame_period(ctx);
+	m->next_tick = (m->next_tick && now - m->next_tick < period) ?
+		m->next_tick + period : now + period;
+}
@@ -0,0 +1,187 @@
+/* check that key, motion and button events don't allocate once warmed up
+ *
+ * A protocol trace is written out and replayed through the callbacks and the
+ * null backend, the same way waynergy -R would, counting every malloc(),
+ * calloc() and realloc() made by our own code (with the --wrap link options).
+ * The first pass over the events is allowed to allocate, as buffers grow to
+ * their working size; the second pass must not. Given "thread", events go
+ * through the injection thread, as with inject/thread. */
+#include "../include/os.h"
+#include "../include/log.h"
+#include "../include/config.h"
+#include "../include/uSynergy.h"
+#include "../include/wayland.h"
+#include "../include/net.h"
+#include "../include/trace.h"
+#include "../include/inject.h"
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PASS_EVENTS 4096
+
+uSynergyContext synContext;
+struct wlContext wlContext;
+struct synNetContext synNetContext;
+
+static uint64_t test_allocs;
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void *__wrap_malloc(size_t size)
+{
+	__atomic_add_fetch(&test_allocs, 1, __ATOMIC_RELAXED);
+	return __real_malloc(size);
+}
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	__atomic_add_fetch(&test_allocs, 1, __ATOMIC_RELAXED);
+	return __real_calloc(nmemb, size);
+}
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	__atomic_add_fetch(&test_allocs, 1, __ATOMIC_RELAXED);
+	return __real_realloc(ptr, size);
+}
+
+/* events seen, and the allocation count over the second pass */
+static uint64_t events;
+static uint64_t pass_start;
+static uint64_t pass_end;
+static uint64_t pass_events;
+
+static void event(void)
+{
+	if (++events == PASS_EVENTS) {
+		pass_start = test_allocs;
+	} else if (events > PASS_EVENTS) {
+		pass_end = test_allocs;
+		++pass_events;
+	}
+}
+
+static void mouse_button_down_cb(uSynergyCookie cookie, enum uSynergyMouseButton button)
+{
+	injectMouseButton(button, 1);
+	event();
+}
+static void mouse_button_up_cb(uSynergyCookie cookie, enum uSynergyMouseButton button)
+{
+	injectMouseButton(button, 0);
+	event();
+}
+static void mouse_move_cb(uSynergyCookie cookie, bool rel, int16_t x, int16_t y)
+{
+	if (rel) {
+		injectMouseRelativeMotion(x, y);
+	} else {
+		injectMouseMotion(x, y);
+	}
+	event();
+}
+static void key_cb(uSynergyCookie cookie, uint16_t key, uint16_t id, uint16_t mod, bool down, bool repeat)
+{
+	injectKey(key, id, down);
+	event();
+}
+
+static size_t put_pkt(uint8_t *buf, const char *id, const uint8_t *payload, size_t len)
+{
+	uint32_t pkt_len = strlen(id) + len;
+
+	buf[0] = pkt_len >> 24;
+	buf[1] = pkt_len >> 16;
+	buf[2] = pkt_len >> 8;
+	buf[3] = pkt_len;
+	memcpy(buf + 4, id, strlen(id));
+	memcpy(buf + 4 + strlen(id), payload, len);
+	return 4 + pkt_len;
+}
+
+/* both passes, a few packets to a read as they would arrive */
+static bool write_trace(const char *path)
+{
+	static const uint8_t hello[] = {0, 1, 0, 6};
+	uint8_t buf[256];
+	size_t len;
+	int i;
+
+	if (!traceRecordOpen(path))
+		return false;
+	traceRecordConnect();
+	traceRecordRecv(buf, put_pkt(buf, "Barrier", hello, sizeof(hello)));
+	for (i = 0; i < PASS_EVENTS * 2; i += 8) {
+		len = 0;
+		len += put_pkt(buf + len, "DKDN", (uint8_t[]){0, 'a', 0, 0, 0, 38}, 6);
+		len += put_pkt(buf + len, "DKUP", (uint8_t[]){0, 'a', 0, 0, 0, 38}, 6);
+		len += put_pkt(buf + len, "DKDN", (uint8_t[]){0, 0, 0, 0, 0, 40}, 6);
+		len += put_pkt(buf + len, "DKUP", (uint8_t[]){0, 0, 0, 0, 0, 40}, 6);
+		len += put_pkt(buf + len, "DMMV", (uint8_t[]){0, i % 100, 0, 100}, 4);
+		len += put_pkt(buf + len, "DMRM", (uint8_t[]){0, 1, 0xFF, 0xFF}, 4);
+		len += put_pkt(buf + len, "DMDN", (uint8_t[]){1}, 1);
+		len += put_pkt(buf + len, "DMUP", (uint8_t[]){1}, 1);
+		traceRecordRecv(buf, len);
+	}
+	close(traceFd);
+	traceFd = -1;
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	char path[] = "/tmp/waynergy-alloc-XXXXXX";
+	bool threaded = argc > 1 && !strcmp(argv[1], "thread");
+	uint64_t allocs;
+	int fd;
+
+	logInit(LOG_WARN, NULL);
+	osConfigPathOverride = "./config";
+	if (!configInitINI())
+		return 1;
+	if ((fd = mkstemp(path)) == -1) {
+		logPErr("mkstemp");
+		return 1;
+	}
+	close(fd);
+	if (!write_trace(path))
+		goto error;
+
+	wlContext.headless = true;
+	wlContext.uinput_fd[0] = -1;
+	wlContext.uinput_fd[1] = -1;
+	if (!wlSetup(&wlContext, 1920, 1080, "null")) {
+		logErr("Could not set up null backend");
+		goto error;
+	}
+	wlKeySetId(&wlContext, 'a', 38);
+	if (!injectStart(&wlContext, threaded, NULL))
+		goto error;
+
+	uSynergyInit(&synContext);
+	synContext.m_clientName = "alloc";
+	synContext.m_clientWidth = 1920;
+	synContext.m_clientHeight = 1080;
+	synContext.m_mouseButtonDownCallback = mouse_button_down_cb;
+	synContext.m_mouseButtonUpCallback = mouse_button_up_cb;
+	synContext.m_mouseMoveCallback = mouse_move_cb;
+	synContext.m_keyboardCallback = key_cb;
+	synNetContext.fd = -1;
+	if (!traceReplay(&synContext, path, true))
+		goto error;
+	unlink(path);
+	/* what the injection thread did after the last event was parsed */
+	injectStop();
+	if (threaded)
+		pass_end = test_allocs;
+
+	if (pass_events != PASS_EVENTS) {
+		logErr("Saw %" PRIu64 " events, expected %d", events, PASS_EVENTS * 2);
+		return 1;
+	}
+	allocs = pass_end - pass_start;
+	printf("%" PRIu64 " allocations over %" PRIu64 " warm events\n", allocs, pass_events);
+	return allocs ? 1 : 0;
+error:
+	unlink(path);
+	return 1;
+}
@@ -0,0 +1,354 @@
+/* microbenchmarks for the hot paths, run through meson test --benchmark
+ *
+ * Each benchmark is run with an increasing number of operations until it
+ * takes long enough to time, then reported as ns/op and allocations/op. The
+ * allocation count only covers malloc(), calloc() and realloc() called from
+ * our own code, and only when linked with --wrap for those. */
+#include "../include/os.h"
+#include "../include/log.h"
+#include "../include/config.h"
+#include "../include/ssp.h"
+#include "../include/uSynergy.h"
+#include "../include/wayland.h"
+#include "../include/net.h"
+#include <inttypes.h>
+#include <string.h>
+
+#define BENCH_MIN_NS 200000000ULL
+#define BENCH_MAX_OPS 100000000ULL
+
+/* sig.c wants these, normally from main.c */
+uSynergyContext synContext;
+struct wlContext wlContext;
+struct synNetContext synNetContext;
+
+static uint64_t bench_allocs;
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void *__wrap_malloc(size_t size)
+{
+	++bench_allocs;
+	return __real_malloc(size);
+}
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	++bench_allocs;
+	return __real_calloc(nmemb, size);
+}
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	++bench_allocs;
+	return __real_realloc(ptr, size);
+}
+
+/* keep results from being optimized away */
+static volatile uint64_t sink;
+
+static uint8_t ssp_data[4096];
+
+static void bench_ssp_u16(uint64_t n)
+{
+	struct sspBuf buf = {.data = ssp_data, .len = sizeof(ssp_data)};
+	uint16_t v;
+
+	for (uint64_t i = 0; i < n; ++i) {
+		if (!sspNetU16(&buf, &v))
+			buf.pos = 0;
+		sink += v;
+	}
+}
+static void bench_ssp_u32(uint64_t n)
+{
+	struct sspBuf buf = {.data = ssp_data, .len = sizeof(ssp_data)};
+	uint32_t v;
+
+	for (uint64_t i = 0; i < n; ++i) {
+		if (!sspNetU32(&buf, &v))
+			buf.pos = 0;
+		sink += v;
+	}
+}
+static void bench_ssp_mem(uint64_t n)
+{
+	struct sspBuf buf = {.data = ssp_data, .len = sizeof(ssp_data)};
+	char v[16];
+
+	for (uint64_t i = 0; i < n; ++i) {
+		if (!sspMemMove(v, &buf, sizeof(v)))
+			buf.pos = 0;
+		sink += v[0];
+	}
+}
+
+/* protocol parsing, one packet type at a time */
+#define PROTO_COUNT 64
+static uint8_t proto_buf[PROTO_COUNT * 32];
+static size_t proto_len;
+
+static size_t put_pkt(uint8_t *buf, const char *id, const uint8_t *payload, size_t len)
+{
+	uint32_t pkt_len = strlen(id) + len;
+
+	buf[0] = pkt_len >> 24;
+	buf[1] = pkt_len >> 16;
+	buf[2] = pkt_len >> 8;
+	buf[3] = pkt_len;
+	memcpy(buf + 4, id, strlen(id));
+	memcpy(buf + 4 + strlen(id), payload, len);
+	return 4 + pkt_len;
+}
+
+static void proto_feed(const uint8_t *buf, size_t len)
+{
+	struct uSynergyBatch batch;
+	size_t used, out;
+
+	do {
+		used = uSynergyFeed(&synContext, buf, len, 0, &batch);
+		buf += used;
+		len -= used;
+		uSynergyOutput(&synContext, &out);
+		uSynergyOutputDone(&synContext, out);
+	} while ((len && used) || batch.more);
+}
+
+static bool proto_setup(void)
+{
+	static const uint8_t hello[] = {0, 1, 0, 6};
+	uint8_t buf[64];
+
+	uSynergyInit(&synContext);
+	synContext.m_clientName = "bench";
+	synContext.m_clientWidth = 1920;
+	synContext.m_clientHeight = 1080;
+	uSynergyStart(&synContext, 0);
+	proto_feed(buf, put_pkt(buf, "Barrier", hello, sizeof(hello)));
+	return synContext.m_hasReceivedHello;
+}
+
+static void proto_prepare(const char *id, const uint8_t *payload, size_t len)
+{
+	proto_len = 0;
+	for (int i = 0; i < PROTO_COUNT; ++i) {
+		proto_len += put_pkt(proto_buf + proto_len, id, payload, len);
+	}
+}
+static void proto_run(uint64_t n)
+{
+	for (uint64_t i = 0; i < n; i += PROTO_COUNT) {
+		proto_feed(proto_buf, proto_len);
+	}
+}
+static void bench_proto_dmmv(uint64_t n)
+{
+	proto_prepare("DMMV", (uint8_t[]){0, 100, 0, 100}, 4);
+	proto_run(n);
+}
+static void bench_proto_dmrm(uint64_t n)
+{
+	proto_prepare("DMRM", (uint8_t[]){0, 1, 0xFF, 0xFF}, 4);
+	proto_run(n);
+}
+static void bench_proto_dmwm(uint64_t n)
+{
+	proto_prepare("DMWM", (uint8_t[]){0, 0, 0, 120}, 4);
+	proto_run(n);
+}
+static void bench_proto_dkdn(uint64_t n)
+{
+	proto_prepare("DKDN", (uint8_t[]){0, 'a', 0, 0, 0, 38}, 6);
+	proto_run(n);
+}
+static void bench_proto_dkup(uint64_t n)
+{
+	proto_prepare("DKUP", (uint8_t[]){0, 'a', 0, 0, 0, 38}, 6);
+	proto_run(n);
+}
+static void bench_proto_calv(uint64_t n)
+{
+	proto_prepare("CALV", NULL, 0);
+	proto_run(n);
+}
+static void bench_proto_dsop(uint64_t n)
+{
+	proto_prepare("DSOP", (uint8_t[]){0, 0, 0, 2, 'H', 'A', 'R', 'T', 0, 0, 0x0B, 0xB8}, 12);
+	proto_run(n);
+}
+
+/* key mapping, through the null backend */
+static bool key_setup(void)
+{
+	wlContext.headless = true;
+	wlContext.uinput_fd[0] = -1;
+	wlContext.uinput_fd[1] = -1;
+	if (!wlSetup(&wlContext, 1920, 1080, "null"))
+		return false;
+	wlKeySetId(&wlContext, 'a', 38);
+	return true;
+}
+static void bench_key_raw(uint64_t n)
+{
+	for (uint64_t i = 0; i < n; ++i) {
+		wlKey(&wlContext, 38, 0, !(i % 2));
+	}
+}
+static void bench_key_id(uint64_t n)
+{
+	for (uint64_t i = 0; i < n; ++i) {
+		wlKey(&wlContext, 0, 'a', !(i % 2));
+	}
+}
+
+/* clipboard, a megabyte at a time */
+#define CLIP_LEN (1024 * 1024)
+static char *clip_data;
+
+static bool clip_setup(void)
+{
+	size_t out;
+
+	if (!proto_setup())
+		return false;
+	clip_data = malloc(CLIP_LEN);
+	for (size_t i = 0; i < CLIP_LEN; ++i) {
+		clip_data[i] = 'a' + i % 26;
+	}
+	uSynergyUpdateClipBuf(&synContext, 0, CLIP_LEN, clip_data);
+	uSynergyOutput(&synContext, &out);
+	uSynergyOutputDone(&synContext, out);
+	return true;
+}
+static void bench_clip_contains(uint64_t n)
+{
+	size_t out;
+
+	/* the same data again, so it is only compared */
+	for (uint64_t i = 0; i < n; ++i) {
+		uSynergyUpdateClipBuf(&synContext, 0, CLIP_LEN, clip_data);
+		uSynergyOutput(&synContext, &out);
+		uSynergyOutputDone(&synContext, out);
+	}
+}
+static void bench_clip_send(uint64_t n)
+{
+	size_t out;
+
+	for (uint64_t i = 0; i < n; ++i) {
+		uSynergySendClipboard(&synContext, 0, CLIP_LEN, (unsigned char *)clip_data);
+		uSynergyOutput(&synContext, &out);
+		uSynergyOutputDone(&synContext, out);
+	}
+}
+
+static bool config_setup(void)
+{
+	osConfigPathOverride = "./config";
+	return configInitINI();
+}
+static void bench_config_string(uint64_t n)
+{
+	char *s;
+
+	for (uint64_t i = 0; i < n; ++i) {
+		s = configTryString("str", NULL);
+		sink += s[0];
+		free(s);
+	}
+}
+static void bench_config_long(uint64_t n)
+{
+	for (uint64_t i = 0; i < n; ++i) {
+		sink += configTryLong("long", 0);
+	}
+}
+static void bench_config_missing(uint64_t n)
+{
+	for (uint64_t i = 0; i < n; ++i) {
+		sink += configTryBool("section/missing", false);
+	}
+}
+
+static bool log_setup(void)
+{
+	logSetLevel(LOG_WARN);
+	return true;
+}
+static void bench_log_filtered(uint64_t n)
+{
+	for (uint64_t i = 0; i < n; ++i) {
+		logDbg("Filtered message %" PRIu64, i);
+	}
+}
+
+static const struct {
+	const char *name;
+	bool (*setup)(void);
+	void (*run)(uint64_t);
+} benches[] = {
+	{"ssp/u16", NULL, bench_ssp_u16},
+	{"ssp/u32", NULL, bench_ssp_u32},
+	{"ssp/mem16", NULL, bench_ssp_mem},
+	{"proto/DMMV", proto_setup, bench_proto_dmmv},
+	{"proto/DMRM", proto_setup, bench_proto_dmrm},
+	{"proto/DMWM", proto_setup, bench_proto_dmwm},
+	{"proto/DKDN", proto_setup, bench_proto_dkdn},
+	{"proto/DKUP", proto_setup, bench_proto_dkup},
+	{"proto/CALV", proto_setup, bench_proto_calv},
+	{"proto/DSOP", proto_setup, bench_proto_dsop},
+	{"key/raw", key_setup, bench_key_raw},
+	{"key/id", NULL, bench_key_id},
+	{"clip/contains", clip_setup, bench_clip_contains},
+	{"clip/send", NULL, bench_clip_send},
+	{"config/string", config_setup, bench_config_string},
+	{"config/long", NULL, bench_config_long},
+	{"config/missing", NULL, bench_config_missing},
+	{"log/filtered", log_setup, bench_log_filtered},
+};
+
+static void run(int i)
+{
+	uint64_t n = 1, start, elapsed, allocs;
+
+	for (;;) {
+		allocs = bench_allocs;
+		start = osGetMonoNs();
+		benches[i].run(n);
+		elapsed = osGetMonoNs() - start;
+		allocs = bench_allocs - allocs;
+		if (elapsed >= BENCH_MIN_NS || n >= BENCH_MAX_OPS)
+			break;
+		n *= elapsed < BENCH_MIN_NS / 100 ? 10 : 2;
+	}
+	printf("%-16s %10" PRIu64 " ops %12.1f ns/op %10.2f allocs/op\n",
+			benches[i].name,
+			n,
+			(double)elapsed / n,
+			(double)allocs / n);
+}
+
+int main(int argc, char **argv)
+{
+	size_t prefix = argc > 1 ? strlen(argv[1]) : 0;
+	bool ready = true;
+	int ret = 0;
+
+	logInit(LOG_WARN, NULL);
+	/* the config is needed by most of the rest */
+	config_setup();
+	for (int i = 0; i < sizeof(ssp_data); ++i) {
+		ssp_data[i] = i;
+	}
+	for (int i = 0; i < sizeof(benches)/sizeof(*benches); ++i) {
+		if (prefix && strncmp(benches[i].name, argv[1], prefix))
+			continue;
+		/* a benchmark without setup relies on the one before it */
+		if (benches[i].setup && !(ready = benches[i].setup())) {
+			logErr("Setup for %s failed", benches[i].name);
+			ret = 1;
+		}
+		if (ready)
+			run(i);
+	}
+	return ret;
+}